@@ -1,6 +1,7 @@
 #include <communication/async_zmq.h>
 #include <communication/netstats.h>
 #include <unistd.h>
+#include <algorithm>
 #include <climits>
 #include <iostream>
 #include <thread>
@@ -8,12 +9,22 @@
 //------------------------------------------------------------------------------
 std::atomic<bool> AsyncZmq::die(false);
 std::mutex AsyncZmq::callbackmap_mtx_;
-std::map<int, AsyncZmq::CallbackType> AsyncZmq::callbacks_;
+std::shared_ptr<const AsyncZmq::CallbackMap> AsyncZmq::callbacks_(
+    new AsyncZmq::CallbackMap());
+std::atomic<unsigned> AsyncZmq::callbacks_version_(0);
+std::mutex AsyncZmq::instances_mtx_;
+std::set<AsyncZmq*> AsyncZmq::instances_;
 //------------------------------------------------------------------------------
-AsyncZmq::AsyncZmq(const std::string& endpoint, const std::string& idprefix)
-    : context_(1),
+AsyncZmq::AsyncZmq(const std::string& endpoint, const std::string& idprefix,
+                   unsigned workers)
+    : wakeup_pending_(false),
+      workers_(workers ? workers
+                       : std::max(1u, std::thread::hardware_concurrency())),
+      context_(1),
       frontend_(context_, ZMQ_ROUTER),
-      backend_(context_, ZMQ_ROUTER) {
+      backend_(context_, ZMQ_ROUTER),
+      wakeup_in_(context_, ZMQ_PAIR),
+      wakeup_out_(context_, ZMQ_PAIR) {
     char hostname[HOST_NAME_MAX];
     gethostname(hostname, HOST_NAME_MAX);
     frontend_.set(zmq::sockopt::routing_id, idprefix + hostname);
@@ -21,15 +32,83 @@ AsyncZmq::AsyncZmq(const std::string& endpoint, const std::string& idprefix)
     frontend_.connect("tcp://" + endpoint);
     NetStats::add_bytes_out(frontend_.get(zmq::sockopt::routing_id).size());
     backend_.bind("ipc://backend.ipc");
+    wakeup_in_.bind("inproc://wakeup");  // inproc: bind before connect
+    wakeup_out_.connect("inproc://wakeup");
+
+    std::unique_lock<std::mutex> lock(instances_mtx_);
+    instances_.insert(this);
+}
+
+//------------------------------------------------------------------------------
+AsyncZmq::~AsyncZmq() {
+    std::unique_lock<std::mutex> lock(instances_mtx_);
+    instances_.erase(this);
+}
+
+//------------------------------------------------------------------------------
+void AsyncZmq::finish() {
+    die = true;
+    std::unique_lock<std::mutex> lock(instances_mtx_);
+    for (AsyncZmq* instance : instances_) {
+        instance->wakeup();  // if one is pending, the loop sees die after it
+    }
 }
 
 //------------------------------------------------------------------------------
-void AsyncZmq::finish() { die = true; }
+// One signal per batch: further pushes find it pending and only queue. The
+// loop may clear the flag before its setter got to send, and finish signals
+// regardless, so sends to wakeup_out_ still take turns.
+//------------------------------------------------------------------------------
+void AsyncZmq::wakeup() {
+    if (wakeup_pending_.exchange(true)) return;
+    std::lock_guard<std::mutex> lock(wakeup_mtx_);
+    wakeup_out_.send(zmq::const_buffer("", 0), zmq::send_flags::dontwait);
+}
+
+//------------------------------------------------------------------------------
+// Cleared after the signal is received, before the queue is read: a pusher
+// either sees it cleared and signals again, or its message is already visible
+// (its exchange is what this one reads, or precedes it)
+//------------------------------------------------------------------------------
+void AsyncZmq::drain_wakeups() {
+    zmq::message_t m;
+    while (wakeup_in_.recv(m, zmq::recv_flags::dontwait)) {
+    }
+    wakeup_pending_.exchange(false);
+}
 
 //------------------------------------------------------------------------------
 void AsyncZmq::add_callback(int id, CallbackType cb) {
     std::unique_lock<std::mutex> lock(callbackmap_mtx_);
-    callbacks_[id] = cb;
+    std::shared_ptr<CallbackMap> updated(new CallbackMap(*callbacks_));
+    (*updated)[id] = cb;
+    callbacks_ = updated;
+    ++callbacks_version_;
+}
+
+//------------------------------------------------------------------------------
+bool AsyncZmq::remove_callback(int id) {
+    std::unique_lock<std::mutex> lock(callbackmap_mtx_);
+    std::shared_ptr<CallbackMap> updated(new CallbackMap(*callbacks_));
+    updated->erase(id);
+    callbacks_ = updated;
+    ++callbacks_version_;
+    return updated->empty();
+}
+
+//------------------------------------------------------------------------------
+// Each worker keeps the map it last saw and only takes the lock to replace it
+//------------------------------------------------------------------------------
+AsyncZmq::CallbackType AsyncZmq::find_callback(int rank) {
+    thread_local std::shared_ptr<const CallbackMap> map;
+    thread_local unsigned version = 0;
+    if (!map || version != callbacks_version_.load()) {
+        std::unique_lock<std::mutex> lock(callbackmap_mtx_);
+        map = callbacks_;
+        version = callbacks_version_.load();
+    }
+    CallbackMap::const_iterator it = map->find(rank);
+    return it == map->end() ? CallbackType() : it->second;
 }
 
 //------------------------------------------------------------------------------
@@ -50,11 +129,7 @@ void AsyncZmq::worker_thread(int id) {
         std::string prefix = "internal";
         if (msg[1].rfind(prefix) == 0) {
             int rank = std::stoi(msg[1].substr(prefix.size()));
-            CallbackType callback;
-            {
-                std::unique_lock<std::mutex> lock(callbackmap_mtx_);
-                callback = callbacks_[rank];
-            }
+            CallbackType callback = find_callback(rank);
             // print("W%d from %s to r%d\n", id, msg[0].c_str(), rank);
             if (callback) {
                 Datatype t;
@@ -74,18 +149,15 @@ void AsyncZmq::worker_thread(int id) {
     }
 }
 
+//------------------------------------------------------------------------------
+// Sends all that is queued. Nothing leaves before the server is known: its
+// probe wakes the loop anyway.
 //------------------------------------------------------------------------------
 size_t AsyncZmq::send_standing_messages() {
     size_t ret = 0;
     if (serverid_.empty()) return ret;
-    while (true) {
-        std::pair<int, std::string> next;
-        {
-            std::unique_lock<std::mutex> lock(oqueue_mtx_);
-            if (outqueue_.empty()) break;
-            outqueue_.front().swap(next);
-            outqueue_.pop();
-        }
+    std::pair<int, std::string> next;
+    while (outqueue_.pop(next)) {
         ret +=
             send_more(serverid_, false);  // doesn't count serverid as data sent
         std::string empty;
@@ -175,55 +247,45 @@ std::vector<std::string> AsyncZmq::internal_recv_multipart(
 
 //------------------------------------------------------------------------------
 void AsyncZmq::polling_loop() {
-    int thread_count = 16;
-    std::thread* t[thread_count];
-    for (int i = 0; i < thread_count; ++i) {
-        t[i] = new std::thread(AsyncZmq::worker_thread, i);
+    std::vector<std::thread> t;
+    for (unsigned i = 0; i < workers_; ++i) {
+        t.emplace_back(AsyncZmq::worker_thread, i);
     }
 
     while (!die) {
         send_standing_messages();
-        zmq::pollitem_t items[] = {{backend_, 0, ZMQ_POLLIN, 0},
+        zmq::pollitem_t items[] = {{wakeup_in_, 0, ZMQ_POLLIN, 0},
+                                   {backend_, 0, ZMQ_POLLIN, 0},
                                    {frontend_, 0, ZMQ_POLLIN, 0}};
 
-        int nevents,
-            timeout = 200;  // in ms, -1 for indefinetely (not good for standing
-                            // messages)
-        if (worker_queue_.empty()) {  // if no worker, just check backend
-            nevents = zmq::poll(&items[0], 1, timeout);
-        } else {
-            nevents = zmq::poll(&items[0], 2, timeout);
-        }
-        send_standing_messages();
-
-        if (nevents <= 0) continue;
+        // if no worker, just check backend
+        int nitems = worker_queue_.empty() ? 2 : 3;
+        if (zmq::poll(&items[0], nitems, -1) <= 0) continue;
 
         if (items[0].revents & ZMQ_POLLIN) {
-            handle_backend();
+            drain_wakeups();
         }
         if (items[1].revents & ZMQ_POLLIN) {
+            handle_backend();
+        }
+        if (items[2].revents & ZMQ_POLLIN) {
             handle_frontend();
         }
     }
+    send_standing_messages();  // goodbyes queued along with finish
 
-    for (int i = 0; i < thread_count; ++i) {
-        t[i]->join();
-        delete t[i];
-    }
+    for (std::thread& worker : t) worker.join();
 }
 
 //------------------------------------------------------------------------------
 void AsyncZmq::announce_completion(int rank, char t) {
-    {
-        std::unique_lock<std::mutex> lock(oqueue_mtx_);
-        outqueue_.push(
-            std::make_pair(rank, pack(t + std::string("so long"), TEXT)));
-    }
-    callbacks_.erase(rank);
-    if (callbacks_.empty()) {
+    outqueue_.push(
+        std::make_pair(rank, pack(t + std::string("so long"), TEXT)));
+    wakeup();
+    if (remove_callback(rank)) {
         finish();
         // Job is done! Ask workers to kill themselves
-        for (int i = 0; i < 16; ++i) {
+        for (unsigned i = 0; i < workers_; ++i) {
             std::string address = "worker" + std::to_string(i);
             zmq_send_more(backend_, address, false);
             zmq_send_more(backend_, std::string(), false);
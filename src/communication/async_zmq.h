@@ -1,14 +1,28 @@
 #pragma once
 
+#include <threads/mpsc_queue.h>
+#include <atomic>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <queue>
+#include <set>
 #include <zmq/zmq.hpp>
 
+//------------------------------------------------------------------------------
+// The polling loop sleeps until there is network traffic or something to send:
+// push signals it through an inproc socket pair when the outgoing queue stops
+// being empty, and the loop then sends everything queued so far at once.
+// Pushing and finding a callback take no lock: the callback map is replaced
+// as a whole when it changes, and workers pick the new one up by its version.
+//------------------------------------------------------------------------------
 class AsyncZmq {
    public:
-    AsyncZmq(const std::string &endpoint, const std::string &idprefix);
+    // workers: threads running callbacks, 0 for one per core
+    AsyncZmq(const std::string &endpoint, const std::string &idprefix,
+             unsigned workers = 0);
+    ~AsyncZmq();
     typedef std::function<void(std::string &&)> CallbackType;
     template <typename T>
     size_t push(int id, const T &data);
@@ -26,22 +40,35 @@ class AsyncZmq {
     static void finish();
 
    private:
-    std::mutex oqueue_mtx_, iqueue_mtx_;
-    std::queue<std::pair<int, std::string>> outqueue_;
+    typedef std::map<int, CallbackType> CallbackMap;
+
+    std::mutex iqueue_mtx_;
+    MpscQueue<std::pair<int, std::string>> outqueue_;
+    std::atomic<bool> wakeup_pending_;  // cleared by the loop once signalled
+    unsigned workers_;
     zmq::context_t context_;
     zmq::socket_t frontend_, backend_;
+    zmq::socket_t wakeup_in_, wakeup_out_;  // poller side, pushers side
+    std::mutex wakeup_mtx_;                 // for wakeup_out_
     std::queue<std::string> worker_queue_;
     std::string serverid_;
 
     size_t recv_and_forward(const std::string &address);
     size_t send_standing_messages();
+    void wakeup();
+    void drain_wakeups();
 
     static void worker_thread(int id);
+    static CallbackType find_callback(int rank);
+    static bool remove_callback(int rank);  // true when none is left
     static std::vector<std::string> internal_recv_multipart(zmq::socket_t &w);
 
     static std::atomic<bool> die;
-    static std::mutex callbackmap_mtx_;
-    static std::map<int, CallbackType> callbacks_;
+    static std::mutex callbackmap_mtx_;  // writers only
+    static std::shared_ptr<const CallbackMap> callbacks_;
+    static std::atomic<unsigned> callbacks_version_;
+    static std::mutex instances_mtx_;
+    static std::set<AsyncZmq *> instances_;  // woken up by finish
 };
 
 #include <communication/async_zmq.hpp>
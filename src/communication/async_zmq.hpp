@@ -3,9 +3,11 @@
 //------------------------------------------------------------------------------
 template <typename T>
 size_t AsyncZmq::push(int id, const T &data) {
-    std::unique_lock<std::mutex> lock(oqueue_mtx_);
-    outqueue_.push(std::make_pair(id, pack(data)));
-    return outqueue_.back().second.size();
+    std::string packed(pack(data));
+    size_t ret = packed.size();
+    outqueue_.push(std::make_pair(id, std::move(packed)));
+    wakeup();
+    return ret;
 }
 
 //------------------------------------------------------------------------------
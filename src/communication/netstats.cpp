@@ -1,5 +1,13 @@
 #include <communication/netstats.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 std::atomic<size_t> NetStats::bytes_in(0), NetStats::bytes_out(0);
 //------------------------------------------------------------------------------
@@ -17,3 +25,154 @@ void NetStats::add_bytes_in(size_t n) {
 }
 
 //------------------------------------------------------------------------------
+// Per peer
+//------------------------------------------------------------------------------
+namespace {
+// Latencies in powers of two of us: bucket i holds [2^i, 2^(i+1)), 0 also
+// what is below. A clock behind the sender's gives negative ones, taken as 0.
+struct Histogram {
+    static const int kBuckets = 32;  // up to over an hour
+    Histogram() : count(0), sum(0), max(0) {
+        std::fill(buckets, buckets + kBuckets, 0);
+    }
+    void add(int64_t us) {
+        us = std::max(us, int64_t(0));
+        int i = 0;
+        while (i + 1 < kBuckets && (us >> (i + 1)) != 0) ++i;
+        ++buckets[i];
+        ++count;
+        sum += us;
+        max = std::max(max, us);
+    }
+    // Spread evenly within its bucket
+    double percentile(double p) const {
+        if (count == 0) return 0;
+        double rank = p * count, seen = 0;
+        for (int i = 0; i < kBuckets; ++i) {
+            if (buckets[i] == 0 || seen + buckets[i] < rank) {
+                seen += buckets[i];
+                continue;
+            }
+            double low = i == 0 ? 0 : double(int64_t(1) << i),
+                   high = double(int64_t(1) << (i + 1));
+            return std::min(low + (high - low) * (rank - seen) / buckets[i],
+                            double(max));
+        }
+        return max;
+    }
+
+    uint64_t buckets[kBuckets], count;
+    double sum;
+    int64_t max;
+};
+
+struct Peer {
+    Peer() : bytes_out(0), bytes_in(0), messages_out(0), messages_in(0) {}
+    uint64_t bytes_out, bytes_in, messages_out, messages_in;
+    Histogram latency;
+};
+
+std::mutex peers_mtx;
+std::map<std::string, Peer> peers;
+
+std::mutex dump_mtx;
+std::condition_variable dump_cv;
+std::thread *dump_thread = nullptr;
+bool dump_stop = false;
+}  // namespace
+
+//------------------------------------------------------------------------------
+int64_t NetStats::now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+//------------------------------------------------------------------------------
+void NetStats::sent_to(const std::string &peer, size_t bytes) {
+    std::lock_guard<std::mutex> lock(peers_mtx);
+    Peer &p = peers[peer];
+    p.bytes_out += bytes;
+    ++p.messages_out;
+}
+
+//------------------------------------------------------------------------------
+void NetStats::received_from(const std::string &peer, size_t bytes,
+                             int64_t sent) {
+    int64_t latency = now() - sent;
+    std::lock_guard<std::mutex> lock(peers_mtx);
+    Peer &p = peers[peer];
+    p.bytes_in += bytes;
+    ++p.messages_in;
+    p.latency.add(latency);
+}
+
+//------------------------------------------------------------------------------
+PeerTraffic NetStats::peer(const std::string &peer) {
+    PeerTraffic ret = {0, 0, 0, 0, 0, 0, 0, 0};
+    std::lock_guard<std::mutex> lock(peers_mtx);
+    auto it = peers.find(peer);
+    if (it == peers.end()) return ret;
+    const Peer &p = it->second;
+    const Histogram &h = p.latency;
+    ret.bytes_out = p.bytes_out;
+    ret.bytes_in = p.bytes_in;
+    ret.messages_out = p.messages_out;
+    ret.messages_in = p.messages_in;
+    ret.latency_mean = h.count ? h.sum / h.count / 1e3 : 0;
+    ret.latency_p50 = h.percentile(.5) / 1e3;
+    ret.latency_p99 = h.percentile(.99) / 1e3;
+    ret.latency_max = h.max / 1e3;
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// netstats;peer;bytesout;bytesin;msgsout;msgsin;latmean;latp50;latp99;latmax
+//------------------------------------------------------------------------------
+std::string NetStats::dump() {
+    std::vector<std::string> ids;
+    {
+        std::lock_guard<std::mutex> lock(peers_mtx);
+        for (const auto &p : peers) ids.push_back(p.first);
+    }
+    std::stringstream ss;
+    for (const auto &id : ids) {
+        PeerTraffic t = peer(id);
+        ss << "netstats;" << id << ";" << t.bytes_out << ";" << t.bytes_in
+           << ";" << t.messages_out << ";" << t.messages_in << ";"
+           << t.latency_mean << ";" << t.latency_p50 << ";" << t.latency_p99
+           << ";" << t.latency_max << "\n";
+    }
+    return ss.str();
+}
+
+//------------------------------------------------------------------------------
+void NetStats::start_dumps(unsigned period) {
+    std::lock_guard<std::mutex> lock(dump_mtx);
+    if (dump_thread || period == 0) return;
+    dump_stop = false;
+    dump_thread = new std::thread([period]() {
+        std::unique_lock<std::mutex> lock(dump_mtx);
+        while (!dump_cv.wait_for(lock, std::chrono::seconds(period),
+                                 []() { return dump_stop; })) {
+            std::cerr << dump() << std::flush;
+        }
+    });
+}
+
+//------------------------------------------------------------------------------
+void NetStats::stop_dumps() {
+    std::thread *t;
+    {
+        std::lock_guard<std::mutex> lock(dump_mtx);
+        t = dump_thread;
+        dump_thread = nullptr;
+        dump_stop = true;
+    }
+    dump_cv.notify_all();
+    if (t == nullptr) return;
+    t->join();
+    delete t;
+}
+
+//------------------------------------------------------------------------------
@@ -1,11 +1,27 @@
 #pragma once
+#include <peer_traffic.h>
 #include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <string>
 
 class NetStats {
    public:
     static void add_bytes_out(size_t);
     static void add_bytes_in(size_t);
 
+    // Per peer, by node id. Transports stamp messages with now() as they are
+    // sent and hand the stamp to received_from.
+    static void sent_to(const std::string &peer, size_t bytes);
+    static void received_from(const std::string &peer, size_t bytes,
+                              int64_t sent);
+    static PeerTraffic peer(const std::string &peer);  // zeros: never seen
+    static std::string dump();  // a line per peer
+    static int64_t now();       // us, wall clock: hosts share it
+
+    // dump on stderr every period seconds, until stop_dumps
+    static void start_dumps(unsigned period);
+    static void stop_dumps();
+
     static std::atomic<size_t> bytes_out, bytes_in;
 };
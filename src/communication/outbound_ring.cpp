@@ -0,0 +1,116 @@
+#include <communication/outbound_ring.h>
+#include <communication_manager.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+
+OutboundRing *OutboundDrain::ring(nullptr);
+size_t OutboundDrain::capacity(0);
+std::mutex OutboundDrain::mtx;
+std::condition_variable OutboundDrain::wakeup_cv, OutboundDrain::progress_cv;
+bool OutboundDrain::woken(false), OutboundDrain::die(false),
+    OutboundDrain::gone(false);
+std::thread *OutboundDrain::thread(nullptr);
+
+//------------------------------------------------------------------------------
+OutboundRing *OutboundDrain::init(size_t bytes) {
+    capacity = bytes & ~size_t(7);
+    void *memory = aligned_alloc(64, (OutboundRing::bytes(capacity) + 63) &
+                                         ~size_t(63));
+    if (memory == nullptr) {
+        std::cerr << "Could not allocate the outbound ring" << std::endl;
+        abort();
+    }
+    ring = new (memory) OutboundRing();
+    ring->head = ring->tail = 0;
+    ring->sleeping = 0;
+    return ring;
+}
+
+//------------------------------------------------------------------------------
+void OutboundDrain::start() { thread = new std::thread(run); }
+
+//------------------------------------------------------------------------------
+// What is still in the ring goes out first: a node's last models are what its
+// neighbours need to finish too
+//------------------------------------------------------------------------------
+void OutboundDrain::finish() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        die = true;
+        gone = gone || thread == nullptr;  // never started
+    }
+    wakeup_cv.notify_all();
+    progress_cv.notify_all();
+    if (thread) thread->join();
+}
+
+//------------------------------------------------------------------------------
+bool OutboundDrain::wakeup() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (gone) return false;
+        woken = true;
+    }
+    wakeup_cv.notify_one();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+bool OutboundDrain::wait(uint64_t consumed) {
+    std::unique_lock<std::mutex> lock(mtx);
+    progress_cv.wait(lock,
+                     [consumed]() { return ring->tail >= consumed || gone; });
+    return !gone;
+}
+
+//------------------------------------------------------------------------------
+// Sleeping is announced before head is checked again, and the enclave checks
+// it after moving head: one of both sees the other. Leaving, it stays set, so
+// that the enclave asks for a wakeup and learns that the drain is gone.
+//------------------------------------------------------------------------------
+void OutboundDrain::run() {
+    uint64_t tail = ring->tail;
+    while (true) {
+        uint64_t head = ring->head;
+        if (head == tail) {
+            std::unique_lock<std::mutex> lock(mtx);
+            ring->sleeping = 1;
+            if (ring->head == tail) {
+                wakeup_cv.wait(lock, []() { return woken || die; });
+            }
+            if (die && ring->head == tail) {
+                gone = true;
+                progress_cv.notify_all();
+                return;
+            }
+            ring->sleeping = 0;
+            woken = false;
+            continue;
+        }
+
+        for (; tail != head; ring->tail = tail) {
+            size_t offset = tail % capacity;
+            OutboundRing::Record record;
+            memcpy(&record, ring->data() + offset, sizeof(record));
+            if (record.route == OutboundRing::kWrap) {
+                tail += capacity - offset;
+                continue;
+            }
+            const char *route = reinterpret_cast<const char *>(
+                ring->data() + offset + sizeof(record));
+            CommunicationManager::send(std::string(route, record.route),
+                                       route + record.route, record.length);
+            tail += OutboundRing::record_size(record.route, record.length);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);  // for waiters in between
+        }
+        progress_cv.notify_all();
+    }
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#ifndef ENCLAVED
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+//------------------------------------------------------------------------------
+// Messages leaving the enclave, in untrusted memory: the enclave writes them
+// at head, a thread outside drains them from tail. Ocalls are only needed to
+// wake that thread up, or to wait for room. Both counters grow forever and are
+// taken modulo capacity. Records are 8-byte aligned and do not wrap around:
+// one that would not fit before the end is preceded by a kWrap record.
+//------------------------------------------------------------------------------
+struct OutboundRing {
+    struct Record {
+        uint32_t route;   // bytes of the routing id that follows, or kWrap
+        uint32_t length;  // bytes of the payload after the routing id
+    };
+    static const uint32_t kWrap = 0xffffffff;
+
+    static size_t record_size(size_t route, size_t length) {
+        return (sizeof(Record) + route + length + 7) & ~size_t(7);
+    }
+    static size_t bytes(size_t capacity) {
+        return sizeof(OutboundRing) + capacity;
+    }
+    uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+
+    alignas(64) std::atomic<uint64_t> head;  // written by the enclave
+    alignas(64) std::atomic<uint64_t> tail;  // written by the drain thread
+    std::atomic<uint32_t> sleeping;  // the drain thread waits for a wakeup
+};
+
+#ifndef ENCLAVED
+//------------------------------------------------------------------------------
+// Untrusted side: owns the ring and hands its messages to CommunicationZmq.
+// init before the enclave, start once the network is up.
+//------------------------------------------------------------------------------
+class OutboundDrain {
+   public:
+    static OutboundRing *init(size_t capacity);
+    static void start();
+    static void finish();
+    // Both false once the drain thread is gone: nothing leaves the ring then
+    static bool wakeup();
+    static bool wait(uint64_t consumed);  // until tail gets there
+
+   private:
+    static void run();
+
+    static OutboundRing *ring;
+    static size_t capacity;
+    static std::mutex mtx;
+    static std::condition_variable wakeup_cv, progress_cv;
+    static bool woken, die, gone;
+    static std::thread *thread;
+};
+#endif
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,427 @@
+#include <communication/netstats.h>
+#include <communication/shm_transport.h>
+#include <threads/thread_pool.h>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#define IDLE_MS 50  // checks for senders still to attach and for finish
+
+//------------------------------------------------------------------------------
+// As OutboundRing: counters grow forever, records never wrap around the end.
+// Records are aligned to their header's size, so whatever room is left at the
+// end holds at least a wrap marker.
+//------------------------------------------------------------------------------
+struct ShmTransport::Ring {
+    struct Record {
+        uint32_t flags;
+        uint32_t length;  // payload bytes that follow
+        int64_t sent;     // NetStats::now() when its message was sent
+    };
+    static const uint32_t kWrap = 1, kMore = 2, kHello = 4;
+
+    static const size_t kAlign = sizeof(Record);
+    static size_t record_size(size_t length) {
+        return (sizeof(Record) + length + kAlign - 1) & ~(kAlign - 1);
+    }
+    uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+
+    alignas(64) std::atomic<uint64_t> head;  // written by the sender
+    alignas(64) std::atomic<uint64_t> tail;  // written by the receiver
+    std::atomic<uint32_t> ready;  // the receiver listens: set last
+    int32_t owner;                // its pid
+    uint64_t capacity;
+};
+
+//------------------------------------------------------------------------------
+struct ShmTransport::Bell {
+    std::atomic<uint32_t> rung, sleeping;
+};
+
+//------------------------------------------------------------------------------
+static std::string ring_name(int receiver, int sender) {
+    return "/rex." + std::to_string(receiver) + "." + std::to_string(sender);
+}
+
+//------------------------------------------------------------------------------
+static std::string bell_name(int receiver) {
+    return "/rex." + std::to_string(receiver);
+}
+
+//------------------------------------------------------------------------------
+// Whatever a run that crashed left under name goes first
+//------------------------------------------------------------------------------
+static void *create_shm(const std::string &name, size_t bytes) {
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    void *ret = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, bytes) == 0) {
+        ret = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (ret == MAP_FAILED) {
+        std::cerr << "Could not create shared memory " << name << ": "
+                  << strerror(errno) << std::endl;
+        abort();
+    }
+    close(fd);
+    return ret;  // zeroed
+}
+
+//------------------------------------------------------------------------------
+// Null while its owner did not create it yet
+//------------------------------------------------------------------------------
+static void *open_shm(const std::string &name, size_t &bytes) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) return nullptr;
+    void *ret = nullptr;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        bytes = st.st_size;
+        ret = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ret == MAP_FAILED) ret = nullptr;
+    }
+    close(fd);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// Not private: the word is shared between processes
+//------------------------------------------------------------------------------
+static void futex_wait(std::atomic<uint32_t> *word, uint32_t seen, long ms) {
+    struct timespec timeout = {ms / 1000, (ms % 1000) * 1000000};
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, seen,
+            &timeout, nullptr, 0);
+}
+
+//------------------------------------------------------------------------------
+static void futex_wake(std::atomic<uint32_t> *word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX,
+            nullptr, nullptr, 0);
+}
+
+//------------------------------------------------------------------------------
+// Its receiver listens, and did not crash meanwhile
+//------------------------------------------------------------------------------
+static bool alive(const ShmTransport::Ring *ring) {
+    return ring->ready && (kill(ring->owner, 0) == 0 || errno == EPERM);
+}
+
+//------------------------------------------------------------------------------
+static void ring_bell(ShmTransport::Bell *bell) {
+    ++bell->rung;
+    if (bell->sleeping) futex_wake(&bell->rung);
+}
+
+//------------------------------------------------------------------------------
+ShmTransport::ShmTransport(size_t ring_bytes, unsigned input_threads)
+    : ring_bytes_(ring_bytes & ~(Ring::kAlign - 1)),
+      input_threads_(input_threads),
+      port_(0),
+      bell_(nullptr),
+      draining_(false),
+      die_(false) {
+    char hostname[HOST_NAME_MAX];
+    gethostname(hostname, HOST_NAME_MAX);
+    hostname_ = hostname;
+}
+
+//------------------------------------------------------------------------------
+void ShmTransport::add_endpoint(const std::string &host, int port) {
+    if (host != hostname_) {
+        std::cerr << "Shared memory reaches nodes on this host only, not "
+                  << host << ":" << port << std::endl;
+        abort();
+    }
+    std::unique_ptr<Outbound> out(new Outbound());
+    out->port = port;
+    out->ring = nullptr;
+    out->bell = nullptr;
+    out->ring_bytes = out->bell_bytes = 0;
+    out->head = 0;
+    out->lost = false;
+    outbound_[host + ":" + std::to_string(port)] = std::move(out);
+}
+
+//------------------------------------------------------------------------------
+// One ring per neighbour, which may start writing as soon as it is ready
+//------------------------------------------------------------------------------
+void ShmTransport::init(InputFunction f, int port) {
+    port_ = port;
+    input_ = f;
+    bell_ = static_cast<Bell *>(create_shm(bell_name(port_), sizeof(Bell)));
+    for (const auto &out : outbound_) {
+        Inbound in;
+        in.sender = out.first;
+        in.name = ring_name(port_, out.second->port);
+        in.ring = static_cast<Ring *>(
+            create_shm(in.name, sizeof(Ring) + ring_bytes_));
+        in.ring->capacity = ring_bytes_;
+        in.ring->owner = getpid();
+        in.ring->ready = 1;
+        inbound_.push_back(in);
+    }
+    for (unsigned i = 0; i < input_threads_; ++i) {
+        lanes_.emplace_back(new ThreadPool(1));
+    }
+}
+
+//------------------------------------------------------------------------------
+// Sleeping is announced before the rings are checked again, and senders check
+// it after moving head: one of both sees the other
+//------------------------------------------------------------------------------
+void ShmTransport::iterate() {
+    std::cout << ("Listening on shared memory " + bell_name(port_))
+              << std::endl;
+    network_ = std::this_thread::get_id();
+    while (!die_) {
+        if (drain()) continue;
+
+        // Never waits behind a sender: it may be waiting for us to drain
+        for (auto &out : outbound_) {
+            std::unique_lock<std::mutex> lock(out.second->mtx,
+                                              std::try_to_lock);
+            if (!lock) continue;
+            if (out.second->ring && !alive(out.second->ring)) {
+                detach(*out.second);
+            }
+            if (out.second->ring == nullptr) attach(*out.second);
+        }
+        uint32_t seen = bell_->rung;
+        bell_->sleeping = 1;
+        bool empty = std::all_of(
+            inbound_.begin(), inbound_.end(),
+            [](const Inbound &in) { return in.ring->head == in.ring->tail; });
+        if (empty && !die_) futex_wait(&bell_->rung, seen, IDLE_MS);
+        bell_->sleeping = 0;
+    }
+    lanes_.clear();  // lets what is being handled finish
+
+    for (auto &in : inbound_) {
+        in.ring->ready = 0;  // senders waiting for room give up
+        munmap(in.ring, sizeof(Ring) + in.ring->capacity);
+        shm_unlink(in.name.c_str());
+    }
+    munmap(bell_, sizeof(Bell));
+    shm_unlink(bell_name(port_).c_str());
+}
+
+//------------------------------------------------------------------------------
+void ShmTransport::finish() {
+    die_ = true;
+    if (bell_) ring_bell(bell_);
+}
+
+//------------------------------------------------------------------------------
+// Network thread only. Not reentered from an input that sends.
+//------------------------------------------------------------------------------
+bool ShmTransport::drain() {
+    if (draining_) return false;
+    draining_ = true;
+    bool busy = false;
+    for (auto &in : inbound_) busy = receive(in) || busy;
+    draining_ = false;
+    return busy;
+}
+
+//------------------------------------------------------------------------------
+// Records are framed as they are copied out, and room is given back as they
+// go: a message larger than the ring keeps flowing
+//------------------------------------------------------------------------------
+bool ShmTransport::receive(Inbound &in) {
+    Ring *ring = in.ring;
+    uint64_t tail = ring->tail, head = ring->head;
+    if (tail == head) return false;
+
+    size_t capacity = ring_bytes_;
+    for (; tail != head; ring->tail = tail) {
+        size_t offset = tail % capacity;
+        Ring::Record record;
+        memcpy(&record, ring->data() + offset, sizeof(record));
+        if (record.flags & Ring::kWrap) {
+            tail += capacity - offset;
+            continue;
+        }
+        if (sizeof(record) + record.length > capacity - offset) {
+            std::cerr << "Corrupt shared memory ring " << in.name << std::endl;
+            abort();
+        }
+        const char *payload = reinterpret_cast<const char *>(
+            ring->data() + offset + sizeof(record));
+        tail += Ring::record_size(record.length);
+
+        size_t n = in.sender.size();
+        if (record.flags & Ring::kHello) {
+            std::string hello((const char *)&n, sizeof(n));
+            deliver(in.sender, std::move(hello.append(in.sender)));
+            continue;
+        }
+        if (in.message.empty()) {  // sender frame, then room for the size
+            in.message.append((const char *)&n, sizeof(n));
+            in.message.append(in.sender);
+            in.message.append(sizeof(size_t), '\0');
+            in.sent = record.sent;
+        }
+        in.message.append(payload, record.length);
+        if (record.flags & Ring::kMore) continue;
+
+        size_t at = sizeof(size_t) + in.sender.size();
+        n = in.message.size() - at - sizeof(size_t);
+        memcpy(&in.message[at], &n, sizeof(n));
+        NetStats::add_bytes_in(n);
+        NetStats::received_from(in.sender, n, in.sent);
+        deliver(in.sender, std::move(in.message));
+        in.message.clear();
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+void ShmTransport::deliver(const std::string &sender, std::string &&message) {
+    if (lanes_.empty()) {
+        input_(message);
+        return;
+    }
+    auto shared = std::make_shared<std::string>(std::move(message));
+    InputFunction &input = input_;
+    size_t lane = std::hash<std::string>()(sender) % lanes_.size();
+    lanes_[lane]->add_task([&input, shared]() { input(*shared); });
+}
+
+//------------------------------------------------------------------------------
+// Called with out.mtx held. What was sent meanwhile follows the greeting.
+//------------------------------------------------------------------------------
+bool ShmTransport::attach(Outbound &out) {
+    size_t bytes = 0, bell_bytes = 0;
+    Ring *ring =
+        static_cast<Ring *>(open_shm(ring_name(out.port, port_), bytes));
+    if (ring == nullptr) return false;
+    if (bytes < sizeof(Ring) || sizeof(Ring) + ring->capacity > bytes ||
+        !alive(ring)) {
+        munmap(ring, bytes);  // not up yet, or left by a run that crashed
+        return false;
+    }
+    Bell *bell = static_cast<Bell *>(open_shm(bell_name(out.port), bell_bytes));
+    if (bell == nullptr || bell_bytes < sizeof(Bell)) {
+        if (bell) munmap(bell, bell_bytes);
+        munmap(ring, bytes);
+        return false;
+    }
+
+    out.ring = ring;
+    out.bell = bell;
+    out.ring_bytes = bytes;
+    out.bell_bytes = bell_bytes;
+    out.head = ring->head;
+    out.lost = false;
+    write(out, Ring::kHello, nullptr, 0);
+    for (const auto &m : out.pending) {
+        if (write(out, 0, m.second.data(), m.second.size(), m.first)) {
+            NetStats::add_bytes_out(m.second.size());
+        }
+    }
+    out.pending.clear();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Called with out.mtx held. The receiver removed or recreated its ring: the
+// mapping is of no use anymore.
+//------------------------------------------------------------------------------
+void ShmTransport::detach(Outbound &out) {
+    munmap(out.ring, out.ring_bytes);
+    munmap(out.bell, out.bell_bytes);
+    out.ring = nullptr;
+    out.bell = nullptr;
+    out.lost = true;
+}
+
+//------------------------------------------------------------------------------
+ssize_t ShmTransport::send(const std::string &id, const void *buffer,
+                           size_t length) {
+    auto it = outbound_.find(id);  // not modified after init
+    if (it == outbound_.end()) {
+        std::cerr << "No shared memory ring to " << id << std::endl;
+        return 0;
+    }
+    Outbound &out = *it->second;
+    int64_t sent = NetStats::now();
+    NetStats::sent_to(id, length);
+    std::lock_guard<std::mutex> lock(out.mtx);
+    if (out.ring && !alive(out.ring)) detach(out);
+    if (out.ring == nullptr && !attach(out)) {
+        if (out.lost) return 0;
+        out.pending.emplace_back(
+            sent, std::string((const char *)buffer, length));
+        return length;
+    }
+    if (!write(out, 0, buffer, length, sent)) {
+        detach(out);
+        return 0;
+    }
+    NetStats::add_bytes_out(length);
+    return length;
+}
+
+//------------------------------------------------------------------------------
+// False once the receiver is gone, or died. The network thread keeps draining
+// its own rings meanwhile: the receiver may as well be waiting for room in
+// them.
+//------------------------------------------------------------------------------
+bool ShmTransport::reserve(Outbound &out, size_t bytes) {
+    Ring *ring = out.ring;
+    bool network = std::this_thread::get_id() == network_;
+    while (out.head + bytes > ring->tail + ring->capacity) {
+        if (!alive(ring)) return false;
+        ring_bell(out.bell);
+        if (network && drain()) continue;
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+bool ShmTransport::write(Outbound &out, uint32_t flags, const void *data,
+                         size_t length, int64_t sent) {
+    Ring *ring = out.ring;
+    size_t capacity = ring->capacity,
+           most = capacity / 4 - sizeof(Ring::Record);
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    do {
+        size_t n = std::min(length, most);
+        size_t need = Ring::record_size(n), offset = out.head % capacity,
+               room = capacity - offset;
+        if (need > room) {  // the rest of the ring is skipped
+            if (!reserve(out, room)) return false;
+            Ring::Record wrap = {Ring::kWrap, 0};
+            memcpy(ring->data() + offset, &wrap, sizeof(wrap));
+            out.head += room;
+            offset = 0;
+        }
+        if (!reserve(out, need)) return false;
+        Ring::Record record = {flags | (n < length ? Ring::kMore : 0),
+                               uint32_t(n), sent};
+        memcpy(ring->data() + offset, &record, sizeof(record));
+        if (n) memcpy(ring->data() + offset + sizeof(record), p, n);
+        out.head += need;
+        ring->head = out.head;
+        p += n;
+        length -= n;
+    } while (length > 0);
+    ring_bell(out.bell);
+    return true;
+}
+
+//------------------------------------------------------------------------------
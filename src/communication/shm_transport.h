@@ -0,0 +1,81 @@
+#pragma once
+
+#include <communication_manager.h>
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class ThreadPool;
+
+//------------------------------------------------------------------------------
+// Nodes on the same host write straight into each other's memory. Each sender
+// and receiver pair has a ring in POSIX shared memory, named after both ports.
+// Each receiver has a bell (a futex) that senders ring when it sleeps.
+// Messages larger than a quarter of a ring go as several records. A receiver
+// creates its rings and removes them on its way out. A sender attaches once
+// the receiver is there and greets it first, as a zmq probe would. It lets go
+// of a receiver that left or died, and attaches again if one comes back.
+//------------------------------------------------------------------------------
+class ShmTransport : public Transport {
+   public:
+    ShmTransport(size_t ring_bytes, unsigned input_threads);
+
+    void add_endpoint(const std::string &host, int port) override;
+    void init(InputFunction f, int port) override;
+    void iterate() override;
+    void finish() override;
+    ssize_t send(const std::string &id, const void *buffer,
+                 size_t length) override;
+
+    struct Ring;
+    struct Bell;
+
+   private:
+    struct Inbound {  // network thread only
+        std::string sender, name;
+        Ring *ring;
+        std::string message;  // being assembled, framed as input takes it
+        int64_t sent;         // its stamp
+    };
+    struct Outbound {
+        std::mutex mtx;
+        int port;
+        Ring *ring;
+        Bell *bell;
+        size_t ring_bytes, bell_bytes;  // as mapped
+        uint64_t head;
+        bool lost;  // the receiver went away: nothing is kept for it
+        // sent before the receiver was up, with their stamps
+        std::vector<std::pair<int64_t, std::string>> pending;
+    };
+
+    bool drain();
+    bool receive(Inbound &in);
+    void deliver(const std::string &sender, std::string &&message);
+    bool attach(Outbound &out);
+    void detach(Outbound &out);
+    bool write(Outbound &out, uint32_t flags, const void *data, size_t length,
+               int64_t sent = 0);
+    bool reserve(Outbound &out, size_t bytes);
+
+    size_t ring_bytes_;
+    unsigned input_threads_;
+    int port_;
+    std::string hostname_;
+    InputFunction input_;
+    Bell *bell_;
+    std::atomic<std::thread::id> network_;  // runs iterate
+    bool draining_;
+    std::vector<Inbound> inbound_;
+    std::map<std::string, std::unique_ptr<Outbound>> outbound_;  // by node id
+    std::vector<std::unique_ptr<ThreadPool>> lanes_;  // by sender, as zmq's
+    std::atomic<bool> die_;
+};
+
+//------------------------------------------------------------------------------
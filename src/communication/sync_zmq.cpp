@@ -2,18 +2,31 @@
 #include <communication/sync_zmq.h>
 #include <limits.h>
 #include <stringtools.h>
+#include <threads/thread_pool.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <iostream>
 
 zmq::context_t *CommunicationZmq::context(nullptr);
 std::atomic<bool> CommunicationZmq::die(false);
-InputFunction CommunicationZmq::finput;
-int CommunicationZmq::localport = 0;
+std::vector<CommunicationZmq *> CommunicationZmq::servers;
+std::mutex CommunicationZmq::socket_mtx;
+std::mutex CommunicationZmq::outbox_mtx;
+std::vector<CommunicationZmq::Outgoing> CommunicationZmq::outbox;
+zmq::socket_t *CommunicationZmq::wakeup_push(nullptr);
+zmq::socket_t *CommunicationZmq::wakeup_pull(nullptr);
+std::thread::id CommunicationZmq::network_thread;
+unsigned CommunicationZmq::input_threads = 0;
+std::vector<std::unique_ptr<ThreadPool>> CommunicationZmq::lanes;
+std::mutex CommunicationZmq::lanes_mtx;
+bool CommunicationZmq::lanes_closed(false);
 //------------------------------------------------------------------------------
 // Client
 //------------------------------------------------------------------------------
 CommunicationZmq::CommunicationZmq(int id)
-    : socket_(*context, zmq::socket_type::dealer) {
+    : port_(0), socket_(*context, zmq::socket_type::dealer) {
     socket_.set(zmq::sockopt::routing_id, "edge" + std::to_string(id));
 }
 
@@ -53,11 +66,12 @@ int CommunicationZmq::recv(CommunicationZmq::RecvBuffer &message) {
 //------------------------------------------------------------------------------
 // Server
 //------------------------------------------------------------------------------
-static CommunicationZmq *communication = nullptr;
 CommunicationZmq::CommunicationZmq(int port, bool dummy)
-    : socket_(*context, zmq::socket_type::router) {
+    : port_(port), socket_(*context, zmq::socket_type::router) {
     socket_.set(zmq::sockopt::probe_router, 1);
-    socket_.set(zmq::sockopt::linger, 0);
+    // Frames still queued at exit get a moment to leave: a node's last models
+    // are what its neighbours need to finish too (ms)
+    socket_.set(zmq::sockopt::linger, 1000);
 
     char hostname[HOST_NAME_MAX];
     gethostname(hostname, HOST_NAME_MAX);
@@ -65,18 +79,43 @@ CommunicationZmq::CommunicationZmq(int port, bool dummy)
                 hostname + (":" + std::to_string(port)));
 }
 
+//------------------------------------------------------------------------------
+void CommunicationZmq::set_input_threads(unsigned n) { input_threads = n; }
+
 //------------------------------------------------------------------------------
 std::set<std::pair<std::string, int>> CommunicationZmq::out_endpoints;
 void CommunicationZmq::init(InputFunction f, int port) {
-    localport = port;
-
-    finput = f;
     context = new zmq::context_t(1);
-    communication = new CommunicationZmq(port, true);
+    network_thread = std::this_thread::get_id();
+
+    wakeup_pull = new zmq::socket_t(*context, zmq::socket_type::pull);
+    wakeup_pull->bind("inproc://outbox");
+    wakeup_push = new zmq::socket_t(*context, zmq::socket_type::push);
+    wakeup_push->connect("inproc://outbox");
+    for (unsigned i = 0; i < input_threads; ++i) {
+        lanes.emplace_back(new ThreadPool(1));
+    }
+    host(f, port);
+}
+
+//------------------------------------------------------------------------------
+// Nodes on this host are reached over loopback: no name resolution needed
+//------------------------------------------------------------------------------
+static std::string address(const std::string &host) {
+    char hostname[HOST_NAME_MAX];
+    gethostname(hostname, HOST_NAME_MAX);
+    return host == hostname ? "127.0.0.1" : host + ".iccluster.epfl.ch";
+}
 
+//------------------------------------------------------------------------------
+unsigned CommunicationZmq::host(InputFunction f, int port) {
+    CommunicationZmq *server = new CommunicationZmq(port, true);
+    server->input_ = f;
     for (const auto &ep : out_endpoints) {
-        communication->connect(ep.first + ".iccluster.epfl.ch", ep.second);
+        server->connect(address(ep.first), ep.second);
     }
+    servers.push_back(server);
+    return servers.size() - 1;
 }
 
 //------------------------------------------------------------------------------
@@ -93,19 +132,58 @@ ssize_t CommunicationZmq::send(int id, const void *buffer, size_t length) {
 //------------------------------------------------------------------------------
 ssize_t CommunicationZmq::send(const std::string &routing_id,
                                const void *buffer, size_t length) {
-    if (communication == nullptr) {
+    if (servers.empty()) {
         std::cerr << "Server not initialized" << std::endl;
         return 0;
     }
+    std::unique_lock<std::mutex> socket(socket_mtx, std::defer_lock);
+    if (std::this_thread::get_id() == network_thread) {
+        socket.lock();
+    } else {
+        socket.try_lock();
+    }
+    int64_t sent = NetStats::now();
+    if (socket.owns_lock()) {
+        flush_outbox();  // queued before
+        return send_now(routing_id, buffer, length, sent);
+    }
 
+    // zmq sockets are not thread safe: queue it for the network thread
     std::vector<std::string> route = split(routing_id, " ");
+    ssize_t ret = length;
+    for (const auto &hop : route) {
+        if (hop.empty() || hop[0] != '@') ret += hop.size();  // not a slot
+    }
+    std::lock_guard<std::mutex> lock(outbox_mtx);
+    if (wakeup_push == nullptr) return 0;  // network thread gone
+    outbox.push_back(
+        {routing_id, std::string((const char *)buffer, length), sent});
+    wakeup_push->send(zmq::const_buffer("", 0), zmq::send_flags::dontwait);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+ssize_t CommunicationZmq::send_now(const std::string &routing_id,
+                                   const void *buffer, size_t length,
+                                   int64_t sent) {
+    std::vector<std::string> route = split(routing_id, " ");
+    CommunicationZmq *server = servers[0];
+    if (!route.empty() && !route[0].empty() && route[0][0] == '@') {
+        size_t slot = std::stoul(route[0].substr(1));
+        if (slot >= servers.size()) {
+            std::cerr << "No socket for " << route[0] << std::endl;
+            return 0;
+        }
+        server = servers[slot];
+        route.erase(route.begin());
+    }
     ssize_t ret = 0;
     for (auto hop = route.begin(); hop != route.end(); ++hop) {
-        ret += communication->send_more(*hop, hop != route.begin());
-        if (hop + 1 != route.end())
-            ret += communication->send_more(std::string());
+        ret += server->send_more(*hop, hop != route.begin());
+        if (hop + 1 != route.end()) ret += server->send_more(std::string());
     }
-    ret += communication->send(zmq::const_buffer(buffer, length));
+    ret += server->send(zmq::const_buffer(buffer, length), sent);
+    if (!route.empty()) NetStats::sent_to(route.back(), length);
 
     return ret;
 }
@@ -121,58 +199,173 @@ void CommunicationZmq::probed(const std::string &probed) {
     }
 }
 
+//------------------------------------------------------------------------------
+void CommunicationZmq::flush_outbox() {
+    zmq::message_t wakeup;
+    while (wakeup_pull->recv(wakeup, zmq::recv_flags::dontwait)) {
+    }
+
+    std::vector<Outgoing> pending;
+    {
+        std::lock_guard<std::mutex> lock(outbox_mtx);
+        pending.swap(outbox);
+    }
+    for (const auto &out : pending) {
+        send_now(out.route, out.payload.data(), out.payload.size(),
+                 out.sent);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Without lanes, right away on the caller's thread
+//------------------------------------------------------------------------------
+void CommunicationZmq::post(const std::string &key,
+                            std::function<void()> task) {
+    std::unique_lock<std::mutex> lock(lanes_mtx);
+    if (lanes_closed) return;
+    if (lanes.empty()) {
+        lock.unlock();
+        task();
+        return;
+    }
+    size_t lane = std::hash<std::string>()(key) % lanes.size();
+    lanes[lane]->add_task(task);
+}
+
+//------------------------------------------------------------------------------
+// Network thread only: nobody else changes lanes
+//------------------------------------------------------------------------------
+bool CommunicationZmq::lanes_full() {
+    return std::any_of(lanes.begin(), lanes.end(),
+                       [](const std::unique_ptr<ThreadPool> &lane) {
+                           return lane->queued() >= kLaneDepth;
+                       });
+}
+
+//------------------------------------------------------------------------------
+// While lanes are full, the outbox is still served, and they are looked at
+// again every millisecond
 //------------------------------------------------------------------------------
 void CommunicationZmq::iterate() {
-    std::string endpoint("tcp://*:" + std::to_string(localport)), sender;
-    std::cout << ("Listening on " + endpoint) << std::endl;
-    communication->socket_.bind(endpoint);
+    for (CommunicationZmq *server : servers) {
+        std::string endpoint("tcp://*:" + std::to_string(server->port_));
+        std::cout << ("Listening on " + endpoint) << std::endl;
+        server->socket_.bind(endpoint);
+    }
+    std::vector<zmq::pollitem_t> items;
+    for (CommunicationZmq *server : servers) {
+        items.push_back(
+            {static_cast<void *>(server->socket_), 0, ZMQ_POLLIN, 0});
+    }
+    items.push_back({static_cast<void *>(*wakeup_pull), 0, ZMQ_POLLIN, 0});
+
+    std::unique_lock<std::mutex> socket(socket_mtx);
     while (!die) {
-        zmq::message_t message;
-        zmq::recv_result_t recvd_size;
-
-        int more, zero_count = 0, nonzero_count = 0;
-        std::string multipart_serialized;
-        do {
-            message.rebuild();
-            try {
-                recvd_size = communication->socket_.recv(message);
-            } catch (const zmq::error_t &e) {
-                break;
-                break;
-            }
-            size_t n = recvd_size.value();
-            if (n != 0) {
-                if (zero_count != 0) NetStats::add_bytes_in(n);
-                // does not count sender address as bytes received
-                multipart_serialized +=
-                    std::string((char *)&n, sizeof(n)) + message.to_string();
-                ++nonzero_count;
-            } else {
-                ++zero_count;
-            }
-            more = communication->socket_.get(zmq::sockopt::rcvmore);
-            if (more && zero_count == 0) {
-                sender = message.to_string();
-            }
-        } while (more);
-        if (zero_count == 1 && nonzero_count == 1) {  // it is a probe msg
-            // account for the reciprocal probe. It assumes probe_router=1
-            communication->probed(sender);
-            NetStats::add_bytes_out(
-                communication->socket_.get(zmq::sockopt::routing_id).size());
-            NetStats::add_bytes_in(sender.size());
+        bool full = lanes_full();
+        for (size_t i = 0; i < servers.size(); ++i) {
+            items[i].events = full ? 0 : ZMQ_POLLIN;
+        }
+        try {
+            zmq::poll(items, std::chrono::milliseconds(full ? 1 : -1));
+        } catch (const zmq::error_t &e) {
+            break;
+        }
+        if (items.back().revents & ZMQ_POLLIN) flush_outbox();
+        for (size_t i = 0; i < servers.size(); ++i) {
+            if (items[i].revents & ZMQ_POLLIN) receive(*servers[i], socket);
+        }
+    }
+    std::vector<std::unique_ptr<ThreadPool>> closing;
+    {
+        std::lock_guard<std::mutex> lock(lanes_mtx);
+        lanes_closed = true;
+        closing.swap(lanes);
+    }
+    closing.clear();  // lets what is being handled finish
+    flush_outbox();  // what they and other threads queued meanwhile
+    for (CommunicationZmq *server : servers) server->socket_.close();
+    {
+        std::lock_guard<std::mutex> lock(outbox_mtx);
+        delete wakeup_push;
+        wakeup_push = nullptr;
+    }
+    delete wakeup_pull;
+    wakeup_pull = nullptr;
+    delete context;  // waits up to linger for what is still queued
+    context = nullptr;
+}
+
+//------------------------------------------------------------------------------
+// One message from server's socket, handed to its input
+//------------------------------------------------------------------------------
+void CommunicationZmq::receive(CommunicationZmq &server,
+                               std::unique_lock<std::mutex> &socket) {
+    zmq::message_t message;
+    zmq::recv_result_t recvd_size;
+
+    int more, zero_count = 0, nonzero_count = 0;
+    std::string multipart_serialized, sender;
+    size_t payload = 0;  // bytes of the last frame
+    Stamp stamp;
+    bool stamped = false, after_delimiter = false;
+    do {
+        message.rebuild();
+        try {
+            recvd_size = server.socket_.recv(message);
+        } catch (const zmq::error_t &e) {
+            break;
+        }
+        size_t n = recvd_size.value();
+        more = server.socket_.get(zmq::sockopt::rcvmore);
+        if (n != 0 && after_delimiter && more && Stamp::is(message)) {
+            memcpy(&stamp, message.data(), sizeof(stamp));  // not payload
+            stamped = true;
+        } else if (n != 0) {
+            if (zero_count != 0) NetStats::add_bytes_in(n);
+            // does not count sender address as bytes received
+            multipart_serialized.append((char *)&n, sizeof(n));
+            multipart_serialized.append(message.data<char>(), n);
+            ++nonzero_count;
+            payload = n;
+        } else {
+            ++zero_count;
         }
-        // std::cout << multipart_serialized.size() << std::endl;
-        finput(multipart_serialized);
+        after_delimiter = n == 0;
+        if (more && zero_count == 0) {
+            sender = message.to_string();
+        }
+    } while (more);
+    if (stamped) NetStats::received_from(sender, payload, stamp.sent);
+    if (zero_count == 1 && nonzero_count == 1) {  // it is a probe msg
+        // account for the reciprocal probe. It assumes probe_router=1
+        server.probed(sender);
+        NetStats::add_bytes_out(
+            server.socket_.get(zmq::sockopt::routing_id).size());
+        NetStats::add_bytes_in(sender.size());
+    }
+    // std::cout << multipart_serialized.size() << std::endl;
+    InputFunction &input = server.input_;
+    if (lanes.empty()) {
+        socket.unlock();
+        input(multipart_serialized);
+        socket.lock();
+    } else {
+        auto shared = std::make_shared<std::string>(
+            std::move(multipart_serialized));
+        post(sender, [&input, shared]() { input(*shared); });
     }
-    communication->socket_.close();
 }
 
+//------------------------------------------------------------------------------
+// The network thread winds down itself: frames queued by other threads would
+// be lost if the context went away under it
 //------------------------------------------------------------------------------
 void CommunicationZmq::finish() {
+    std::lock_guard<std::mutex> lock(outbox_mtx);
     die = true;
-    delete context;
-    context = nullptr;
+    if (wakeup_push) {
+        wakeup_push->send(zmq::const_buffer("", 0), zmq::send_flags::dontwait);
+    }
 }
 
 //------------------------------------------------------------------------------
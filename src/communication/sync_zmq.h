@@ -3,8 +3,16 @@
 #include <communication_manager.h>
 
 #include <atomic>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <zmq/zmq.hpp>
 #include <set>
+#include <thread>
+#include <vector>
+
+class ThreadPool;
 
 class CommunicationZmq {
    public:
@@ -17,6 +25,8 @@ class CommunicationZmq {
     template <typename T>
     size_t send(const T &);
     template <typename T>
+    size_t send(const T &, int64_t sent);  // stamped with when it was sent
+    template <typename T>
     size_t send_more(const T &, bool count = true);
     static ssize_t send(int socket, const void *buffer, size_t length);
     static ssize_t send(const std::string &routing_id, const void *buffer,
@@ -28,21 +38,93 @@ class CommunicationZmq {
     void probed(const std::string &probed);
 
     // If server: init, iterate, finish
+    static void set_input_threads(unsigned n);  // before init
     static void init(InputFunction, int port);
     static void iterate();
     static void finish();
     static void add_endpoint(const std::string &host, int port);
 
+    // More nodes in this process, each with its own socket and port, after
+    // init and before iterate. Routes starting with "@slot" leave from the
+    // socket of that slot; init's is 0.
+    static unsigned host(InputFunction, int port);
+
+    // Runs task on the input lane of key, after what was posted there before
+    static void post(const std::string &key, std::function<void()> task);
+
     static std::atomic<size_t> bytes_out, bytes_in;
     static std::set<std::pair<std::string, int>> out_endpoints;
 
    private:
-    static InputFunction finput;
+    // Envelope frame right after the delimiter, tagged so that peers that do
+    // not stamp, and payload frames, are told apart
+    struct Stamp {
+        Stamp(int64_t t = 0) : sent(t) { memcpy(tag, kTag, sizeof(tag)); }
+        static bool is(const zmq::message_t &frame) {
+            return frame.size() == sizeof(Stamp) &&
+                   memcmp(frame.data(), kTag, sizeof(tag)) == 0;
+        }
+        static constexpr const char *kTag = "rex\0stv1";  // and version
+        char tag[8];
+        int64_t sent;  // NetStats::now()
+    };
+
+    // The socket is used under socket_mtx, which the network thread releases
+    // while it handles input. Sends issued from elsewhere then go out right
+    // away; otherwise they are handed over to the network thread.
+    struct Outgoing {
+        std::string route, payload;
+        int64_t sent;  // NetStats::now() when it was handed over
+    };
+    static ssize_t send_now(const std::string &routing_id,
+                            const void *buffer, size_t length, int64_t sent);
+    static void flush_outbox();
+    static void receive(CommunicationZmq &server,
+                        std::unique_lock<std::mutex> &socket);
+    static bool lanes_full();
+
+    // Received messages are handled off the network thread, by one of
+    // input_threads lanes picked by sender: in order for each sender. While
+    // one holds kLaneDepth messages, sockets are not read and zmq pushes back.
+    // Once closed, by the network thread on its way out, what is posted is
+    // dropped.
+    static unsigned input_threads;
+    static const size_t kLaneDepth = 8;
+    static std::vector<std::unique_ptr<ThreadPool>> lanes;
+    static std::mutex lanes_mtx;
+    static bool lanes_closed;
+
+    static std::mutex socket_mtx, outbox_mtx;
+    static std::vector<Outgoing> outbox;
+    static zmq::socket_t *wakeup_push, *wakeup_pull;
+    static std::thread::id network_thread;
+
+    static std::vector<CommunicationZmq *> servers;  // by slot
     static std::atomic<bool> die;
     static zmq::context_t* context;
-    static int localport;
+    InputFunction input_;
+    int port_;
     zmq::socket_t socket_;
     std::set<std::pair<std::string,int>> probed_;
 };
 
+//------------------------------------------------------------------------------
+// CommunicationZmq behind the Transport interface: ROUTER sockets over TCP
+//------------------------------------------------------------------------------
+class ZmqTransport : public Transport {
+   public:
+    void add_endpoint(const std::string &host, int port) override {
+        CommunicationZmq::add_endpoint(host, port);
+    }
+    void init(InputFunction f, int port) override {
+        CommunicationZmq::init(f, port);
+    }
+    void iterate() override { CommunicationZmq::iterate(); }
+    void finish() override { CommunicationZmq::finish(); }
+    ssize_t send(const std::string &id, const void *buffer,
+                 size_t length) override {
+        return CommunicationZmq::send(id, buffer, length);
+    }
+};
+
 #include <communication/sync_zmq.hpp>
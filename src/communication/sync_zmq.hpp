@@ -13,3 +13,16 @@ size_t CommunicationZmq::send(const T& data) {
 }
 
 //------------------------------------------------------------------------------
+// The stamp goes between delimiter and data. It is not traffic: it counts
+// neither as bytes sent nor in what is returned.
+//------------------------------------------------------------------------------
+template <typename T>
+size_t CommunicationZmq::send(const T& data, int64_t sent) {
+    size_t ret = zmq_send_more(socket_, std::string());
+    Stamp stamp(sent);
+    zmq_send_more(socket_, std::string((const char*)&stamp, sizeof(stamp)),
+                  false);
+    return ret + zmq_send(socket_, data);
+}
+
+//------------------------------------------------------------------------------
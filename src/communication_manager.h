@@ -1,14 +1,48 @@
 #pragma once
 
+#include <sys/types.h>
 #include <functional>
 #include <string>
 
 typedef std::function<int(const std::string&)> InputFunction;
 
-template <typename T>
+//------------------------------------------------------------------------------
+// Carries messages between nodes. Input gets them as size-prefixed frames,
+// sender first then payload; the sender frame alone announces that peer
+// (connected, or probed). Endpoints are added before init, iterate runs the
+// transport until finish, and send may be called from any thread.
+//------------------------------------------------------------------------------
+class Transport {
+   public:
+    virtual ~Transport() {}
+    virtual void add_endpoint(const std::string& host, int port) = 0;
+    virtual void init(InputFunction f, int port) = 0;
+    virtual void iterate() = 0;
+    virtual void finish() = 0;
+    virtual ssize_t send(const std::string& id, const void* buffer,
+                         size_t length) = 0;
+};
+
+//------------------------------------------------------------------------------
+// The transport of this process, picked once before init
+//------------------------------------------------------------------------------
 class CommunicationManager {
    public:
-    static void init(InputFunction f, int port) { T::init(f, port); }
-    static void iterate() { T::iterate(); }
-    static void finish() { T::finish(); }
+    static void use(Transport* t) { transport() = t; }
+    static void add_endpoint(const std::string& host, int port) {
+        transport()->add_endpoint(host, port);
+    }
+    static void init(InputFunction f, int port) { transport()->init(f, port); }
+    static void iterate() { transport()->iterate(); }
+    static void finish() { transport()->finish(); }
+    static ssize_t send(const std::string& id, const void* buffer,
+                        size_t length) {
+        return transport()->send(id, buffer, length);
+    }
+
+   private:
+    static Transport*& transport() {
+        static Transport* t = nullptr;
+        return t;
+    }
 };
@@ -5,11 +5,17 @@
 extern "C" {
 #endif
 struct EnclaveArguments {
-    unsigned char *train, *test, datashare, modelshare, dpsgd;
-    size_t train_size, test_size, degree, steps_per_iteration;
+    unsigned char *train, *test, datashare, modelshare, dpsgd, asyncgossip,
+        pipelined, delta, compression;
+    void *outbox;  // OutboundRing in untrusted memory, null: none
+    size_t train_size, test_size, degree, steps_per_iteration, recv_budget,
+        share_budget, outbox_size, chunk_size, max_message;
     int userrank;
     char nodes[1000];
-    unsigned share_howmany, local, epochs;
+    char checkpoint[512], restore[512];  // directories, empty: none
+    unsigned share_howmany, local, epochs, staleness, quantize;
+    unsigned slot, hosted;  // socket of this node, nodes in the process
+    double share_fraction;
 };
 #ifdef __cplusplus
 }
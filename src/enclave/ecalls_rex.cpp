@@ -1,5 +1,6 @@
 #include <machine_learning/mf_node.h>
 #include <stdarg.h>
+#include <memory>
 #include "args_rex.h"
 #include "node_protocol.h"
 
@@ -20,12 +21,26 @@ int printf(const char *fmt, ...) {
 }
 #endif
 //------------------------------------------------------------------------------
+#ifdef NATIVE
+std::vector<std::unique_ptr<NodeProtocol>> protocols;  // by slot
+int ecall_init(struct EnclaveArguments args) {
+    if (protocols.size() <= args.slot) protocols.resize(args.slot + 1);
+    protocols[args.slot].reset(new NodeProtocol());
+    return protocols[args.slot]->init(args);
+}
+
+//------------------------------------------------------------------------------
+void ecall_colocate() { NodeProtocol::colocate(); }
+#else
 NodeProtocol protocol;
 int ecall_init(struct EnclaveArguments args) { return protocol.init(args); }
+#endif
 //------------------------------------------------------------------------------
-std::vector<std::string> multipart_deserialize(const char *data,
-                                               size_t data_size) {
-    std::vector<std::string> ret;
+// Views on the frames: they are only valid during the ecall
+//------------------------------------------------------------------------------
+std::vector<ByteView> multipart_deserialize(const char *data,
+                                            size_t data_size) {
+    std::vector<ByteView> ret;
     size_t chunk_size, cursor;
     for (cursor = 0; cursor < data_size;
          cursor += sizeof(size_t) + chunk_size) {
@@ -36,13 +51,21 @@ std::vector<std::string> multipart_deserialize(const char *data,
                       << " Data size: " << data_size << std::endl;
             break;
         }
-        ret.push_back(std::string(data + cursor + sizeof(size_t), chunk_size));
+        ret.emplace_back(data + cursor + sizeof(size_t), chunk_size);
     }
     return ret;
 }
 
 //------------------------------------------------------------------------------
+#ifdef NATIVE
+int ecall_input(unsigned slot, const char *data, size_t data_size) {
+    protocols[slot]->input(multipart_deserialize(data, data_size));
+    return 0;
+}
+#else
 int ecall_input(const char *data, size_t data_size) {
     protocol.input(multipart_deserialize(data, data_size));
+    return 0;
 }
+#endif
 //------------------------------------------------------------------------------
@@ -4,6 +4,7 @@
 #include <args_rex.h>
 
 #include <cstdlib>
-int ecall_init(EnclaveArguments args);
-int ecall_input(const char *data, size_t data_size);
+int ecall_init(EnclaveArguments args);  // once per hosted node
+int ecall_input(unsigned slot, const char *data, size_t data_size);
+void ecall_colocate();
 #endif
@@ -0,0 +1,109 @@
+#include "message_chunks.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#ifndef NATIVE
+#include <libc_mock/libcpp_mock.h>
+#endif
+
+//------------------------------------------------------------------------------
+ChunkWriter::ChunkWriter(ByteView message, size_t chunk_size, uint32_t sequence)
+    : message_(message), chunk_size_(chunk_size), offset_(0) {
+    memset(&header_, 0, sizeof(header_));
+    header_.tag = ChunkHeader::kTag;
+    header_.message = sequence;
+    header_.count = (message.size() + chunk_size - 1) / chunk_size;
+    header_.total = message.size();
+    frame_.reserve(sizeof(header_) + chunk_size);
+}
+
+//------------------------------------------------------------------------------
+bool ChunkWriter::next() {
+    if (offset_ >= message_.size()) return false;
+    size_t length = std::min(chunk_size_, message_.size() - offset_);
+    frame_.resize(sizeof(header_) + length);
+    memcpy(frame_.data(), &header_, sizeof(header_));
+    memcpy(frame_.data() + sizeof(header_), message_.data() + offset_, length);
+    offset_ += length;
+    ++header_.index;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+ChunkAssembler::ChunkAssembler(uint64_t limit)
+    : total_(0),
+      limit_(limit),
+      message_(0),
+      next_index_(0),
+      count_(0),
+      assembling_(false),
+      seen_(false) {}
+
+//------------------------------------------------------------------------------
+void ChunkAssembler::clear() {
+    buffer_.clear();
+    assembling_ = false;
+}
+
+//------------------------------------------------------------------------------
+bool ChunkAssembler::fail(const char *why) {
+    std::cerr << "Dropping chunked message " << message_ << ": " << why
+              << std::endl;
+    clear();
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// A first chunk reserves the whole message, the next ones fill it up to total.
+// Total comes from the peer: it is checked before anything is reserved.
+//------------------------------------------------------------------------------
+bool ChunkAssembler::add(ByteView frame) {
+    ChunkHeader header;
+    memcpy(&header, frame.data(), sizeof(header));
+    ByteView payload(frame.data() + sizeof(header),
+                     frame.size() - sizeof(header));
+
+    if (header.index == 0) {
+        if (assembling_) fail("restarted");
+        if (seen_ && header.message <= message_) {
+            std::cerr << "Replayed chunked message " << header.message
+                      << std::endl;
+            return false;
+        }
+        if (header.count == 0 || payload.empty() ||
+            header.total > uint64_t(header.count) * payload.size()) {
+            std::cerr << "Malformed chunked message " << header.message
+                      << std::endl;
+            return false;
+        }
+        if (header.total > limit_) {
+            std::cerr << "Chunked message " << header.message << " of "
+                      << header.total << " B is over the limit" << std::endl;
+            return false;
+        }
+        message_ = header.message;
+        count_ = header.count;
+        total_ = header.total;
+        next_index_ = 0;
+        seen_ = assembling_ = true;
+        buffer_.clear();
+        buffer_.reserve(total_);
+    } else if (!assembling_) {
+        return false;  // its first chunk was dropped
+    }
+
+    if (header.message != message_ || header.index != next_index_ ||
+        header.count != count_) {
+        return fail("out of sequence");
+    }
+    uint64_t filled = buffer_.size() + payload.size();
+    if (filled > total_ || (header.index + 1 == count_) != (filled == total_)) {
+        return fail("sizes do not add up");
+    }
+    buffer_.insert(buffer_.end(), payload.begin(), payload.end());
+    ++next_index_;
+    return next_index_ == count_;
+}
+
+//------------------------------------------------------------------------------
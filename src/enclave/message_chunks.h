@@ -0,0 +1,65 @@
+#pragma once
+
+#include <utils/byte_view.h>
+
+#include <cstdint>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Large models travel as a sequence of frames, each of them encrypted and
+// authenticated on its own, so that the receiver handles one while the next is
+// on the way and never holds a whole ciphertext. Every chunk says which
+// message it belongs to, where it goes and how large the message is. Input is
+// ordered per sender: chunks of a message arrive one after the other.
+//------------------------------------------------------------------------------
+struct ChunkHeader {
+    static const uint8_t kTag = 0xd0;  // models start with their type, 0..6,
+                                       // compressed payloads with 0xc?
+    uint8_t tag, reserved[3];
+    uint32_t message;  // increases with every chunked message of a sender
+    uint32_t index, count;
+    uint64_t total;  // bytes of the whole message
+
+    static bool is_chunk(ByteView frame) {
+        return frame.size() >= sizeof(ChunkHeader) && frame[0] == kTag;
+    }
+};
+
+//------------------------------------------------------------------------------
+// Frames of a message, one at a time, written over the same buffer
+//------------------------------------------------------------------------------
+class ChunkWriter {
+   public:
+    ChunkWriter(ByteView message, size_t chunk_size, uint32_t sequence);
+    bool next();  // false once all went out
+    const std::vector<uint8_t> &frame() const { return frame_; }
+
+   private:
+    ByteView message_;
+    size_t chunk_size_, offset_;
+    ChunkHeader header_;
+    std::vector<uint8_t> frame_;
+};
+
+//------------------------------------------------------------------------------
+// One per sender. Chunks are copied where they belong as they come; anything
+// out of sequence drops the message being assembled, as does a message
+// larger than limit bytes.
+//------------------------------------------------------------------------------
+class ChunkAssembler {
+   public:
+    explicit ChunkAssembler(uint64_t limit);
+    bool add(ByteView frame);  // true when this chunk completes the message
+    ByteView message() const { return buffer_; }
+    void clear();  // keeps the buffer for the next message
+
+   private:
+    bool fail(const char *why);
+
+    std::vector<uint8_t> buffer_;
+    uint64_t total_, limit_;
+    uint32_t message_, next_index_, count_;
+    bool assembling_, seen_;
+};
+
+//------------------------------------------------------------------------------
@@ -1,16 +1,44 @@
 #include "node_protocol.h"
 #include <json_utils.h>
 #include <stringtools.h>
+#include <sstream>
 #ifdef NATIVE
+#include <functional>
 extern void ocall_farewell();
+extern void ocall_post(const std::string &key, std::function<void()> task);
+extern void ocall_peer_traffic(const char *peer, struct PeerTraffic *traffic);
+
+std::mutex NodeProtocol::colocated_mtx_;
+std::map<unsigned, NodeProtocol *> NodeProtocol::colocated_;
 #endif
 //------------------------------------------------------------------------------
-NodeProtocol::NodeProtocol() : degree_(-1) {}
+NodeProtocol::NodeProtocol()
+    : degree_(-1),
+      compression_(Compression::NONE),
+      chunk_size_(0),
+      max_message_(0),
+      chunk_sequence_(0),
+      buffers_(std::make_shared<BufferPool>()),
+      train_pending_(false) {
+#ifdef NATIVE
+    started_ = false;
+    rank_ = 0;
+#endif
+}
 
 //------------------------------------------------------------------------------
 int NodeProtocol::init(EnclaveArguments &args) {
     degree_ = args.degree;
     dpsgd_ = args.dpsgd;
+    asyncgossip_ = args.asyncgossip;
+    staleness_ = args.staleness;
+    pipelined_ = args.pipelined;
+    compression_ = Compression::Codec(args.compression);
+    chunk_size_ = args.chunk_size;
+    max_message_ = args.max_message;
+    if (args.outbox && !outbound_.attach(args.outbox, args.outbox_size)) {
+        printf("Invalid outbound ring: one ocall per message\n");
+    }
     share_howmany_ = args.share_howmany;
     local_ = args.local;
     steps_per_iteration_ = args.steps_per_iteration;
@@ -30,6 +58,21 @@ int NodeProtocol::init(EnclaveArguments &args) {
 
     node_ = std::make_shared<MFNode>(args.userrank, node_data, test_set,
                                      args.modelshare, args.datashare, "");
+    node_->set_partial_sharing(args.share_fraction);
+    node_->set_memory_budget(args.recv_budget);
+    node_->set_share_budget(args.share_budget);
+    node_->set_quantization(args.quantize);
+    node_->set_delta_encoding(args.delta);
+#ifdef NATIVE
+    node_->set_checkpoint(args.checkpoint, args.restore);
+    rank_ = args.userrank;
+    if (args.hosted > 1) {
+        route_prefix_ = "@" + std::to_string(args.slot) + " ";
+        label_ = std::to_string(rank_) + ";";
+        std::lock_guard<std::mutex> lock(colocated_mtx_);
+        colocated_[rank_] = this;
+    }
+#endif
     printf("Hello enclave! I'm %d. Train: %ld. Test: %ld\n", args.userrank,
            node_data->size(), test_set.size());
 
@@ -47,6 +90,7 @@ int NodeProtocol::init(EnclaveArguments &args) {
 
 #ifndef NATIVE
     print_training_summary(trigger_training());
+    train_while_ready();
 #endif
     return 0;
 }
@@ -54,17 +98,42 @@ int NodeProtocol::init(EnclaveArguments &args) {
 //------------------------------------------------------------------------------
 void NodeProtocol::print_training_summary(const TrainInfo &info) {
     if (!info.dummy()) {
-        int epoch = node_->finished_epoch();
-        printf("%d;%lf;%lf;%lf;%ld;%lf;%ld;%ld\n", epoch, absolutetime_->stop(),
-               info.train_err, info.test_err, info.train_count, info.duration,
-               info.bytes_out, info.bytes_in);
+        int epoch = info.epoch;
+        printf("%s%d;%lf;%lf;%lf;%ld;%lf;%ld;%ld\n", label_.c_str(), epoch,
+               absolutetime_->stop(), info.train_err, info.test_err,
+               info.train_count, info.duration, info.bytes_out, info.bytes_in);
         if (epoch >= epochs_) {
-            std::cout << node_->summary();
+            std::cout << node_->summary() << traffic_summary();
             ocall_farewell();
         }
     }
 }
 
+//------------------------------------------------------------------------------
+// Colocated neighbours are not reached through the transport: all zeros
+//------------------------------------------------------------------------------
+PeerTraffic NodeProtocol::traffic(unsigned rank) {
+    PeerTraffic ret = {0, 0, 0, 0, 0, 0, 0, 0};
+    auto it = rank_netid.find(rank);  // not modified after init
+    if (it != rank_netid.end()) ocall_peer_traffic(it->second.c_str(), &ret);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+std::string NodeProtocol::traffic_summary() {
+    std::stringstream ss;
+    ss << "peer\tbytesout\tbytesin\tmsgsout\tmsgsin\tmeanms\tp50ms\tp99ms"
+          "\tmaxms\n";
+    for (const auto &peer : rank_netid) {
+        PeerTraffic t = traffic(peer.first);
+        ss << peer.second << "\t" << t.bytes_out << "\t" << t.bytes_in << "\t"
+           << t.messages_out << "\t" << t.messages_in << "\t"
+           << t.latency_mean << "\t" << t.latency_p50 << "\t" << t.latency_p99
+           << "\t" << t.latency_max << "\n";
+    }
+    return ss.str();
+}
+
 //------------------------------------------------------------------------------
 TrainInfo NodeProtocol::trigger_training() {
     double init_bias = 1, init_factor = sqrt(0.9);
@@ -72,13 +141,111 @@ TrainInfo NodeProtocol::trigger_training() {
     absolutetime_ = std::make_shared<TimeProbe>();
     absolutetime_->start();
     printf(
-        "epoch;timestamp;trainerr;testerr;traincount;duration;bytesout;"
-        "bytesin\n");
-    node_->init_training(this, hyper, dpsgd_ ? DPSGD : RMW, local_,
-                         steps_per_iteration_, share_howmany_);
-    return node_->train_and_share(0);
+        "%sepoch;timestamp;trainerr;testerr;traincount;duration;bytesout;"
+        "bytesin\n",
+        label_.empty() ? "" : "node;");
+    ModelMergerType merger = asyncgossip_ ? ASYNC : (dpsgd_ ? DPSGD : RMW);
+    if (pipelined_) {
+        node_->set_pipelined(
+            [this](const TrainInfo &info) { print_training_summary(info); });
+    }
+    node_->init_training(this, hyper, merger, local_, steps_per_iteration_,
+                         share_howmany_, staleness_);
+    return node_->train_and_share(node_->finished_epoch() + 1);
+}
+
+//------------------------------------------------------------------------------
+// With bounded staleness a node may be allowed several epochs in a row. Whoever
+// trains checks again for what arrived meanwhile: a caller that finds training
+// busy only flags it.
+//------------------------------------------------------------------------------
+void NodeProtocol::train_while_ready() {
+    train_pending_ = true;
+    while (train_pending_) {
+        std::unique_lock<std::mutex> lock(train_mtx_, std::try_to_lock);
+        if (!lock.owns_lock()) return;
+        train_pending_ = false;
+        while (node_->finished_epoch() < int(epochs_)) {
+            auto res = node_->trigger_epoch_if_ready(degree_);
+            if (!res.first) break;
+            print_training_summary(res.second);
+        }
+    }
+}
+
+#ifdef NATIVE
+//------------------------------------------------------------------------------
+// Models that came early are received before any later one from the same
+// sender: those wait on early_mtx_
+//------------------------------------------------------------------------------
+void NodeProtocol::start_training() {
+    {
+        std::lock_guard<std::mutex> lock(train_mtx_);
+        print_training_summary(trigger_training());
+    }
+    {
+        std::lock_guard<std::mutex> lock(early_mtx_);
+        for (const auto &m : early_) node_->receive(m.first, m.second);
+        for (const auto &m : early_models_) {
+            node_->receive(m.first, m.second, m.second->serial_size());
+        }
+        early_.clear();
+        early_models_.clear();
+        started_ = true;
+    }
+    train_while_ready();
+}
+
+//------------------------------------------------------------------------------
+// A neighbour showed up, over the network or in this process
+//------------------------------------------------------------------------------
+void NodeProtocol::present(const std::string &nodeid) {
+    std::unique_lock<std::mutex> lock(protocol_mtx_);
+    bool inserted = neighbors.insert(nodeid).second;
+    assemblers.erase(nodeid);  // reconnected: a new sequence starts
+    if (inserted && neighbors.size() == degree_) {
+        lock.unlock();
+        start_training();
+    }
+}
+
+//------------------------------------------------------------------------------
+// From a node in this process: neither serialized nor copied. Messages are
+// not modified once sent and receivers only read them. Their bytes are
+// accounted as if they went over the network.
+//------------------------------------------------------------------------------
+void NodeProtocol::local_input(unsigned src,
+                               std::shared_ptr<ShareableModel> m) {
+    {
+        std::lock_guard<std::mutex> lock(early_mtx_);
+        if (!started_) {
+            early_models_.emplace_back(src, m);
+            return;
+        }
+    }
+    node_->receive(src, m, m->serial_size());
+    train_while_ready();
 }
 
+//------------------------------------------------------------------------------
+// Each one is told about the others on their input lanes, as a probe would
+//------------------------------------------------------------------------------
+void NodeProtocol::colocate() {
+    std::lock_guard<std::mutex> lock(colocated_mtx_);
+    for (const auto &node : colocated_) {
+        for (const auto &peer : colocated_) {
+            auto netid = node.second->rank_netid.find(peer.first);
+            if (netid == node.second->rank_netid.end()) continue;
+            NodeProtocol *protocol = node.second;
+            std::string nodeid = netid->second;
+            ocall_post("local " + std::to_string(peer.first) + ">" +
+                           std::to_string(node.first),
+                       [protocol, nodeid]() { protocol->present(nodeid); });
+        }
+    }
+}
+#endif
+
 //------------------------------------------------------------------------------
 bool NodeProtocol::all_neighbors_attested() {
     return neighbors.size() == degree_ &&
@@ -89,15 +256,17 @@ bool NodeProtocol::all_neighbors_attested() {
 }
 
 //------------------------------------------------------------------------------
-void NodeProtocol::input(const std::vector<std::string> &message) {
+void NodeProtocol::input(const std::vector<ByteView> &message) {
     if (message.empty()) return;
-    const std::string &nodeid = message[0];
+    std::string nodeid = message[0].str();
+    std::unique_lock<std::mutex> lock(protocol_mtx_);
     if (message.size() == 1) {
-        bool inserted = neighbors.insert(nodeid).second;
 #ifdef NATIVE
-        if (inserted && neighbors.size() == degree_)
-            print_training_summary(trigger_training());
+        lock.unlock();
+        present(nodeid);
 #else
+        bool inserted = neighbors.insert(nodeid).second;
+        assemblers.erase(nodeid);  // reconnected: a new sequence starts
         if (inserted && attested.find(nodeid) == attested.end()) {
             std::cout << nodeid << std::endl;
             attested[nodeid] = false;
@@ -107,24 +276,53 @@ void NodeProtocol::input(const std::vector<std::string> &message) {
     } else {
         /*std::cout << nodeid << " " << message[1].size() << "- "
                   << int(message[1][0]) << std::endl;*/
+        unsigned src = netid_rank[nodeid];
+        auto it = assemblers.find(nodeid);
+        if (it == assemblers.end()) {
+            it = assemblers.emplace(nodeid, ChunkAssembler(max_message_))
+                     .first;
+        }
+        ChunkAssembler &chunks = it->second;
 #ifdef NATIVE
-        std::vector<uint8_t> content(message[1].begin(), message[1].end());
-        node_->receive(netid_rank[nodeid], content);
-        print_training_summary(node_->trigger_epoch_if_ready(degree_).second);
+        lock.unlock();
+        ByteView data = message[1];
+        bool chunked = ChunkHeader::is_chunk(data);
+        if (chunked) {
+            if (!chunks.add(data)) return;
+            data = chunks.message();
+        }
+        {
+            std::lock_guard<std::mutex> early(early_mtx_);
+            if (!started_) {
+                early_.emplace_back(src, data.str());
+                if (chunked) chunks.clear();
+                return;
+            }
+        }
+        node_->receive(src, data);
+        if (chunked) chunks.clear();
+        train_while_ready();
 #else
         if (attested.find(nodeid) == attested.end() || !attested[nodeid]) {
-            attestation_message(nodeid, message[1]);
+            attestation_message(nodeid, message[1].str());
         } else {
-            auto m = decrypt_received(nodeid, message[1]);
-            auto &content = m.second;
-            if (m.first) {
-                node_->receive(netid_rank[nodeid], content);
-                print_training_summary(
-                    node_->trigger_epoch_if_ready(degree_).second);
-            } else {
+            auto key = attestor_.get_key(nodeid);
+            lock.unlock();  // decrypted and merged alongside other senders
+            auto m = decrypt_received(key, message[1].str());
+            if (!m.first) {
                 std::cerr << "Error in decryption of a message from " << nodeid
                           << std::endl;
+                return;
+            }
+            ByteView data(m.second);
+            bool chunked = ChunkHeader::is_chunk(data);
+            if (chunked) {  // decrypted while the next one is on the way
+                if (!chunks.add(data)) return;
+                data = chunks.message();
             }
+            node_->receive(src, data);
+            if (chunked) chunks.clear();
+            train_while_ready();
         }
 #endif
     }
@@ -170,29 +368,72 @@ size_t NodeProtocol::send_queued(const std::string &dstid) {
     size_t ret = 0;
     auto &waiting_queue = waiting[dstid];
     while (!waiting_queue.empty()) {
+        ret += send_model(dstid, *pack(*waiting_queue.front()));
+        waiting_queue.pop();
+    }
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+size_t NodeProtocol::send_frame(const std::string &dst,
+                                const std::vector<uint8_t> &frame) {
 #ifdef NATIVE
-        ret += send(dstid, waiting_queue.front()->serialize());
+    return send(dst, frame);
 #else
-        ret += encrypted_send(dstid, waiting_queue.front()->serialize());
+    return encrypted_send(dst, frame);
 #endif
-        waiting_queue.pop();
+}
+
+//------------------------------------------------------------------------------
+// A chunk is encrypted and handed to the outbox before the next one is cut, so
+// the whole ciphertext never exists at once
+//------------------------------------------------------------------------------
+size_t NodeProtocol::send_model(const std::string &dst,
+                                const std::vector<uint8_t> &wire) {
+    if (chunk_size_ == 0 || wire.size() <= chunk_size_) {
+        return send_frame(dst, wire);
     }
+    size_t ret = 0;
+    std::lock_guard<std::mutex> lock(chunks_mtx_);
+    ChunkWriter chunks(wire, chunk_size_, chunk_sequence_++);
+    while (chunks.next()) ret += send_frame(dst, chunks.frame());
     return ret;
 }
 
+//------------------------------------------------------------------------------
+// Compressed before encryption: ciphertext does not compress
+//------------------------------------------------------------------------------
+std::shared_ptr<const std::vector<uint8_t>> NodeProtocol::pack(
+    const ShareableModel &m) const {
+    return m.wire(compression_, *buffers_);
+}
+
 //------------------------------------------------------------------------------
 size_t NodeProtocol::send(unsigned src, unsigned dst,
                           std::shared_ptr<ShareableModel> m) {
     size_t ret = 0;
     const std::string dstid = rank_netid[dst];
 #ifdef NATIVE
-    ret += send(dstid, m->serialize());
+    NodeProtocol *local = nullptr;
+    if (!route_prefix_.empty()) {
+        std::lock_guard<std::mutex> lock(colocated_mtx_);
+        auto it = colocated_.find(dst);
+        if (it != colocated_.end()) local = it->second;
+    }
+    if (local) {
+        ocall_post("local " + std::to_string(src) + ">" + std::to_string(dst),
+                   [local, src, m]() { local->local_input(src, m); });
+        ret += m->serial_size();
+    } else {
+        ret += send_model(dstid, *pack(*m));
+    }
 #else
+    std::lock_guard<std::mutex> lock(protocol_mtx_);
     if (attested.find(dstid) == attested.end() || !attested[dstid]) {
         waiting[dstid].emplace(m);
     } else {
         ret += send_queued(dstid);
-        ret += encrypted_send(dstid, m->serialize());
+        ret += send_model(dstid, *pack(*m));
     }
 #endif
     return ret;
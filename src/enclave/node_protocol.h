@@ -1,7 +1,14 @@
 #pragma once
 #include <machine_learning/mf_node.h>
+#include <utils/buffer_pool.h>
+#include <utils/compression.h>
+#include <atomic>
+#include <mutex>
 #include <queue>
 #include "args_rex.h"
+#include "message_chunks.h"
+#include "outbound_writer.h"
+#include "peer_traffic.h"
 
 #ifndef NATIVE
 #include <attestor.h>
@@ -10,34 +17,83 @@ extern int printf(const char *fmt, ...);
 }
 #endif
 
+//------------------------------------------------------------------------------
+// input may be called for several senders at once, in order for each one.
+// Training runs on one of those calls at a time: the others leave what they
+// received to it. protocol_mtx_ guards neighbour and attestation state.
+// Models larger than chunk_size_ go out in chunks (see ChunkHeader).
+// Natively, several nodes may share a process: models for one of them are
+// handed over as they are, on the input lane of their sender.
+//------------------------------------------------------------------------------
 class NodeProtocol : Communication {
    public:
     NodeProtocol();
 
     int init(EnclaveArguments &args);
-    void input(const std::vector<std::string> &message);
+    void input(const std::vector<ByteView> &message);
     virtual size_t send(unsigned src, unsigned dst,
                         std::shared_ptr<ShareableModel> m);
+    // The link with a neighbour, as the transport saw it
+    PeerTraffic traffic(unsigned rank);
+#ifdef NATIVE
+    static void colocate();  // hosted nodes meet each other, after init
+#endif
 
    private:
     void print_training_summary(const TrainInfo &info);
+    std::string traffic_summary();
     TrainInfo trigger_training();
+    void train_while_ready();
+#ifdef NATIVE
+    void start_training();
+    void present(const std::string &nodeid);
+    void local_input(unsigned src, std::shared_ptr<ShareableModel> m);
+#endif
     bool all_neighbors_attested();
     template <typename T>
     size_t send(const std::string &dst, const T &data);
     size_t send_queued(const std::string &dstid);
+    size_t send_model(const std::string &dst,
+                      const std::vector<uint8_t> &wire);
+    size_t send_frame(const std::string &dst,
+                      const std::vector<uint8_t> &frame);
+    std::shared_ptr<const std::vector<uint8_t>> pack(
+        const ShareableModel &m) const;
     template <typename T>
     size_t encrypted_send(const std::string &dst, const T &data);
     template <typename T>
     std::pair<bool, std::vector<uint8_t>> decrypt_received(
-        const std::string &src, const T &data);
+        const std::vector<uint8_t> &key, const T &data);
 
     std::shared_ptr<MFNode> node_;
     size_t degree_, steps_per_iteration_;
-    unsigned share_howmany_, local_, epochs_;
-    bool dpsgd_;
+    unsigned share_howmany_, local_, epochs_, staleness_;
+    bool dpsgd_, asyncgossip_, pipelined_;
+    Compression::Codec compression_;
+    size_t chunk_size_;  // 0: models in a single frame
+    size_t max_message_;  // chunked ones received
+    std::mutex chunks_mtx_;  // chunks of a message go out together
+    uint32_t chunk_sequence_;
+    std::shared_ptr<BufferPool> buffers_;  // of what goes on the wire
+    OutboundWriter outbound_;
     std::shared_ptr<TimeProbe> absolutetime_;
-#ifndef NATIVE
+    std::mutex protocol_mtx_, train_mtx_;
+    std::atomic<bool> train_pending_;
+    std::string label_;  // starts epoch lines of nodes sharing a process
+#ifdef NATIVE
+    // Models that arrive before our own neighbours all showed up
+    std::mutex early_mtx_;
+    bool started_;
+    std::vector<std::pair<unsigned, std::string>> early_;
+    std::vector<std::pair<unsigned, std::shared_ptr<ShareableModel>>>
+        early_models_;
+
+    // Nodes of this process by rank. Route prefix picks our own socket.
+    static std::mutex colocated_mtx_;
+    static std::map<unsigned, NodeProtocol *> colocated_;
+    unsigned rank_;
+    std::string route_prefix_;
+#else
     void trigger_attestation(const std::string &nodeid);
     std::string new_attest_msg(const std::string &dst);
     void attestation_message(const std::string &nodeid,
@@ -51,6 +107,7 @@ class NodeProtocol : Communication {
     std::map<std::string, bool> attested;
     std::map<unsigned, std::string> rank_netid;
     std::map<std::string, unsigned> netid_rank;
+    std::map<std::string, ChunkAssembler> assemblers;  // used by its lane only
 };
 
 #include "node_protocol.hpp"
@@ -1,19 +1,16 @@
 #include <aes_utils.h>
-#ifdef NATIVE
-extern ssize_t ocall_send(const char *id, const void *buffer, size_t length);
-#else
+#ifndef NATIVE
 #include "enclave_rex_t.h"
 #endif
 //------------------------------------------------------------------------------
 template <typename T>
 size_t NodeProtocol::send(const std::string &dst, const T &data) {
-    ssize_t ret = 0;
 #ifdef NATIVE
-    ret = ocall_send(dst.c_str(), data.data(), data.size());
-#else
-    ocall_send(&ret, dst.c_str(), data.data(), data.size());
+    if (!route_prefix_.empty()) {
+        return outbound_.send(route_prefix_ + dst, data.data(), data.size());
+    }
 #endif
-    return ret;
+    return outbound_.send(dst, data.data(), data.size());
 }
 
 #ifndef NATIVE
@@ -30,9 +27,8 @@ size_t NodeProtocol::encrypted_send(const std::string &dst, const T &data) {
 //------------------------------------------------------------------------------
 template <typename T>
 std::pair<bool, std::vector<uint8_t>> NodeProtocol::decrypt_received(
-    const std::string &src, const T &data) {
+    const std::vector<uint8_t> &key, const T &data) {
     std::pair<bool, std::vector<uint8_t>> ret(false, std::vector<uint8_t>());
-    auto key = attestor_.get_key(src);
     if (key.empty()) return ret;
 
     auto plain = Crypto::decrypt_aesgcm(key, data);
@@ -0,0 +1,156 @@
+#include "outbound_writer.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#ifdef NATIVE
+extern ssize_t ocall_send(const char *id, const void *buffer, size_t length);
+extern int ocall_outbox_wakeup();
+extern int ocall_outbox_wait(uint64_t consumed);
+#else
+#include <libc_mock/libcpp_mock.h>
+#include <sgx_trts.h>
+#include "enclave_rex_t.h"
+#endif
+
+//------------------------------------------------------------------------------
+OutboundWriter::OutboundWriter() : ring_(nullptr), capacity_(0), head_(0) {}
+
+//------------------------------------------------------------------------------
+bool OutboundWriter::attach(void *ring, size_t capacity) {
+    if (ring == nullptr || capacity == 0 || capacity % 8 != 0) return false;
+#ifndef NATIVE
+    if (!sgx_is_outside_enclave(ring, OutboundRing::bytes(capacity))) {
+        return false;
+    }
+#endif
+    ring_ = static_cast<OutboundRing *>(ring);
+    capacity_ = capacity;
+    head_ = ring_->head;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+uint64_t OutboundWriter::tail() const {
+    uint64_t ret = ring_->tail;
+    if (ret > head_ || head_ - ret > capacity_) {
+        std::cerr << "Corrupt outbound ring" << std::endl;
+        abort();
+    }
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+static ssize_t direct_send(const char *route, const void *data, size_t length) {
+    ssize_t ret = 0;
+#ifdef NATIVE
+    ret = ocall_send(route, data, length);
+#else
+    ocall_send(&ret, route, data, length);
+#endif
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+static bool drain_wakeup() {
+    int ret = 0;
+#ifdef NATIVE
+    ret = ocall_outbox_wakeup();
+#else
+    ocall_outbox_wakeup(&ret);
+#endif
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+static bool drain_wait(uint64_t consumed) {
+    int ret = 0;
+#ifdef NATIVE
+    ret = ocall_outbox_wait(consumed);
+#else
+    ocall_outbox_wait(&ret, consumed);
+#endif
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+bool OutboundWriter::reserve(size_t bytes) {
+    if (head_ + bytes <= capacity_) return true;
+    uint64_t consumed = head_ + bytes - capacity_;
+    while (tail() < consumed) {
+        if (!drain_wait(consumed)) return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// False if it did not get in. Wraps may be left behind: detach skips them.
+//------------------------------------------------------------------------------
+bool OutboundWriter::append(const std::string &route, const void *data,
+                            size_t length, size_t need) {
+    size_t offset = head_ % capacity_, room = capacity_ - offset;
+    if (need > room) {  // the rest of the ring is skipped
+        if (!reserve(room)) return false;
+        OutboundRing::Record wrap = {OutboundRing::kWrap, 0};
+        memcpy(ring_->data() + offset, &wrap, sizeof(wrap));
+        head_ += room;
+        offset = 0;
+    }
+    if (!reserve(need)) return false;
+    uint8_t *p = ring_->data() + offset;
+    OutboundRing::Record record = {uint32_t(route.size()), uint32_t(length)};
+    memcpy(p, &record, sizeof(record));
+    memcpy(p + sizeof(record), route.data(), route.size());
+    memcpy(p + sizeof(record) + route.size(), data, length);
+    head_ += need;
+    ring_->head = head_;
+    if (ring_->sleeping && !drain_wakeup()) detach();  // this one included
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// What the drain left behind goes out in order, copied in first: the ring is
+// untrusted memory
+//------------------------------------------------------------------------------
+void OutboundWriter::detach() {
+    for (uint64_t at = tail(); at < head_;) {
+        size_t offset = at % capacity_;
+        OutboundRing::Record record;
+        memcpy(&record, ring_->data() + offset, sizeof(record));
+        if (record.route == OutboundRing::kWrap) {
+            at += capacity_ - offset;
+            continue;
+        }
+        size_t size = OutboundRing::record_size(record.route, record.length);
+        if (record.route > capacity_ || record.length > capacity_ ||
+            size > capacity_ - offset || size > head_ - at) {
+            std::cerr << "Corrupt outbound ring" << std::endl;
+            abort();
+        }
+        const uint8_t *p = ring_->data() + offset + sizeof(record);
+        std::string route(reinterpret_cast<const char *>(p), record.route);
+        std::vector<uint8_t> payload(p + record.route,
+                                     p + record.route + record.length);
+        direct_send(route.c_str(), payload.data(), payload.size());
+        at += size;
+    }
+    ring_ = nullptr;
+}
+
+//------------------------------------------------------------------------------
+size_t OutboundWriter::send(const std::string &route, const void *data,
+                            size_t length) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    size_t need = OutboundRing::record_size(route.size(), length);
+    if (ring_ && need <= capacity_ / 2 && append(route, data, length, need)) {
+        // as counted by CommunicationZmq: payload and routing ids
+        return length + route.size() -
+               std::count(route.begin(), route.end(), ' ');
+    }
+    if (ring_ && !reserve(capacity_)) detach();  // empty first
+    return direct_send(route.c_str(), data, length);
+}
+
+//------------------------------------------------------------------------------
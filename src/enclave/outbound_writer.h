@@ -0,0 +1,34 @@
+#pragma once
+
+#include <communication/outbound_ring.h>
+
+#include <mutex>
+#include <string>
+
+//------------------------------------------------------------------------------
+// Enclave side of the OutboundRing. Without a ring, or for messages larger
+// than half of it, a send is an ocall, issued once the ring has drained so
+// that messages keep their order. The untrusted counters are checked, never
+// trusted for addressing. Once the drain thread is gone, what it left in the
+// ring is sent with ocalls, and so is everything after.
+//------------------------------------------------------------------------------
+class OutboundWriter {
+   public:
+    OutboundWriter();
+    bool attach(void *ring, size_t capacity);
+    size_t send(const std::string &route, const void *data, size_t length);
+
+   private:
+    uint64_t tail() const;
+    bool reserve(size_t bytes);  // at head_. False if the drain is gone
+    bool append(const std::string &route, const void *data, size_t length,
+                size_t need);
+    void detach();
+
+    OutboundRing *ring_;
+    size_t capacity_;
+    uint64_t head_;
+    std::mutex mtx_;
+};
+
+//------------------------------------------------------------------------------
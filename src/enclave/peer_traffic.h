@@ -0,0 +1,20 @@
+#pragma once
+
+#ifdef __cplusplus
+#include <cstdint>
+extern "C" {
+#else
+#include <stdint.h>
+#endif
+//------------------------------------------------------------------------------
+// What went through the link with a peer. Latencies are of messages from it,
+// from when it sent them to when they were received, in ms: only as accurate
+// as the clocks of both hosts are in sync.
+//------------------------------------------------------------------------------
+struct PeerTraffic {
+    uint64_t bytes_out, bytes_in, messages_out, messages_in;
+    double latency_mean, latency_p50, latency_p99, latency_max;
+};
+#ifdef __cplusplus
+}
+#endif
@@ -32,6 +32,11 @@ bool EnclaveInterface::init(const EnclaveArguments &args) {
     return true;
 }
 
+#ifdef NATIVE
+//------------------------------------------------------------------------------
+void EnclaveInterface::colocate() { ecall_colocate(); }
+#endif
+
 //------------------------------------------------------------------------------
 void EnclaveInterface::finish() {
 #ifdef NATIVE
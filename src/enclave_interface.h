@@ -11,6 +11,11 @@ class EnclaveInterface {
     static void finish();
     template <typename T>
     static int input(const T &);
+#ifdef NATIVE
+    template <typename T>
+    static int input_slot(unsigned slot, const T &);  // of a hosted node
+    static void colocate();
+#endif
 #ifndef NATIVE
     static sgx_enclave_id_t g_eid;
 #endif
@@ -8,9 +8,17 @@ int EnclaveInterface::input(const T& msg) {
     int ret;
 
 #ifdef NATIVE
-    ret = ecall_input(msg.data(), msg.size());
+    ret = ecall_input(0, msg.data(), msg.size());
 #else
     ecall_input(g_eid, &ret, msg.data(), msg.size());
 #endif
     return ret;
 }
+
+#ifdef NATIVE
+//------------------------------------------------------------------------------
+template <typename T>
+int EnclaveInterface::input_slot(unsigned slot, const T& msg) {
+    return ecall_input(slot, msg.data(), msg.size());
+}
+#endif
@@ -21,7 +21,32 @@ static struct argp_option options[] = {
     {"disable_model_sharing", 'x', 0, 0,
      "Disable sharing of models. Enables data sharing by default."},
     {"local", 'l', "number", 0, "Local iterations. Default: 1."},
+    {"partial", 'g', "fraction", 0,
+     "Fraction of the embeddings sent to each neighbour per epoch, sampled "
+     "at random. Default: 1."},
     {"dpsgd", 'd', 0, 0, "Switch to DPSGD. Default: RMW."},
+    {"async", 'a', "staleness", 0,
+     "Switch to barrier-free gossip. Nodes may run at most 'staleness' "
+     "epochs ahead of their slowest neighbour."},
+    {"pipelined", 'i', 0, 0,
+     "Send and test each epoch in the background while the next one trains."},
+    {"budget", 'b', "MB", 0,
+     "Memory for models buffered from neighbours, fractions too. Past it they "
+     "are kept compressed and senders running ahead are throttled. Default: "
+     "unlimited."},
+    {"bandwidth", 'w', "KB", 0,
+     "Model bytes sent to each neighbour per epoch. Only the embeddings that "
+     "changed the most since last sent fit: not with -g. Default: the whole "
+     "model."},
+    {"compress", 'z', "codec", 0,
+     "Compress messages before sending (and encrypting) them: none, fast, "
+     "high or auto (by size). Default: none."},
+    {"delta", 't', 0, 0,
+     "Send each neighbour only what changed since the last model it "
+     "acknowledged."},
+    {"quantize", 'q', "bits", 0,
+     "Send embeddings with 8 or 16 bits per value instead of 64. What is lost "
+     "is added back the next time they are sent. Default: 64."},
     {"embedding", 'k', "size", 0, "Size of feature vectors (embeddings)"},
     {"sharedmemory", 'm', 0, 0,
      "Switch to shared memory communication. You cannot get network "
@@ -37,28 +62,53 @@ static struct argp_option options[] = {
     {"epochs", 'e', "howmany", 0, "Number of epochs. Deafult 100."},
     {"usersdata", 'c', "howmany", 0,
      "Cap the amount of users in the input file. Default: unlimited."},
+    {"checkpoint", 'C', "directory", 0,
+     "Save the model of each node to directory after every epoch."},
+    {"restore", 'R', "directory", 0,
+     "Start from the models saved in directory, at the epoch after theirs."},
+    {"network", 'N', "Mbps:ms:ms:loss", 0,
+     "Emulate the network between nodes: bandwidth, latency, jitter and "
+     "packet loss of every link. Epochs get a simulated time. Default: none."},
+    {"links", 'L', "file", 0,
+     "Emulate the links listed in file, one per line as 'src dst "
+     "Mbps:ms:ms:loss'. Others are as given by -N."},
     {0}};
 
 //------------------------------------------------------------------------------
 struct Arguments {
     Arguments()
-        : datashare(false),
+        : output_dir(DEFAULTDIR),
+          datashare(false),
           modelshare(true),
           dpsgd(false),
           randgraph(false),
+          shared_memory(false),
+          asyncgossip(false),
+          pipelined(false),
+          delta(false),
           local(1),
-          output_dir(DEFAULTDIR),
           num_nodes(10),
-          steps_per_iteration(30),
           share_howmany(20),
-          shared_memory(false),
           epochs(100),
-          capusers(-1), embedding_size(10) {}
+          staleness(0),
+          quantize(64),
+          steps_per_iteration(30),
+          capusers(-1),
+          embedding_size(10),
+          budget(0),
+          bandwidth(0),
+          share_fraction(1.),
+          compression(Compression::NONE) {}
 
-    std::string input_fname, output_dir;
-    bool datashare, modelshare, dpsgd, randgraph, shared_memory;
-    unsigned local, num_nodes, share_howmany, epochs;
-    size_t steps_per_iteration, capusers, embedding_size;
+    std::string input_fname, output_dir, checkpoint_dir, restore_dir,
+        network, links_fname;
+    bool datashare, modelshare, dpsgd, randgraph, shared_memory, asyncgossip,
+        pipelined, delta;
+    unsigned local, num_nodes, share_howmany, epochs, staleness, quantize;
+    size_t steps_per_iteration, capusers, embedding_size, budget,
+        bandwidth;
+    double share_fraction;
+    Compression::Codec compression;
 };
 
 //------------------------------------------------------------------------------
@@ -77,6 +127,13 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 'd':
             args->dpsgd = true;
             break;
+        case 'a':
+            args->asyncgossip = true;
+            args->staleness = std::atoi(arg);
+            break;
+        case 'i':
+            args->pipelined = true;
+            break;
         case 'r':
             args->randgraph = true;
             break;
@@ -107,6 +164,47 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 'c':
             args->capusers = std::atoi(arg);
             break;
+        case 'g':
+            args->share_fraction = std::atof(arg);
+            break;
+        case 'b': {
+            char *end;
+            double mb = strtod(arg, &end);
+            args->budget = size_t(mb * (1 << 20));
+            if (end == arg || *end || mb < 0 || (mb > 0 && !args->budget)) {
+                argp_error(state, "budget is a number of MB, 0: unlimited");
+            }
+            break;
+        }
+        case 'w':
+            args->bandwidth = size_t(std::atol(arg)) << 10;
+            break;
+        case 't':
+            args->delta = true;
+            break;
+        case 'z':
+            args->compression = Compression::parse(arg);
+            break;
+        case 'q':
+            args->quantize = std::atoi(arg);
+            break;
+        case 'C':
+            args->checkpoint_dir = arg;
+            break;
+        case 'R':
+            args->restore_dir = arg;
+            break;
+        case 'N':
+            args->network = arg;
+            break;
+        case 'L':
+            args->links_fname = arg;
+            break;
+        case ARGP_KEY_END:
+            if (args->bandwidth && args->share_fraction != 1) {
+                argp_error(state, "-w and -g both choose what is shared: use one");
+            }
+            break;
         default:
             return ARGP_ERR_UNKNOWN;
     };
@@ -198,21 +296,46 @@ int main(int argc, char **argv) {
     }
 
     boost::filesystem::create_directories(args.output_dir);
+    if (!args.checkpoint_dir.empty()) {
+        boost::filesystem::create_directories(args.checkpoint_dir);
+    }
 
     std::vector<MFNode> nodes;
     if (!read_data(fname, nodes, args.num_nodes, args.modelshare,
                    args.datashare, args.capusers, args.output_dir))
         return 1;
+    for (auto &n : nodes) {
+        n.set_partial_sharing(args.share_fraction);
+        n.set_memory_budget(args.budget);
+        n.set_share_budget(args.bandwidth);
+        n.set_quantization(args.quantize);
+        n.set_delta_encoding(args.delta);
+        n.set_checkpoint(args.checkpoint_dir, args.restore_dir);
+    }
 
     //std::cout << "Shared Memory: " << (args.shared_memory ? "Yes" : "No")
     //          << std::endl;
-    MFCoordinator coordinator(nodes, args.shared_memory);
+    MFCoordinator coordinator(nodes, args.shared_memory, args.pipelined);
+    coordinator.set_compression(args.compression);
+    if (!args.network.empty() || !args.links_fname.empty()) {
+        LinkSpec defaults;
+        if (!args.network.empty() && !LinkSpec::parse(args.network, defaults)) {
+            std::cerr << "Invalid network: " << args.network << std::endl;
+            return 1;
+        }
+        std::unique_ptr<NetworkModel> network(new NetworkModel(defaults));
+        if (!args.links_fname.empty() && !network->load_links(args.links_fname))
+            return 1;
+        coordinator.set_network(std::move(network));
+    }
 
     //std::cout << (args.dpsgd ? "DPSGD" : "RMW") << std::endl;
 
     // lowscore, highscore, matrix_rank, learning, regularization, iterations
-    coordinator.run(1, 10, args.embedding_size, 0.005, 0.1, args.epochs, args.dpsgd,
+    ModelMergerType merger =
+        args.asyncgossip ? ASYNC : (args.dpsgd ? DPSGD : RMW);
+    coordinator.run(1, 10, args.embedding_size, 0.005, 0.1, args.epochs, merger,
                     args.randgraph, args.local, args.steps_per_iteration,
-                    args.share_howmany);
+                    args.share_howmany, args.staleness);
     return 0;
 }
@@ -18,11 +18,15 @@ static char doc[] =
     "MF local training: PoC to check implementation correctness";
 static char args_doc[] = "";
 static struct argp_option options[] = {
-    {"filename", 'f', "filename", 0, "Data file"}, {0}};
+    {"filename", 'f', "filename", 0, "Data file"},
+    {"checkpoint", 'C', "file", 0, "Save the model to file after every epoch."},
+    {"restore", 'R', "file", 0,
+     "Start from the model saved in file, at the epoch after its own."},
+    {0}};
 
 //------------------------------------------------------------------------------
 struct Arguments {
-    std::string input_fname;
+    std::string input_fname, checkpoint, restore;
 };
 
 //------------------------------------------------------------------------------
@@ -32,6 +36,12 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 'f':
             args->input_fname = arg;
             break;
+        case 'C':
+            args->checkpoint = arg;
+            break;
+        case 'R':
+            args->restore = arg;
+            break;
         default:
             return ARGP_ERR_UNKNOWN;
     };
@@ -46,7 +56,8 @@ MatrixFactorizationModel train(Eigen::SparseMatrix<uint8_t> &ratings) {
 */
 
 //------------------------------------------------------------------------------
-void run(Ratings &ratings, TripletVector<uint8_t> &test) {
+void run(Ratings &ratings, TripletVector<uint8_t> &test,
+         const Arguments &args) {
     /*
         MatrixFactorizationModel model = train(ratings);
         printf("RMSE = %lf\n", test_model(test, model));
@@ -65,7 +76,8 @@ void run(Ratings &ratings, TripletVector<uint8_t> &test) {
                     auto shared = std::make_shared<
                         std::packaged_task<MatrixFactorizationModel()>>(
                         std::bind(&MFSGD::trainX, ratings, 2, 10, rank, eta,
-                                  lambda, iter, test));
+                                  lambda, iter, test, args.restore,
+                                  args.checkpoint));
                     std::stringstream ss;
                     ss << "r=" << rank << " n=" << eta << " l=" << lambda
                        << " n=" << iter;
@@ -119,7 +131,7 @@ int main(int argc, char **argv) {
 
     if (!read_data(fname, ratings, test)) return 1;
 
-    run(ratings, test);
+    run(ratings, test, args);
 
     return 0;
 }
@@ -1,6 +1,9 @@
 #include "matrix_factorization.h"
 #include <utils/time_probe.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 
 //------------------------------------------------------------------------------
@@ -64,37 +67,163 @@ void MatrixFactorizationModel::make_compressed() {
 
 //------------------------------------------------------------------------------
 // Iterates through Other and average its non-zero columns with Y, i.e.,
-// Y.col(i) = average(Y.col(i), Other.col(i))
+// Y.col(i) = (1 - w) * Y.col(i) + w * Other.col(i)
 //------------------------------------------------------------------------------
-void MatrixFactorizationModel::item_merge_column(Sparse &Y,
-                                                 const Sparse &Other) {
+void MatrixFactorizationModel::item_merge_column(Sparse &Y, const Sparse &Other,
+                                                 double w) {
     sparse_matrix_outer_iterate(Other, [&](Sparse::InnerIterator it, int i) {
         int item = it.col();
         if (!init_item(item, Other.col(item))) {
-            Y.col(item) = (Y.col(item) + Other.col(item)) / 2.;
+            Y.col(item) = (1. - w) * Y.col(item) + w * Other.col(item);
         }
     });
 }
 
 //------------------------------------------------------------------------------
-void MatrixFactorizationModel::user_merge_column(Sparse &X,
-                                                 const Sparse &Other) {
+void MatrixFactorizationModel::user_merge_column(Sparse &X, const Sparse &Other,
+                                                 double w) {
     sparse_matrix_outer_iterate(Other, [&](Sparse::InnerIterator it, int i) {
         int user = it.col();
         if (!init_user(user, Other.col(user))) {
-            X.col(user) = (X.col(user) + Other.col(user)) / 2.;
+            X.col(user) = (1. - w) * X.col(user) + w * Other.col(user);
         }
     });
 }
 
 //------------------------------------------------------------------------------
-void MatrixFactorizationModel::merge_average(
-    const MatrixFactorizationModel &m) {
-    item_merge_column(weights_.items, m.weights_.items);
-    item_merge_column(weights_.item_biases, m.weights_.item_biases);
+void MatrixFactorizationModel::merge_average(const MatrixFactorizationModel &m,
+                                             double weight) {
+    item_merge_column(weights_.items, m.weights_.items, weight);
+    item_merge_column(weights_.item_biases, m.weights_.item_biases, weight);
 
-    user_merge_column(weights_.users, m.weights_.users);
-    user_merge_column(weights_.user_biases, m.weights_.user_biases);
+    user_merge_column(weights_.users, m.weights_.users, weight);
+    user_merge_column(weights_.user_biases, m.weights_.user_biases, weight);
+}
+
+//------------------------------------------------------------------------------
+// Picks ceil(fraction * #blocks) random blocks of `block` consecutive ids
+//------------------------------------------------------------------------------
+static std::vector<bool> sample_blocks(size_t n, double fraction,
+                                       unsigned block) {
+    size_t nblocks = (n + block - 1) / block,
+           k = std::min(nblocks, size_t(std::ceil(fraction * nblocks)));
+    std::vector<size_t> blocks(nblocks);
+    for (size_t i = 0; i < nblocks; ++i) blocks[i] = i;
+    for (size_t i = 0; i < k; ++i) {  // partial Fisher-Yates
+        std::swap(blocks[i], blocks[i + rand() % (nblocks - i)]);
+    }
+    std::vector<bool> keep(n, false);
+    for (size_t i = 0; i < k; ++i) {
+        for (size_t j = blocks[i] * block;
+             j < n && j < (blocks[i] + 1) * block; ++j) {
+            keep[j] = true;
+        }
+    }
+    return keep;
+}
+
+//------------------------------------------------------------------------------
+static Sparse keep_columns(const Sparse &m, const std::vector<bool> &keep) {
+    TripletVector<double> kept;
+    sparse_matrix_iterate(m, [&](Sparse::InnerIterator it) {
+        if (size_t(it.col()) < keep.size() && keep[it.col()]) {
+            kept.emplace_back(it.row(), it.col(), it.value());
+        }
+    });
+    Sparse ret(m.rows(), m.cols());
+    ret.setFromTriplets(kept.begin(), kept.end());
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// Partial model: a random subset of user and item embeddings (with biases).
+// Absent ids are all-zero columns, which merging already skips.
+//------------------------------------------------------------------------------
+MatrixFactorizationModel MatrixFactorizationModel::sample(
+    double fraction, unsigned block) const {
+    MatrixFactorizationModel ret(rank_);
+    std::vector<bool> users =
+        sample_blocks(weights_.users.cols(), fraction, block);
+    ret.weights_.users = keep_columns(weights_.users, users);
+    ret.weights_.user_biases = keep_columns(weights_.user_biases, users);
+
+    std::vector<bool> items =
+        sample_blocks(weights_.items.cols(), fraction, block);
+    ret.weights_.items = keep_columns(weights_.items, items);
+    ret.weights_.item_biases = keep_columns(weights_.item_biases, items);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// How far embedding (factors and bias) col moved away from its value in since.
+// Columns past the end of a matrix are zeros.
+//------------------------------------------------------------------------------
+static double column_drift(const Sparse &factors, const Sparse &biases,
+                           const Sparse &since_factors,
+                           const Sparse &since_biases, int col) {
+    auto bias = [col](const Sparse &b) {
+        return b.rows() > 0 && col < b.cols() ? b.coeff(0, col) : 0.;
+    };
+    double moved = std::pow(bias(biases) - bias(since_biases), 2);
+    if (col >= since_factors.cols()) {
+        return Sparse(factors.col(col)).squaredNorm() + moved;
+    }
+    return Sparse(factors.col(col) - since_factors.col(col)).squaredNorm() +
+           moved;
+}
+
+//------------------------------------------------------------------------------
+// Partial model with the embeddings that changed the most since `since`, as
+// many as fit in `budget` serialized bytes
+//------------------------------------------------------------------------------
+MatrixFactorizationModel MatrixFactorizationModel::top_changed(
+    const MatrixFactorizationModel &since, size_t budget,
+    MFWeights::Precision p) const {
+    struct Candidate {
+        double drift;
+        bool user;
+        int col;
+    };
+    std::vector<Candidate> candidates;
+    auto rank_columns = [&](const Sparse &factors, const Sparse &biases,
+                            const Sparse &since_factors,
+                            const Sparse &since_biases, bool user) {
+        for (int c = 0; c < factors.outerSize(); ++c) {
+            if (!Sparse::InnerIterator(factors, c)) continue;  // not ours
+            candidates.push_back(Candidate{
+                column_drift(factors, biases, since_factors, since_biases, c),
+                user, c});
+        }
+    };
+    rank_columns(weights_.users, weights_.user_biases, since.weights_.users,
+                 since.weights_.user_biases, true);
+    rank_columns(weights_.items, weights_.item_biases, since.weights_.items,
+                 since.weights_.item_biases, false);
+
+    // Every embedding costs the same on the wire
+    size_t overhead = sizeof(rank_) + MFWeights::serial_overhead(),
+           k = budget > overhead ? (budget - overhead) /
+                                       MFWeights::serial_column_size(rank_, p)
+                                 : 0;
+    k = std::min(k, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + k,
+                      candidates.end(),
+                      [](const Candidate &a, const Candidate &b) {
+                          return a.drift > b.drift;
+                      });
+
+    std::vector<bool> users(weights_.users.cols(), false),
+        items(weights_.items.cols(), false);
+    for (size_t i = 0; i < k; ++i) {
+        (candidates[i].user ? users : items)[candidates[i].col] = true;
+    }
+
+    MatrixFactorizationModel ret(rank_);
+    ret.weights_.users = keep_columns(weights_.users, users);
+    ret.weights_.user_biases = keep_columns(weights_.user_biases, users);
+    ret.weights_.items = keep_columns(weights_.items, items);
+    ret.weights_.item_biases = keep_columns(weights_.item_biases, items);
+    return ret;
 }
 
 //------------------------------------------------------------------------------
@@ -270,6 +399,34 @@ void MatrixFactorizationModel::find_space(int user, int item, const Sparse &col,
     }
 }
 
+//------------------------------------------------------------------------------
+// Sent embeddings lose precision; residual keeps what was lost (see MFWeights)
+//------------------------------------------------------------------------------
+void MatrixFactorizationModel::quantize(MFWeights::Precision p,
+                                        MatrixFactorizationModel *residual) {
+    weights_.quantize(p, residual ? &residual->weights_ : nullptr);
+}
+
+//------------------------------------------------------------------------------
+// Delta encoding. The delta has the embeddings of this model, as differences
+// to base; applying it to the same base gives them back.
+//------------------------------------------------------------------------------
+MatrixFactorizationModel MatrixFactorizationModel::delta_from(
+    const MatrixFactorizationModel &base) const {
+    MatrixFactorizationModel ret(rank_);
+    ret.weights_ = weights_.combined(base.weights_, -1.);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+MatrixFactorizationModel MatrixFactorizationModel::delta_applied(
+    const MatrixFactorizationModel &base) const {
+    MatrixFactorizationModel ret(rank_);
+    ret.weights_ = weights_.combined(base.weights_, 1.);
+    ret.weights_.precision = MFWeights::FP64;
+    return ret;
+}
+
 //------------------------------------------------------------------------------
 size_t MatrixFactorizationModel::estimate_serial_size() const {
     return sizeof(rank_) + weights_.estimate_serial_size();
@@ -284,10 +441,13 @@ void MatrixFactorizationModel::serialize_append(
 }
 
 //------------------------------------------------------------------------------
-size_t MatrixFactorizationModel::deserialize(const std::vector<uint8_t> &data,
-                                             size_t offset) {
-    rank_ = *reinterpret_cast<const int *>(&data[offset]);
-    return weights_.deserialize(data, offset + sizeof(rank_));
+size_t MatrixFactorizationModel::deserialize(ByteView data, size_t offset) {
+    if (offset > data.size() || data.size() - offset < sizeof(rank_)) {
+        std::cerr << "Malformed model: short message" << std::endl;
+        abort();
+    }
+    memcpy(&rank_, &data[offset], sizeof(rank_));
+    return weights_.deserialize(data, offset + sizeof(rank_), rank_);
 }
 
 //------------------------------------------------------------------------------
@@ -4,6 +4,7 @@
 
 #include <memory>
 #include <set>
+#include <string>
 #include <vector>
 
 #include "mf_weights.h"
@@ -21,22 +22,33 @@ class MatrixFactorizationModel {
     std::vector<int> recommend_user(int item, int how_many);
     std::vector<int> recommend_item(int user, int how_many);
     int rank() { return rank_; }
+    MFWeights::Precision precision() const { return weights_.precision; }
     const Sparse& user_features() { return weights_.users; }
     const Sparse& item_features() { return weights_.items; }
     double rmse(const TripletVector<uint8_t>& testset);
     void get_factors(int user, int item);
 
     void serialize_append(std::vector<uint8_t> &out) const;
-    size_t deserialize(const std::vector<uint8_t> &data, size_t offset);
+    size_t deserialize(ByteView data, size_t offset);
     void find_space(int user, int item, const Sparse& col = Sparse(),
                     double b = -1);
 
     // Merging models
-    void merge_average(const MatrixFactorizationModel& w);
+    void merge_average(const MatrixFactorizationModel& w,
+                       double weight = .5);
     void merge_weighted(size_t my_degree, const DegreesAndModels& models);
-
-    void item_merge_column(Sparse& Y, const Sparse& Other);
-    void user_merge_column(Sparse& X, const Sparse& Other);
+    MatrixFactorizationModel sample(double fraction, unsigned block) const;
+    MatrixFactorizationModel top_changed(
+        const MatrixFactorizationModel& since, size_t budget,
+        MFWeights::Precision p = MFWeights::FP64) const;
+    void quantize(MFWeights::Precision p, MatrixFactorizationModel* residual);
+    MatrixFactorizationModel delta_from(
+        const MatrixFactorizationModel& base) const;
+    MatrixFactorizationModel delta_applied(
+        const MatrixFactorizationModel& base) const;
+
+    void item_merge_column(Sparse& Y, const Sparse& Other, double w = .5);
+    void user_merge_column(Sparse& X, const Sparse& Other, double w = .5);
 
     bool init_item(int item, const Sparse& column);
     bool init_user(int user, const Sparse& column);
@@ -68,6 +80,7 @@ class MatrixFactorizationModel {
     int rank_;
     MFWeights weights_;
     friend class MFSGD;
+    friend class MFCheckpoint;
 };
 
 //------------------------------------------------------------------------------
@@ -85,12 +98,16 @@ class MFSGD {
     MFSGD(HyperMFSGD h);
     virtual std::pair<double, size_t> train() = 0;
     MatrixFactorizationModel model() const { return model_; }
+    bool save_checkpoint(const std::string& path, int epoch) const;
+    int restore_checkpoint(const std::string& path);
     static MatrixFactorizationModel trainX(const Ratings& ratings,
                                            uint8_t lowscore, uint8_t highscore,
                                            int rank, double learning,
                                            double regularization,
                                            int iterations,
-                                           const TripletVector<uint8_t>& test);
+                                           const TripletVector<uint8_t>& test,
+                                           const std::string& restore = "",
+                                           const std::string& checkpoint = "");
 
    protected:
     double train(int user, int item, double value);
@@ -10,22 +10,29 @@ MatrixFactorizationModel MFSGD::trainX(const Ratings &ratings, uint8_t lowscore,
                                        uint8_t highscore, int matrix_rank,
                                        double learning, double regularization,
                                        int iterations,
-                                       const TripletVector<uint8_t> &test) {
+                                       const TripletVector<uint8_t> &test,
+                                       const std::string &restore,
+                                       const std::string &checkpoint) {
     double init_bias = lowscore,
            init_factor = sqrt(double(highscore - lowscore) / matrix_rank);
     HyperMFSGD hyper(matrix_rank, learning, regularization, init_bias,
                      init_factor);
     MFSGDCentralized trainer(ratings, hyper);
+    int first = 0;
+    if (!restore.empty()) {  // init() leaves restored embeddings as they are
+        first = trainer.restore_checkpoint(restore) + 1;
+    }
     trainer.init();
     std::cout << "epoch;trainerr;testerr\n";
     TimeProbe time;
     std::cout << "epoch;timestamp;trainerr;testerr\n";
     time.start();
-    for (int i = 0; i < iterations; ++i) {
+    for (int i = first; i < iterations; ++i) {
         auto res = trainer.train();
         std::cout << i << ";" << time.stop() << ";"
                   << sqrt(res.first / res.second) << ";"
                   << trainer.model().rmse(test) << std::endl;
+        if (!checkpoint.empty()) trainer.save_checkpoint(checkpoint, i);
     }
     return trainer.model();
 }
@@ -0,0 +1,197 @@
+#include "mf_checkpoint.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+static const char kMagic[8] = {'R', 'E', 'X', 'M', 'F', 'C', 'K', 'P'};
+static const uint32_t kVersion = 1;
+static const size_t kAlignment = 64;
+
+//------------------------------------------------------------------------------
+static bool write_all(int fd, const void *data, size_t size) {
+    const char *p = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+static bool increasing(const int32_t *ids, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (ids[i] < 0 || (i > 0 && ids[i] <= ids[i - 1])) return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+size_t MFCheckpoint::block_offset(size_t users, size_t items) {
+    size_t ids_end = sizeof(Header) + (users + items) * (sizeof(int32_t) + 1);
+    return (ids_end + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+//------------------------------------------------------------------------------
+// Written aside and renamed over path: a crash leaves the previous checkpoint
+//------------------------------------------------------------------------------
+bool MFCheckpoint::save(const std::string &path,
+                        const MatrixFactorizationModel &m, int epoch) {
+    const MFWeights &w = m.weights_;
+    std::vector<int32_t> ids;
+    std::vector<uint8_t> flags;
+    std::vector<double> values;
+    MFWeights::dense_columns(w.users, w.user_biases, ids, flags, values);
+    size_t users = ids.size();
+    MFWeights::dense_columns(w.items, w.item_biases, ids, flags, values);
+
+    Header header;
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.rank = m.rank_;
+    header.epoch = epoch;
+    header.reserved = 0;
+    header.users = users;
+    header.items = ids.size() - users;
+    header.block_offset = block_offset(header.users, header.items);
+    header.size = header.block_offset + values.size() * sizeof(double);
+    std::vector<char> padding(header.block_offset - sizeof(header) -
+                              ids.size() * (sizeof(int32_t) + 1));
+
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && write_all(fd, &header, sizeof(header)) &&
+              write_all(fd, ids.data(), ids.size() * sizeof(int32_t)) &&
+              write_all(fd, flags.data(), flags.size()) &&
+              write_all(fd, padding.data(), padding.size()) &&
+              write_all(fd, values.data(), values.size() * sizeof(double)) &&
+              fsync(fd) == 0;
+    if (fd >= 0) ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        std::cerr << "Could not save checkpoint " << path << ": "
+                  << strerror(errno) << std::endl;
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+MFCheckpoint::MFCheckpoint(const std::string &path)
+    : base_(nullptr), size_(0), header_(nullptr) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::cerr << "Could not open checkpoint " << path << ": "
+                  << strerror(errno) << std::endl;
+        abort();
+    }
+    size_ = st.st_size;
+    void *addr = size_ >= sizeof(Header)
+                     ? mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0)
+                     : MAP_FAILED;
+    close(fd);  // the mapping stays
+    if (addr == MAP_FAILED) {
+        std::cerr << "Could not map checkpoint " << path << std::endl;
+        abort();
+    }
+    base_ = static_cast<const uint8_t *>(addr);
+    header_ = reinterpret_cast<const Header *>(base_);
+
+    const Header &h = *header_;
+    if (memcmp(h.magic, kMagic, sizeof(kMagic)) != 0 ||
+        h.version != kVersion || h.rank <= 0 ||
+        h.rank > MFWeights::kMaxRank || h.size != size_ ||
+        h.users > h.size || h.items > h.size ||
+        h.block_offset != block_offset(h.users, h.items) ||
+        h.block_offset > h.size ||
+        (h.size - h.block_offset) / sizeof(double) !=
+            (h.users + h.items) * (h.rank + 1)) {
+        std::cerr << "Invalid checkpoint " << path << std::endl;
+        abort();
+    }
+    if (!increasing(user_ids(), users()) || !increasing(item_ids(), items())) {
+        std::cerr << "Invalid checkpoint " << path << ": ids out of order"
+                  << std::endl;
+        abort();
+    }
+    if ((users() && !MFWeights::plausible_columns(
+                        uint64_t(user_ids()[users() - 1]) + 1, h.size)) ||
+        (items() && !MFWeights::plausible_columns(
+                        uint64_t(item_ids()[items() - 1]) + 1, h.size))) {
+        std::cerr << "Invalid checkpoint " << path << ": ids out of range"
+                  << std::endl;
+        abort();
+    }
+}
+
+//------------------------------------------------------------------------------
+MFCheckpoint::~MFCheckpoint() {
+    munmap(const_cast<uint8_t *>(base_), size_);
+}
+
+//------------------------------------------------------------------------------
+const int32_t *MFCheckpoint::user_ids() const {
+    return reinterpret_cast<const int32_t *>(base_ + sizeof(Header));
+}
+
+//------------------------------------------------------------------------------
+const int32_t *MFCheckpoint::item_ids() const { return user_ids() + users(); }
+
+//------------------------------------------------------------------------------
+MFCheckpoint::Block MFCheckpoint::user_embeddings() const {
+    const double *block =
+        reinterpret_cast<const double *>(base_ + header_->block_offset);
+    return Block(block, rank() + 1, users());
+}
+
+//------------------------------------------------------------------------------
+MFCheckpoint::Block MFCheckpoint::item_embeddings() const {
+    const double *block =
+        reinterpret_cast<const double *>(base_ + header_->block_offset);
+    return Block(block + (rank() + 1) * users(), rank() + 1, items());
+}
+
+//------------------------------------------------------------------------------
+MatrixFactorizationModel MFCheckpoint::model() const {
+    MatrixFactorizationModel ret(rank());
+    const uint8_t *flags =
+        reinterpret_cast<const uint8_t *>(item_ids() + items());
+    MFWeights &w = ret.weights_;
+    MFWeights::from_dense_columns(rank(), users(), user_ids(), flags,
+                                  user_embeddings().data(), w.users,
+                                  w.user_biases);
+    MFWeights::from_dense_columns(rank(), items(), item_ids(), flags + users(),
+                                  item_embeddings().data(), w.items,
+                                  w.item_biases);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// MFSGD hooks: resume a run or warm-start one from a trained model
+//------------------------------------------------------------------------------
+bool MFSGD::save_checkpoint(const std::string &path, int epoch) const {
+    return MFCheckpoint::save(path, model_, epoch);
+}
+
+//------------------------------------------------------------------------------
+int MFSGD::restore_checkpoint(const std::string &path) {
+    MFCheckpoint checkpoint(path);
+    if (checkpoint.rank() != hyper_.rank) {
+        std::cerr << "Checkpoint " << path << " has embeddings of size "
+                  << checkpoint.rank() << ", not " << hyper_.rank << std::endl;
+        abort();
+    }
+    model_ = checkpoint.model();
+    return checkpoint.epoch();
+}
+
+//------------------------------------------------------------------------------
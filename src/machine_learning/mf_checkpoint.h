@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "matrix_factorization.h"
+
+//------------------------------------------------------------------------------
+// Model checkpoint: header, id map (user ids, item ids, then the flags of
+// each), and a dense block of rank + 1 doubles per embedding (factors, then
+// the bias), users first. The block is cache-line aligned and read in place
+// from a read-only mapping of the file. Native byte order.
+//------------------------------------------------------------------------------
+class MFCheckpoint {
+   public:
+    typedef Eigen::Map<const Dense, Eigen::Aligned> Block;
+
+    explicit MFCheckpoint(const std::string &path);  // aborts if invalid
+    ~MFCheckpoint();
+    static bool save(const std::string &path, const MatrixFactorizationModel &m,
+                     int epoch);
+
+    int rank() const { return header_->rank; }
+    int epoch() const { return header_->epoch; }
+    size_t users() const { return header_->users; }
+    size_t items() const { return header_->items; }
+    const int32_t *user_ids() const;
+    const int32_t *item_ids() const;
+    Block user_embeddings() const;  // (rank + 1) x users
+    Block item_embeddings() const;  // (rank + 1) x items
+    MatrixFactorizationModel model() const;
+
+   private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        int32_t rank, epoch;
+        uint32_t reserved;
+        uint64_t users, items, block_offset, size;
+    };
+    static size_t block_offset(size_t users, size_t items);
+
+    MFCheckpoint(const MFCheckpoint &) = delete;
+    MFCheckpoint &operator=(const MFCheckpoint &) = delete;
+
+    const uint8_t *base_;
+    size_t size_;
+    const Header *header_;
+};
+
+//------------------------------------------------------------------------------
@@ -6,6 +6,7 @@
 #include <boost/graph/make_connected.hpp>
 #include <boost/graph/small_world_generator.hpp>
 #include <boost/random/linear_congruential.hpp>
+#include <algorithm>
 #include <future>
 
 //------------------------------------------------------------------------------
@@ -25,8 +26,33 @@ Graph random_graph_erdos_renyi(unsigned num_nodes) {
 //------------------------------------------------------------------------------
 // MFCoordinator
 //------------------------------------------------------------------------------
-MFCoordinator::MFCoordinator(std::vector<MFNode> &nodes, bool shared_memory)
-    : nodes_(nodes), shared_memory_(shared_memory) {}
+MFCoordinator::MFCoordinator(std::vector<MFNode> &nodes, bool shared_memory,
+                             bool pipelined)
+    : nodes_(nodes),
+      shared_memory_(shared_memory),
+      pipelined_(pipelined),
+      compression_(Compression::NONE),
+      async_tp_(nullptr),
+      sim_barrier_(true) {
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+        buffers_.emplace_back(std::make_shared<BufferPool>());
+    }
+}
+
+//------------------------------------------------------------------------------
+void MFCoordinator::set_compression(Compression::Codec codec) {
+    compression_ = codec;
+}
+
+//------------------------------------------------------------------------------
+void MFCoordinator::set_network(std::unique_ptr<NetworkModel> network) {
+    network_ = std::move(network);
+    sim_clock_.assign(nodes_.size(), 0);
+    sim_ready_.assign(nodes_.size(), 0);
+    sim_arrived_.assign(nodes_.size(), 0);
+    sim_started_.assign(nodes_.size(), Clock::time_point());
+    sim_running_.assign(nodes_.size(), 0);
+}
 
 //------------------------------------------------------------------------------
 unsigned MFCoordinator::establish_relations(Graph &G) {
@@ -57,17 +83,81 @@ void MFCoordinator::coordinate_epoch(int epoch, ThreadPool &tp) {
     epoch_stats_.start();
     for (auto &n : nodes_) {
         auto shared = std::make_shared<std::packaged_task<TrainInfo()>>(
-            std::bind(&MFNode::train_and_share, &n, epoch));
+            std::bind(&MFCoordinator::train_and_share, this, std::ref(n),
+                      epoch));
         results.emplace_back(std::make_pair(n.rank(), shared->get_future()));
         tp.add_task([shared]() { (*shared)(); });
     }
 
+    std::vector<TrainInfo> infos;
+    for (auto &kv : results) {
+        kv.second.wait();  // barrier
+        infos.emplace_back(kv.second.get());
+    }
+    epoch_stats_.stop();
+    if (network_) {  // what was sent in this epoch is merged in the next
+        std::lock_guard<std::mutex> lock(sim_mtx_);
+        sim_ready_ = sim_arrived_;
+    }
+    print_epoch(epoch, infos);
+    // std::cout << epoch_stats_.summary() << std::endl;
+}
+
+//------------------------------------------------------------------------------
+// A node starts once its clock reached the last model it merges: with a
+// barrier, those sent in the previous epoch. The training then takes as long
+// as it really does. Pipelined nodes finish the epoch later on, in their own
+// worker: only what happens in here is accounted.
+//------------------------------------------------------------------------------
+TrainInfo MFCoordinator::train_and_share(MFNode &n, int epoch) {
+    sim_begin(n.rank());
+    TrainInfo info = n.train_and_share(epoch);
+    sim_end(n, true);
+    return info;
+}
+
+//------------------------------------------------------------------------------
+void MFCoordinator::sim_begin(unsigned rank) {
+    if (!network_) return;
+    std::lock_guard<std::mutex> lock(sim_mtx_);
+    if (!sim_barrier_) sim_ready_[rank] = sim_arrived_[rank];
+    sim_clock_[rank] = std::max(sim_clock_[rank], sim_ready_[rank]);
+    sim_started_[rank] = Clock::now();
+    sim_running_[rank] = 1;
+}
+
+//------------------------------------------------------------------------------
+// Attempts that did not train, as asynchronous nodes make while waiting on a
+// straggler, cost no simulated time
+//------------------------------------------------------------------------------
+void MFCoordinator::sim_end(MFNode &n, bool trained) {
+    if (!network_) return;
+    unsigned rank = n.rank();
+    std::lock_guard<std::mutex> lock(sim_mtx_);
+    sim_running_[rank] = 0;
+    if (!trained) return;
+    std::chrono::duration<double> elapsed = Clock::now() - sim_started_[rank];
+    sim_clock_[rank] += elapsed.count();
+    double &done = sim_epochs_[n.finished_epoch()];
+    done = std::max(done, sim_clock_[rank]);
+}
+
+//------------------------------------------------------------------------------
+// Callers hold sim_mtx_
+//------------------------------------------------------------------------------
+double MFCoordinator::sim_now(unsigned rank) {
+    if (!sim_running_[rank]) return sim_clock_[rank];
+    std::chrono::duration<double> elapsed = Clock::now() - sim_started_[rank];
+    return sim_clock_[rank] + elapsed.count();
+}
+
+//------------------------------------------------------------------------------
+void MFCoordinator::print_epoch(int epoch,
+                                const std::vector<TrainInfo> &results) {
     double sum_train_err = 0, sum_test_err = 0, sum_time = 0, sum_items = 0,
            sumbout = 0, sumbin = 0;
     unsigned count = 0;
-    for (auto &kv : results) {
-        kv.second.wait();  // barrier
-        auto retval = kv.second.get();
+    for (const auto &retval : results) {
         sum_train_err += retval.train_err;
         sum_items += retval.train_count;
         sum_test_err += retval.test_err;
@@ -76,20 +166,121 @@ void MFCoordinator::coordinate_epoch(int epoch, ThreadPool &tp) {
         sumbin += retval.bytes_in;
         ++count;
     }
-    epoch_stats_.stop();
     std::cout << epoch << ";" << absolute_timer_.stop() << ";"
               << (sum_train_err / count) << ";" << (sum_test_err / count) << ";"
               << (sum_items / count) << ";" << (sum_time / count) << ";"
-              << (sumbout / count) << ";" << (sumbin / count) << ";" << count
-              << std::endl;
-    // std::cout << epoch_stats_.summary() << std::endl;
+              << (sumbout / count) << ";" << (sumbin / count) << ";" << count;
+    if (network_) {
+        std::lock_guard<std::mutex> lock(sim_mtx_);
+        auto it = sim_epochs_.find(epoch);
+        if (it == sim_epochs_.end()) {  // pipelined: as late as anyone is
+            double latest = 0;
+            for (unsigned i = 0; i < nodes_.size(); ++i) {
+                latest = std::max(latest, sim_now(i));
+            }
+            std::cout << ";" << latest * 1e3;
+        } else {
+            std::cout << ";" << it->second * 1e3;
+            sim_epochs_.erase(sim_epochs_.begin(), ++it);
+        }
+    }
+    std::cout << std::endl;
+}
+
+//------------------------------------------------------------------------------
+// No barrier: each node runs its next epoch as soon as its merger allows it.
+// Epochs are printed once every node did them.
+//------------------------------------------------------------------------------
+void MFCoordinator::coordinate_async(int first, int iterations,
+                                     ThreadPool &tp) {
+    async_last_ = iterations;
+    async_printed_ = first - 1;
+    {
+        std::lock_guard<std::mutex> lock(step_mtx_);
+        step_state_.assign(nodes_.size(), RUNNING);
+        async_tp_ = &tp;
+    }
+    for (auto &n : nodes_) {
+        tp.add_task([this, &n, first]() {
+            record_epoch(train_and_share(n, first));
+            async_step(n);
+        });
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(async_mtx_);
+        async_done_.wait(lock,
+                         [this]() { return async_printed_ >= async_last_; });
+    }
+    std::lock_guard<std::mutex> lock(step_mtx_);
+    async_tp_ = nullptr;
+}
+
+//------------------------------------------------------------------------------
+// An epoch per task, so that nodes take turns in the pool. A node whose
+// merger is not ready waits for wake instead of a thread.
+//------------------------------------------------------------------------------
+void MFCoordinator::async_step(MFNode &n) {
+    if (n.finished_epoch() >= async_last_) return;
+
+    unsigned rank = n.rank();
+    {
+        std::lock_guard<std::mutex> lock(step_mtx_);
+        step_state_[rank] = RUNNING;  // what arrives meanwhile kicks it
+    }
+    sim_begin(rank);
+    auto res = n.trigger_epoch_if_ready(n.degree());
+    sim_end(n, res.first);
+    // the pool may be gone as soon as the last epoch is recorded
+    bool last = n.finished_epoch() >= async_last_;
+    if (res.first) record_epoch(res.second);
+    if (last) return;
+
+    std::lock_guard<std::mutex> lock(step_mtx_);
+    if (!res.first && step_state_[rank] != KICKED) {
+        step_state_[rank] = PARKED;  // waiting on a straggler
+        return;
+    }
+    step_state_[rank] = RUNNING;
+    async_tp_->add_task([this, &n]() { async_step(n); });
+}
+
+//------------------------------------------------------------------------------
+// Called once a model was handed to rank: all that makes a merger ready
+//------------------------------------------------------------------------------
+void MFCoordinator::wake(unsigned rank) {
+    std::lock_guard<std::mutex> lock(step_mtx_);
+    if (async_tp_ == nullptr) return;
+    if (step_state_[rank] == RUNNING) step_state_[rank] = KICKED;
+    if (step_state_[rank] != PARKED) return;
+    step_state_[rank] = RUNNING;
+    MFNode &n = nodes_[rank];
+    async_tp_->add_task([this, &n]() { async_step(n); });
+}
+
+//------------------------------------------------------------------------------
+// Pipelined nodes return dummies and report later, from their own worker
+//------------------------------------------------------------------------------
+void MFCoordinator::record_epoch(const TrainInfo &info) {
+    if (info.dummy()) return;
+    std::unique_lock<std::mutex> lock(async_mtx_);
+    async_results_[info.epoch].emplace_back(info);
+    while (async_results_.size() > 0 &&
+           async_results_.begin()->second.size() == nodes_.size()) {
+        auto it = async_results_.begin();
+        print_epoch(it->first, it->second);
+        async_printed_ = it->first;
+        async_results_.erase(it);
+    }
+    if (async_printed_ >= async_last_) async_done_.notify_all();
 }
 
 //------------------------------------------------------------------------------
 void MFCoordinator::run(uint8_t lowscore, uint8_t highscore, int matrix_rank,
                         double learning, double regularization, int iterations,
-                        bool dpsgd, bool randgraph, unsigned local,
-                        size_t steps_per_iteration, unsigned share_howmany) {
+                        ModelMergerType merger, bool randgraph,
+                        unsigned local, size_t steps_per_iteration,
+                        unsigned share_howmany, unsigned staleness) {
     Graph g = randgraph ? random_graph_erdos_renyi(nodes_.size())
                         : random_graph_small_world(nodes_.size());
     make_connected(g);
@@ -102,16 +293,32 @@ void MFCoordinator::run(uint8_t lowscore, uint8_t highscore, int matrix_rank,
     HyperMFSGD hyper(matrix_rank, learning, regularization, init_bias,
                      init_factor);
     for (auto &n : nodes_) {
-        n.init_training(this, hyper, dpsgd ? DPSGD : RMW, local,
-                        steps_per_iteration, share_howmany);
+        if (pipelined_) {
+            n.set_pipelined(
+                [this](const TrainInfo &info) { record_epoch(info); });
+        }
+        n.init_training(this, hyper, merger, local, steps_per_iteration,
+                        share_howmany, staleness);
     }
 
+    // Restored nodes go on together, from the oldest checkpoint: a run may
+    // have stopped while the nodes were saving the same epoch
+    int first = nodes_.empty() ? 0 : nodes_.front().finished_epoch() + 1;
+    for (auto &n : nodes_) first = std::min(first, n.finished_epoch() + 1);
+    for (auto &n : nodes_) n.resume(first - 1);
+
     unsigned processes = std::thread::hardware_concurrency();
     ThreadPool tp(processes);
     std::cout << "epoch;timestamp;meantrainerr;meantesterr;meandataitems;time;"
-                 "bytesout;bytesin;nodes\n";
+                 "bytesout;bytesin;nodes"
+              << (network_ ? ";simtime\n" : "\n");
     absolute_timer_.start();
-    for (int e = 0; e <= iterations; ++e) {
+    sim_barrier_ = merger != ASYNC && !pipelined_;
+    if (merger == ASYNC || pipelined_) {  // messages drive the epochs
+        coordinate_async(first, iterations, tp);
+        return;
+    }
+    for (int e = first; e <= iterations; ++e) {
         coordinate_epoch(e, tp);
     }
 }
@@ -119,11 +326,22 @@ void MFCoordinator::run(uint8_t lowscore, uint8_t highscore, int matrix_rank,
 //------------------------------------------------------------------------------
 size_t MFCoordinator::send(unsigned src, unsigned dst,
                            std::shared_ptr<ShareableModel> m) {
-    if (shared_memory_) {
-        return nodes_[dst].receive(src, m);
+    size_t ret;
+    if (shared_memory_ && !network_) {
+        ret = nodes_[dst].receive(src, m);
     } else {
-        return nodes_[dst].receive(src, m->serialize());
+        auto wire = m->wire(compression_, *buffers_[src]);
+        if (network_) {
+            std::lock_guard<std::mutex> lock(sim_mtx_);
+            double arrival =
+                network_->deliver(src, dst, wire->size(), sim_now(src));
+            sim_arrived_[dst] = std::max(sim_arrived_[dst], arrival);
+        }
+        ret = shared_memory_ ? nodes_[dst].receive(src, m)
+                             : nodes_[dst].receive(src, *wire);
     }
+    wake(dst);
+    return ret;
 }
 
 //------------------------------------------------------------------------------
@@ -1,11 +1,15 @@
 #pragma once
 
 #include <threads/thread_pool.h>
+#include <utils/compression.h>
 #include <utils/time_probe.h>
 
 #include <boost/graph/adjacency_list.hpp>
+#include <chrono>
+#include <condition_variable>
 
 #include "mf_node.h"
+#include "network_model.h"
 
 //------------------------------------------------------------------------------
 typedef boost::adjacency_list<boost::vecS, boost::vecS, boost::undirectedS>
@@ -14,22 +18,62 @@ typedef boost::adjacency_list<boost::vecS, boost::vecS, boost::undirectedS>
 //------------------------------------------------------------------------------
 class MFCoordinator : Communication {
    public:
-    MFCoordinator(std::vector<MFNode> &nodes, bool shared_memory);
+    MFCoordinator(std::vector<MFNode> &nodes, bool shared_memory,
+                  bool pipelined = false);
     void run(uint8_t lowscore, uint8_t highscore, int matrix_rank,
              double learning, double regularization, int iterations,
-             bool dpsgd, bool randgraph, unsigned local, 
-             size_t steps_per_iteration, unsigned share_howmany);
+             ModelMergerType merger, bool randgraph, unsigned local,
+             size_t steps_per_iteration, unsigned share_howmany,
+             unsigned staleness = 0);
     virtual size_t send(unsigned src, unsigned dst,
                       std::shared_ptr<ShareableModel>);
+    void set_compression(Compression::Codec codec);
+    // Models go over emulated links, epochs get a simulated time
+    void set_network(std::unique_ptr<NetworkModel> network);
 
    private:
     void coordinate_epoch(int epoch, ThreadPool &tp);
+    void coordinate_async(int first, int iterations, ThreadPool &tp);
+    void async_step(MFNode &n);
+    void wake(unsigned rank);
+    void record_epoch(const TrainInfo &info);
+    void print_epoch(int epoch, const std::vector<TrainInfo> &results);
     unsigned establish_relations(Graph &G);
+    TrainInfo train_and_share(MFNode &n, int epoch);
+    void sim_begin(unsigned rank);
+    void sim_end(MFNode &n, bool trained);
+    double sim_now(unsigned rank);
 
-    bool datashare_, shared_memory_;
+    bool datashare_, shared_memory_, pipelined_;
+    Compression::Codec compression_;  // unused with shared memory
+    std::vector<std::shared_ptr<BufferPool>> buffers_;  // per sending node
     TimeProbeStats epoch_stats_;
     TimeProbe absolute_timer_;
 
+    // Asynchronous and pipelined modes: nodes report epochs out of order
+    std::mutex async_mtx_;
+    std::condition_variable async_done_;
+    std::map<int, std::vector<TrainInfo>> async_results_;
+    int async_printed_, async_last_;
+
+    // A node that is not ready parks until a model arrives for it. One that
+    // arrives while it is checking kicks it into checking again.
+    enum StepState { PARKED, RUNNING, KICKED };
+    std::mutex step_mtx_;
+    std::vector<StepState> step_state_;
+    ThreadPool *async_tp_;  // null: nodes are not woken
+
+    // Emulated network: each node has a simulated clock, advanced by its real
+    // training time and held back until the models it waits for arrive
+    typedef std::chrono::steady_clock Clock;
+    std::unique_ptr<NetworkModel> network_;
+    std::mutex sim_mtx_;
+    std::vector<double> sim_clock_, sim_ready_, sim_arrived_;  // in seconds
+    bool sim_barrier_;
+    std::vector<Clock::time_point> sim_started_;
+    std::vector<char> sim_running_;
+    std::map<int, double> sim_epochs_;  // when the last node finished each
+
     std::vector<MFNode> &nodes_;
 };
 
@@ -58,24 +58,31 @@ std::pair<double, size_t> MFSGDDecentralized::train() {
 
 //------------------------------------------------------------------------------
 double MFSGDDecentralized::test(const TripletVector<uint8_t> &testset) {
+    init_test(testset);
+    return model_.rmse(testset);
+}
+
+//------------------------------------------------------------------------------
+void MFSGDDecentralized::init_test(const TripletVector<uint8_t> &testset) {
     for (const auto &t : testset) {
         model_.init_user(t.row(), hyper_.init_column_);
         model_.init_item(t.col(), hyper_.init_column_); 
     }
-    return model_.rmse(testset);
 }
 
+//------------------------------------------------------------------------------
+// Shared ratings arrive ordered like the store: each one goes right after the
+// previous, so hinted insertion takes constant time
 //------------------------------------------------------------------------------
 size_t MFSGDDecentralized::add_raw_ratings(SharingRatings sr) {
-    size_t count = 0;
-    if (sr) {
-        for(auto it = sr->begin(); it != sr->end(); it++) {
-            auto res = node_data_->insert(std::make_pair(std::make_pair(it->row(), it->col()), it->value()));
-            if(res.second)
-                count++;
-        }
+    if (!sr) return 0;
+    size_t before = node_data_->size();
+    auto hint = node_data_->end();
+    for (const auto &t : *sr) {
+        hint = std::next(node_data_->emplace_hint(
+            hint, std::make_pair(t.row(), t.col()), t.value()));
     }
-    return count;
+    return node_data_->size() - before;
 }
 
 //------------------------------------------------------------------------------
@@ -20,6 +20,7 @@ class MFSGDDecentralized : public MFSGD {
     
     virtual std::pair<double, size_t> train();
     double test(const TripletVector<uint8_t>& testset);
+    void init_test(const TripletVector<uint8_t>& testset);
     void extract_raw_ratings(unsigned userrank, unsigned howmany,
                              TripletVector<uint8_t>& dst);
     size_t add_raw_ratings(SharingRatings sr);
@@ -1,18 +1,25 @@
+#include <model_merging/async_merger.h>
 #include <model_merging/dpsgd.h>
 #include <model_merging/random_model_walk.h>
 #include <utils/time_probe.h>
+#ifndef ENCLAVED
+#include <threads/thread_pool.h>
+
+#include "mf_checkpoint.h"
+#endif
 
 #include <iostream>
 
 //------------------------------------------------------------------------------
 // TrainInfo
 //------------------------------------------------------------------------------
-TrainInfo::TrainInfo(std::pair<double, size_t> train, double test, double dur,
-                     size_t bo, size_t bi)
-    : train_err(sqrt(train.first / train.second)),
-      train_count(train.second),
+TrainInfo::TrainInfo(int e, std::pair<double, size_t> train, double test,
+                     double dur, size_t bo, size_t bi)
+    : epoch(e),
+      train_err(sqrt(train.first / train.second)),
       test_err(test),
       duration(dur),
+      train_count(train.second),
       bytes_out(bo),
       bytes_in(bi) {}
 
@@ -22,15 +29,20 @@ TrainInfo::TrainInfo(std::pair<double, size_t> train, double test, double dur,
 MFNode::MFNode(unsigned node_index, std::shared_ptr<DataStore> node_data,
                const TripletVector<uint8_t> &test_set, bool modelshare,
                bool datashare, std::string outdir)
-    : node_index_(node_index),
+    : test_set_(test_set),
       node_data_(node_data),
-      test_set_(test_set),
+      finished_epoch_(-1),
+      node_index_(node_index),
+      share_block_(1),
+      share_fraction_(1.),
       modelshare_(modelshare),
       datashare_(datashare),
       outdir_(outdir),
       bytes_reported_(0),
-      bytes_in_(0),
-      finished_epoch_(-1) {
+      memory_budget_(0),
+      share_budget_(0),
+      precision_(MFWeights::FP64),
+      delta_encoding_(false) {
     if (!modelshare_) {
         datashare_ = true;
     }
@@ -43,12 +55,90 @@ bool MFNode::add_neighbour(unsigned rank) {
     return neighbours_.insert(rank).second;
 }
 
+//------------------------------------------------------------------------------
+size_t MFNode::degree() const { return neighbours_.size(); }
+
+//------------------------------------------------------------------------------
+void MFNode::set_partial_sharing(double fraction, unsigned block) {
+    share_fraction_ = fraction;
+    share_block_ = block;
+}
+
+//------------------------------------------------------------------------------
+void MFNode::set_memory_budget(size_t bytes) { memory_budget_ = bytes; }
+
+//------------------------------------------------------------------------------
+void MFNode::set_share_budget(size_t bytes) { share_budget_ = bytes; }
+
+//------------------------------------------------------------------------------
+// Bits per value of the shared embeddings: 8, 16 or 64 (no quantization)
+//------------------------------------------------------------------------------
+void MFNode::set_quantization(unsigned bits) {
+    switch (bits) {
+        case 8:
+            precision_ = MFWeights::INT8;
+            break;
+        case 16:
+            precision_ = MFWeights::FP16;
+            break;
+        case 64:
+            precision_ = MFWeights::FP64;
+            break;
+        default:
+            std::cerr << "Invalid quantization: " << bits << " bits"
+                      << std::endl;
+            abort();
+    }
+}
+
+//------------------------------------------------------------------------------
+void MFNode::set_delta_encoding(bool enable) { delta_encoding_ = enable; }
+
+//------------------------------------------------------------------------------
+// Epoch results are then delivered to `done`, from the pipeline worker
+//------------------------------------------------------------------------------
+void MFNode::set_pipelined(EpochCallback done) {
+#ifdef ENCLAVED
+    std::cerr << "Pipelined epochs need threads. Running sequentially."
+              << std::endl;
+#else
+    epoch_done_ = done;
+    pipeline_ = std::make_shared<ThreadPool>(1);
+#endif
+}
+
+#ifndef ENCLAVED
+//------------------------------------------------------------------------------
+// Each finished epoch gets saved to save_dir. Training starts from the model
+// in restore_dir, at the epoch after the one it was saved at.
+//------------------------------------------------------------------------------
+void MFNode::set_checkpoint(const std::string &save_dir,
+                            const std::string &restore_dir) {
+    checkpoint_dir_ = save_dir;
+    restore_dir_ = restore_dir;
+}
+
+//------------------------------------------------------------------------------
+std::string MFNode::checkpoint_file(const std::string &dir) const {
+    return dir + "/" + std::to_string(node_index_) + ".ckpt";
+}
+#endif
+
 //------------------------------------------------------------------------------
 void MFNode::init_training(Communication *comm, const HyperMFSGD &h,
                            ModelMergerType model, unsigned local,
-                           size_t steps_per_iteration, unsigned share_howmany) {
+                           size_t steps_per_iteration, unsigned share_howmany,
+                           unsigned staleness) {
     trainer_ = std::make_shared<MFSGDDecentralized>(node_index_, node_data_, h,
                                                     steps_per_iteration);
+    if (delta_encoding_) {  // below the deferral: encodes when really sent
+        delta_ = std::make_shared<DeltaCommunication>(node_index_, comm);
+        comm = delta_.get();
+    }
+    if (epoch_done_) {
+        deferred_ = std::make_shared<DeferredCommunication>(comm);
+        comm = deferred_.get();
+    }
     local_iterations_ = local;
     switch (model) {
         case RMW:
@@ -62,14 +152,27 @@ void MFNode::init_training(Communication *comm, const HyperMFSGD &h,
                 new DPSGDMerger(node_index_, share_howmany, comm, trainer_,
                                 neighbours_, modelshare_, datashare_));
             break;
+        case ASYNC:
+            decentralized_sharing_ = std::shared_ptr<ModelMerger>(
+                new AsyncGossipMerger(node_index_, share_howmany, comm,
+                                      trainer_, neighbours_, modelshare_,
+                                      datashare_, staleness));
+            break;
         default:
             std::cerr << "Unknown model " << model << std::endl;
     }
+    decentralized_sharing_->set_partial_sharing(share_fraction_, share_block_);
+    decentralized_sharing_->set_memory_budget(memory_budget_);
+    decentralized_sharing_->set_share_budget(share_budget_);
+    decentralized_sharing_->set_quantization(precision_);
 
 #ifndef ENCLAVED
     std::string fname = outdir_ + "/" + std::to_string(node_index_) + ".dat";
     logfile_ = std::make_shared<std::ofstream>(fname);
     decentralized_sharing_->set_logfile(logfile_);
+    if (!restore_dir_.empty()) {
+        resume(trainer_->restore_checkpoint(checkpoint_file(restore_dir_)));
+    }
 #endif
 }
 
@@ -84,7 +187,7 @@ TrainInfo MFNode::train_and_share(int epoch) {
     chrono.start();
     if (epoch > 0 && decentralized_sharing_) {
         merging_stats_.start();
-        decentralized_sharing_->merge(epoch - 1);
+        decentralized_sharing_->merge_buffered(epoch - 1);
         merging_stats_.stop();
     }
 
@@ -95,6 +198,10 @@ TrainInfo MFNode::train_and_share(int epoch) {
     }
     train_stats_.stop();
 
+    if (deferred_) {
+        return share_and_test_pipelined(epoch, chrono.stop(), train);
+    }
+
     size_t bytes_out;
     share_stats_.start();
     if (decentralized_sharing_) {
@@ -110,21 +217,81 @@ TrainInfo MFNode::train_and_share(int epoch) {
     size_t bytes_in_report = bytes_in_ - bytes_reported_;
     bytes_reported_ += bytes_in_report;
     finished_epoch_ = epoch;
-    return TrainInfo(train, test_err, chrono.stop(), bytes_out,
-                     bytes_in_report);
+    TrainInfo info(epoch, train, test_err, chrono.stop(), bytes_out,
+                   bytes_in_report);
+#ifndef ENCLAVED
+    if (!checkpoint_dir_.empty()) {
+        trainer_->save_checkpoint(checkpoint_file(checkpoint_dir_), epoch);
+    }
+#endif
+    return info;
+}
+
+//------------------------------------------------------------------------------
+// Only snapshots are taken here. Serialization, sending and test run on the
+// pipeline worker while the caller moves on to the next epoch.
+//------------------------------------------------------------------------------
+TrainInfo MFNode::share_and_test_pipelined(int epoch, double duration,
+                                           std::pair<double, size_t> train) {
+    share_stats_.start();
+    if (decentralized_sharing_) {
+        decentralized_sharing_->share(epoch);
+    }
+    DeferredCommunication::Batch batch = deferred_->take();
+    share_stats_.stop();
+
+    trainer_->init_test(test_set_);
+    auto snapshot =
+        std::make_shared<MatrixFactorizationModel>(trainer_->model());
+
+    trainer_->make_compressed();  // saves memory
+    size_t bytes_in_report = bytes_in_ - bytes_reported_;
+    bytes_reported_ += bytes_in_report;
+    finished_epoch_ = epoch;
+
+#ifndef ENCLAVED
+    std::string checkpoint =
+        checkpoint_dir_.empty() ? "" : checkpoint_file(checkpoint_dir_);
+    auto job = std::make_shared<std::packaged_task<void()>>([=]() {
+        size_t bytes_out = deferred_->send_all(batch);
+        inference_stats_.start();
+        double test_err = snapshot->rmse(test_set_);
+        inference_stats_.stop();
+        if (!checkpoint.empty()) {
+            MFCheckpoint::save(checkpoint, *snapshot, epoch);
+        }
+        if (epoch_done_) {
+            epoch_done_(TrainInfo(epoch, train, test_err, duration, bytes_out,
+                                  bytes_in_report));
+        }
+    });
+    pipeline_last_ = job->get_future().share();
+    pipeline_->add_task([job]() { (*job)(); });
+#endif
+    return TrainInfo();  // dummy: the real one goes to epoch_done_
+}
+
+//------------------------------------------------------------------------------
+void MFNode::flush_pipeline() {
+#ifndef ENCLAVED
+    if (pipeline_last_.valid()) {
+        pipeline_last_.wait();
+    }
+#endif
 }
 
 //------------------------------------------------------------------------------
-size_t MFNode::receive(unsigned src, const std::vector<uint8_t> &data) {
-    ModelMergerType t = ShareableModel::extract_type(data);
+size_t MFNode::receive(unsigned src, ByteView data) {
     std::shared_ptr<ShareableModel> smodelptr(
-        t == DPSGD ? new DPSGDShareableModel() : new ShareableModel());
-    smodelptr->deserialize(data);
+        Compression::compressed(data)
+            ? ShareableModel::create(Compression::decompress(data))
+            : ShareableModel::create(data));
     if (!decentralized_sharing_) {
         std::cerr << "decentralized_sharing_ shold not be null" << std::endl;
         abort();
     }
-    decentralized_sharing_->receive(src, smodelptr);
+    if (delta_) smodelptr = delta_->receive(src, smodelptr);
+    if (smodelptr) decentralized_sharing_->receive(src, smodelptr);
     /*if (t == DPSGD) {
         std::cout
             << "from: " << src << " d: "
@@ -137,16 +304,20 @@ size_t MFNode::receive(unsigned src, const std::vector<uint8_t> &data) {
 }
 
 //------------------------------------------------------------------------------
-size_t MFNode::receive(unsigned src, const std::shared_ptr<ShareableModel> m) {
-    decentralized_sharing_->receive(src, m);
-    return 0;
+size_t MFNode::receive(unsigned src, const std::shared_ptr<ShareableModel> m,
+                       size_t bytes) {
+    auto whole = delta_ ? delta_->receive(src, m) : m;
+    if (whole) decentralized_sharing_->receive(src, whole);
+    bytes_in_ += bytes;
+    return bytes;
 }
 
 //------------------------------------------------------------------------------
 std::pair<bool, TrainInfo> MFNode::trigger_epoch_if_ready(size_t degree) {
     TrainInfo info;
     bool trained = false;
-    if (decentralized_sharing_->received_all(finished_epoch_, degree)) {
+    if (!decentralized_sharing_->throttled() &&
+        decentralized_sharing_->ready(finished_epoch_, degree)) {
         info = train_and_share(finished_epoch_ + 1);
         trained = true;
     }
@@ -156,6 +327,14 @@ std::pair<bool, TrainInfo> MFNode::trigger_epoch_if_ready(size_t degree) {
 //------------------------------------------------------------------------------
 int MFNode::finished_epoch() { return finished_epoch_; }
 
+//------------------------------------------------------------------------------
+// The next epoch trained is epoch + 1, as if the previous ones just ran
+//------------------------------------------------------------------------------
+void MFNode::resume(int epoch) {
+    finished_epoch_ = epoch;
+    if (decentralized_sharing_) decentralized_sharing_->resume(epoch);
+}
+
 //------------------------------------------------------------------------------
 std::string MFNode::summary() {
     std::stringstream ss;
@@ -169,6 +348,7 @@ std::string MFNode::summary() {
 
 //------------------------------------------------------------------------------
 MFNode::~MFNode() {
+    flush_pipeline();
 #ifndef ENCLAVED
     if (logfile_) {
         *logfile_ << summary();
@@ -176,6 +356,139 @@ MFNode::~MFNode() {
 #endif
 }
 
+//------------------------------------------------------------------------------
+// DeferredCommunication
+//------------------------------------------------------------------------------
+DeferredCommunication::DeferredCommunication(Communication *c)
+    : communication_(c) {}
+
+//------------------------------------------------------------------------------
+size_t DeferredCommunication::send(unsigned src, unsigned dst,
+                                   std::shared_ptr<ShareableModel> m) {
+    if (flow_control(m->type_)) {  // must not wait for the batch
+        return communication_->send(src, dst, m);
+    }
+    pending_.push_back(Message{src, dst, m});
+    return 0;  // accounted for in send_all
+}
+
+//------------------------------------------------------------------------------
+DeferredCommunication::Batch DeferredCommunication::take() {
+    Batch ret;
+    ret.swap(pending_);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+size_t DeferredCommunication::send_all(const Batch &batch) {
+    size_t ret = 0;
+    for (const auto &m : batch) {
+        ret += communication_->send(m.src, m.dst, m.model);
+    }
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// DeltaCommunication
+//------------------------------------------------------------------------------
+static const size_t kMaxUnacked = 8;
+
+//------------------------------------------------------------------------------
+DeltaCommunication::DeltaCommunication(unsigned rank, Communication *c)
+    : rank_(rank), communication_(c) {}
+
+//------------------------------------------------------------------------------
+// Each neighbour rebuilds what we send on top of the model it acknowledged
+// last. We keep the same sum for every epoch in flight, to become its base
+// once acknowledged. Deltas get quantized here, so that both sides agree on
+// every bit: rounding errors are in the next delta.
+//------------------------------------------------------------------------------
+size_t DeltaCommunication::send(unsigned src, unsigned dst,
+                                std::shared_ptr<ShareableModel> m) {
+    if (flow_control(m->type_) || m->model_.rank() < 0) {
+        return communication_->send(src, dst, m);
+    }
+
+    ShareableModelPtr tosend;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        Peer &peer = sent_[dst];
+        if (peer.acked < 0) {
+            tosend = m;
+            peer.unacked[m->epoch] = m->model_;
+        } else {
+            MatrixFactorizationModel delta =
+                m->model_.delta_from(peer.reference);
+            delta.quantize(m->model_.precision(), nullptr);
+            tosend = m->with_model(delta);
+            tosend->base = peer.acked;
+            peer.unacked[m->epoch] = delta.delta_applied(peer.reference);
+        }
+        while (peer.unacked.size() > kMaxUnacked) {  // acks lost: stop waiting
+            peer.unacked.erase(peer.unacked.begin());
+        }
+    }
+    return communication_->send(src, dst, tosend);
+}
+
+//------------------------------------------------------------------------------
+ShareableModelPtr DeltaCommunication::receive(unsigned src,
+                                              ShareableModelPtr m) {
+    if (m->type_ == ACK || m->type_ == RESYNC) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        Peer &peer = sent_[src];
+        if (m->type_ == RESYNC) {
+            peer = Peer();
+            return nullptr;
+        }
+        auto it = peer.unacked.find(m->epoch);
+        if (it != peer.unacked.end() && m->epoch > peer.acked) {
+            peer.acked = m->epoch;
+            peer.reference = std::move(it->second);
+            peer.unacked.erase(peer.unacked.begin(), ++it);
+        }
+        return nullptr;
+    }
+    if (flow_control(m->type_) || m->model_.rank() < 0) return m;
+
+    ShareableModelPtr whole = m;
+    bool lost = false;
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        auto &history = received_[src];
+        if (m->base >= 0) {
+            auto it = history.find(m->base);
+            if (it == history.end()) {
+                lost = true;  // merger gets no embeddings from src this time
+                whole = m->with_model(MatrixFactorizationModel(m->model_.rank()));
+            } else {
+                whole = m->with_model(m->model_.delta_applied(it->second));
+            }
+        }
+        if (!lost) {
+            // Bases only move forward: older ones are not needed anymore
+            if (m->base >= 0) {
+                history.erase(history.begin(), history.lower_bound(m->base));
+            }
+            history[m->epoch] = whole->model_;
+            while (history.size() > 2 * kMaxUnacked) {  // a resync at worst
+                history.erase(history.begin());
+            }
+        }
+    }
+    control(src, lost ? RESYNC : ACK, m->epoch);
+    return whole;
+}
+
+//------------------------------------------------------------------------------
+void DeltaCommunication::control(unsigned dst, ModelMergerType type,
+                                 int epoch) {
+    communication_->send(rank_, dst,
+                         std::make_shared<ShareableModel>(
+                             epoch, type, MatrixFactorizationModel(-1),
+                             SharingRatings()));
+}
+
 //------------------------------------------------------------------------------
 // ModelMerger
 //------------------------------------------------------------------------------
@@ -183,11 +496,18 @@ ModelMerger::ModelMerger(unsigned rank, unsigned share_howmany,
                          Communication *c,
                          std::shared_ptr<MFSGDDecentralized> t,
                          std::set<unsigned> &n, bool modelshare, bool datashare)
-    : userrank_(rank),
-      share_howmany_(share_howmany),
-      communication_(c),
-      trainer_(t),
+    : trainer_(t),
       neighbours_(n),
+      memory_budget_(0),
+      merged_epoch_(-1),
+      communication_(c),
+      userrank_(rank),
+      share_howmany_(share_howmany),
+      share_block_(1),
+      share_fraction_(1.),
+      share_budget_(0),
+      precision_(MFWeights::FP64),
+      residual_(-2),
       modelshare_(modelshare),
       datashare_(datashare) {}
 
@@ -195,19 +515,143 @@ ModelMerger::ModelMerger(unsigned rank, unsigned share_howmany,
 void ModelMerger::receive(unsigned src, std::shared_ptr<ShareableModel> m) {
     std::unique_lock<std::mutex> lock(recv_mtx_);
     int epoch = m->epoch;
+    if (m->type_ == THROTTLE) {
+        throttled_by_.insert(src);
+        return;
+    }
+    if (m->type_ == RELEASE) {
+        throttled_by_.erase(src);
+        return;
+    }
+
+    bool hold = false;
     if (recvdfrom_.insert(std::make_pair(src, epoch)).second) {
         received_models_[epoch].emplace_back(src, m);
+        hold = enforce_budget(epoch);
     } else {
         std::cerr << "I am " << userrank_ << " and received a duplicate from "
                   << src << ". I currently have msgs from " << recvdfrom_.size()
                   << " neighbours" << std::endl;
         abort();
     }
+    lock.unlock();  // sending may loop back to us
+
+    if (hold) {
+        std::unique_lock<std::mutex> tlock(throttle_mtx_);
+        if (throttled_senders_.insert(src).second) send_throttle(src, true);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Spills the models furthest ahead until the deserialized ones fit. Returns
+// whether the sender of epoch, if running ahead of us, should be throttled.
+//------------------------------------------------------------------------------
+bool ModelMerger::enforce_budget(int epoch) {
+    if (memory_budget_ == 0) return false;
+
+    size_t used = buffered_bytes();
+    auto it = received_models_.rbegin();
+    while (used > memory_budget_ && it != received_models_.rend() &&
+           it->first > merged_epoch_ + 1) {  // next epoch's models stay
+        if (it->second.empty()) {
+            ++it;
+            continue;
+        }
+        auto &victim = it->second.back();
+        used -= victim.second->memory_size();
+        spilled_[it->first].emplace_back(
+            victim.first, Compression::compress(victim.second->serialize(),
+                                                Compression::FAST));
+        it->second.pop_back();
+    }
+
+    bool ahead = epoch > merged_epoch_ + 1;
+    return ahead && !spilled_.empty();
+}
+
+//------------------------------------------------------------------------------
+size_t ModelMerger::buffered_bytes() const {
+    size_t ret = 0;
+    for (const auto &kv : received_models_) {
+        for (const auto &m : kv.second) ret += m.second->memory_size();
+    }
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+void ModelMerger::unspill(int upto) {
+    std::unique_lock<std::mutex> lock(recv_mtx_);
+    while (!spilled_.empty() && spilled_.begin()->first <= upto) {
+        auto &models = received_models_[spilled_.begin()->first];
+        for (const auto &s : spilled_.begin()->second) {
+            models.emplace_back(
+                s.first, Compression::compressed(s.second)
+                             ? ShareableModel::create(
+                                   Compression::decompress(s.second))
+                             : ShareableModel::create(s.second));
+        }
+        spilled_.erase(spilled_.begin());
+    }
+}
+
+//------------------------------------------------------------------------------
+// Senders get released once we are under budget again or once we need their
+// next model. Otherwise a throttled node could be the one we are waiting for.
+//------------------------------------------------------------------------------
+void ModelMerger::merge_buffered(int epoch) {
+    unspill(epoch);
+    merge(epoch);
+
+    bool relieved;
+    std::map<unsigned, int> newest;
+    {
+        std::unique_lock<std::mutex> lock(recv_mtx_);
+        merged_epoch_ = epoch;
+        relieved = spilled_.empty() && buffered_bytes() <= memory_budget_;
+        for (const auto &r : recvdfrom_) {
+            newest[r.first] = std::max(newest[r.first], r.second);
+        }
+    }
+
+    // Holds and releases go out in the order they are decided
+    std::unique_lock<std::mutex> tlock(throttle_mtx_);
+    for (auto it = throttled_senders_.begin();
+         it != throttled_senders_.end();) {
+        auto n = newest.find(*it);
+        if (relieved || n == newest.end() || n->second <= epoch + 1) {
+            send_throttle(*it, false);
+            it = throttled_senders_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+bool ModelMerger::throttled() {
+    std::unique_lock<std::mutex> lock(recv_mtx_);
+    return !throttled_by_.empty();
+}
+
+//------------------------------------------------------------------------------
+void ModelMerger::send_throttle(unsigned dst, bool hold) {
+    communication_->send(userrank_, dst,
+                         std::make_shared<ShareableModel>(
+                             0, hold ? THROTTLE : RELEASE,
+                             MatrixFactorizationModel(-2), SharingRatings()));
+}
+
+//------------------------------------------------------------------------------
+bool ModelMerger::ready(int epoch, size_t howmany) {
+    std::unique_lock<std::mutex> lock(recv_mtx_);  // receive runs meanwhile
+    return received_all(epoch, howmany);
 }
 
 //------------------------------------------------------------------------------
 bool ModelMerger::received_all(int epoch, size_t howmany) {
-    return received_models_[epoch].size() == howmany;
+    auto spilled = spilled_.find(epoch);
+    size_t count = spilled == spilled_.end() ? 0 : spilled->second.size();
+    return received_models_[epoch].size() + count == howmany;
 }
 
 //------------------------------------------------------------------------------
@@ -217,6 +661,74 @@ void ModelMerger::set_logfile(std::shared_ptr<std::ofstream> file) {
 }
 #endif
 
+//------------------------------------------------------------------------------
+void ModelMerger::set_partial_sharing(double fraction, unsigned block) {
+    if (fraction <= 0 || fraction > 1 || block == 0) {
+        std::cerr << "Invalid partial sharing: fraction " << fraction
+                  << " block " << block << std::endl;
+        abort();
+    }
+    share_fraction_ = fraction;
+    share_block_ = block;
+}
+
+//------------------------------------------------------------------------------
+void ModelMerger::set_memory_budget(size_t bytes) { memory_budget_ = bytes; }
+
+//------------------------------------------------------------------------------
+bool ModelMerger::partial_sharing() const {
+    return share_fraction_ < 1. || share_budget_ > 0;
+}
+
+//------------------------------------------------------------------------------
+void ModelMerger::set_share_budget(size_t bytes) { share_budget_ = bytes; }
+
+//------------------------------------------------------------------------------
+void ModelMerger::set_quantization(MFWeights::Precision p) { precision_ = p; }
+
+//------------------------------------------------------------------------------
+void ModelMerger::resume(int epoch) {
+    std::unique_lock<std::mutex> lock(recv_mtx_);
+    merged_epoch_ = epoch;
+}
+
+//------------------------------------------------------------------------------
+// What goes in the model slot of the ShareableModel for dst. A fresh random
+// subset on every call when sharing partially, so each neighbour gets
+// different ids. Under a byte budget, the embeddings that moved the most
+// since dst last got them, each neighbour tracked apart. Quantized embeddings
+// carry over their rounding error to the next time they are sent.
+//------------------------------------------------------------------------------
+MatrixFactorizationModel ModelMerger::model_toshare(unsigned dst) {
+    if (!modelshare_) {
+        return MatrixFactorizationModel(-2);  // -2 for no model sharing
+    }
+    auto &model = trainer_->mutable_model();
+    MatrixFactorizationModel ret;
+    if (share_budget_ > 0) {
+        MatrixFactorizationModel &last = last_shared_[dst];
+        if (last.rank() != model.rank()) {
+            last = MatrixFactorizationModel(model.rank());
+        }
+        ret = model.top_changed(last, share_budget_, precision_);
+    } else if (partial_sharing()) {
+        ret = model.sample(share_fraction_, share_block_);
+    } else {
+        ret = trainer_->model();
+    }
+
+    if (precision_ != MFWeights::FP64 && ret.rank() >= 0) {
+        if (residual_.rank() != ret.rank()) {
+            residual_ = MatrixFactorizationModel(ret.rank());
+        }
+        ret.quantize(precision_, &residual_);
+    }
+    if (share_budget_ > 0) {
+        last_shared_[dst].merge_average(ret, 1.);  // copies what was sent
+    }
+    return ret;
+}
+
 //------------------------------------------------------------------------------
 SharingRatings ModelMerger::extract_ratings(unsigned howmany) {
     SharingRatings ret = std::make_shared<SharingRatings::element_type>();
@@ -230,58 +742,128 @@ SharingRatings ModelMerger::extract_ratings(unsigned howmany) {
 ShareableModel::ShareableModel(int e, ModelMergerType t,
                                const MatrixFactorizationModel &m,
                                SharingRatings data)
-    : epoch(e), type_(t), model_(m), rawdata(data) {}
+    : type_(t), epoch(e), base(-1), model_(m), rawdata(data) {}
+
+//------------------------------------------------------------------------------
+// Messages are not modified once handed to Communication, so what goes on the
+// wire is computed for the first destination and reused for the others. Its
+// buffers come from pool and go back there once the message is gone.
+//------------------------------------------------------------------------------
+std::shared_ptr<const std::vector<uint8_t>> ShareableModel::wire(
+    Compression::Codec codec, BufferPool &pool) const {
+    std::unique_lock<std::mutex> lock(wire_mtx_);
+    if (!wire_ || wire_codec_ != codec) {
+        BufferPool::Buffer serial = pool.acquire(), compressed = pool.acquire();
+        serialize_append(serial);
+        if (Compression::compress(serial, codec, compressed)) {
+            std::swap(serial, compressed);
+        }
+        pool.release(std::move(compressed));
+        wire_ = pool.share(std::move(serial));
+        wire_codec_ = codec;
+    }
+    return wire_;
+}
+
+//------------------------------------------------------------------------------
+// Same message, other model: what delta encoding sends each neighbour
+//------------------------------------------------------------------------------
+std::shared_ptr<ShareableModel> ShareableModel::with_model(
+    const MatrixFactorizationModel &m) const {
+    return std::make_shared<ShareableModel>(epoch, type_, m, rawdata);
+}
 
 //------------------------------------------------------------------------------
 std::vector<uint8_t> ShareableModel::serialize() const {
-    std::vector<uint8_t> ret(sizeof(type_) + sizeof(epoch));
-    size_t datasize =
-        rawdata ? (rawdata->size() * sizeof(TripletVector<uint8_t>::value_type))
-                : 0;
-    ret.reserve(ret.size() + model_.estimate_serial_size() + datasize);
+    std::vector<uint8_t> ret;
+    serialize_append(ret);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// Reserves an upper bound first: a buffer that served a previous epoch does
+// not grow again
+//------------------------------------------------------------------------------
+void ShareableModel::serialize_append(std::vector<uint8_t> &ret) const {
+    size_t start = ret.size(),
+           header = sizeof(type_) + sizeof(epoch) + sizeof(base);
+    ret.reserve(start + serial_size());
+    ret.resize(start + header);
 
-    memcpy(ret.data(), &type_, sizeof(type_));
-    memcpy(&ret[sizeof(type_)], &epoch, sizeof(epoch));
+    memcpy(&ret[start], &type_, sizeof(type_));
+    memcpy(&ret[start + sizeof(type_)], &epoch, sizeof(epoch));
+    memcpy(&ret[start + sizeof(type_) + sizeof(epoch)], &base, sizeof(base));
     model_.serialize_append(ret);
 
     size_t index = ret.size();
     uint8_t *nptr = reinterpret_cast<uint8_t *>(&index);
     ret.insert(ret.end(), nptr, nptr + sizeof(index));  // placeholder
-    if (rawdata) {
-        std::vector<uint8_t> data(triplets_to_raw(*rawdata));
-        ret.insert(ret.end(), data.begin(), data.end());
-    }
+    if (rawdata) ratings_append(*rawdata, ret);
     assert(*reinterpret_cast<size_t *>(&ret[index]) == index);  // check value
     size_t tmp = ret.size() - index - sizeof(size_t);
     memcpy(&ret[index], &tmp, sizeof(tmp));  // fill size in B
-    return ret;
 }
 
 //------------------------------------------------------------------------------
-size_t ShareableModel::deserialize(const std::vector<uint8_t> &data) {
+// Ratings take at most a count varint, then half a byte for the value and two
+// int varints of 5 bytes each
+//------------------------------------------------------------------------------
+size_t ShareableModel::serial_size() const {
+    return sizeof(type_) + sizeof(epoch) + sizeof(base) +
+           model_.estimate_serial_size() + sizeof(size_t) +
+           (rawdata ? 10 + 11 * rawdata->size() : 0);
+}
+
+//------------------------------------------------------------------------------
+size_t ShareableModel::deserialize(ByteView data) {
     type_ = extract_type(data);
     epoch = *reinterpret_cast<const int *>(&data[sizeof(type_)]);
-    assert(epoch >= 0 && (type_ == RMW || type_ == DPSGD));
-    size_t offset = model_.deserialize(data, sizeof(type_) + sizeof(epoch));
-    assert(offset + sizeof(size_t) <= data.size());
-
-    const size_t *size = reinterpret_cast<const size_t *>(&data[offset]);
-    offset += sizeof(size_t);
-    if (*size > 0) {
-        typedef SharingRatings::element_type::value_type TripletType;
-        const TripletType *begin =
-            reinterpret_cast<const TripletType *>(&data[offset]);
-        offset += *size;
-        assert(offset <= data.size());
-        const TripletType *end = begin + *size / sizeof(TripletType);
-        rawdata = std::make_shared<SharingRatings::element_type>(begin, end);
+    base = *reinterpret_cast<const int *>(&data[sizeof(type_) + sizeof(epoch)]);
+    assert(epoch >= 0 && type_ < UNKKOWN);
+    size_t offset = model_.deserialize(
+        data, sizeof(type_) + sizeof(epoch) + sizeof(base));
+    size_t size = 0;
+    if (data.size() - offset < sizeof(size)) {
+        std::cerr << "Malformed model: short message" << std::endl;
+        abort();
+    }
+    memcpy(&size, &data[offset], sizeof(size));
+    offset += sizeof(size);
+    if (size > 0) {
+        size_t end = offset + size;
+        rawdata = std::make_shared<SharingRatings::element_type>();
+        if (size > data.size() - offset ||
+            !ratings_read(ByteView(data.data(), end), offset, *rawdata)) {
+            std::cerr << "Malformed model: ratings" << std::endl;
+            abort();
+        }
+        offset = end;
     }
     return offset;
 }
 
 //------------------------------------------------------------------------------
-ModelMergerType ShareableModel::extract_type(const std::vector<uint8_t> &data) {
+ModelMergerType ShareableModel::extract_type(ByteView data) {
     return *reinterpret_cast<const ModelMergerType *>(data.data());
 }
 
 //------------------------------------------------------------------------------
+std::shared_ptr<ShareableModel> ShareableModel::create(ByteView data) {
+    std::shared_ptr<ShareableModel> ret(extract_type(data) == DPSGD
+                                            ? new DPSGDShareableModel()
+                                            : new ShareableModel());
+    ret->deserialize(data);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// Rough footprint once deserialized, what memory budgets are checked against
+//------------------------------------------------------------------------------
+size_t ShareableModel::memory_size() const {
+    size_t datasize =
+        rawdata ? (rawdata->size() * sizeof(TripletVector<uint8_t>::value_type))
+                : 0;
+    return sizeof(*this) + model_.estimate_serial_size() + datasize;
+}
+
+//------------------------------------------------------------------------------
@@ -1,16 +1,32 @@
 #pragma once
 
+#include <utils/buffer_pool.h>
+#include <utils/compression.h>
 #include <utils/time_probe.h>
 
 #include <Eigen/Sparse>
+#include <atomic>
 #include <fstream>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
+#ifndef ENCLAVED
+#include <future>
+#endif
 
 #include "mf_decentralized.h"
 
-enum ModelMergerType { RMW, DPSGD, UNKKOWN };
+class ThreadPool;
+
+// THROTTLE asks the receiver to hold and RELEASE lets it go on: flow control.
+// ACK (of an epoch) and RESYNC are for delta encoding: see DeltaCommunication
+enum ModelMergerType {
+    RMW, DPSGD, ASYNC, THROTTLE, ACK, RESYNC, RELEASE, UNKKOWN
+};
+inline bool flow_control(ModelMergerType t) {
+    return t == THROTTLE || t == RELEASE;
+}
 
 //------------------------------------------------------------------------------
 class ShareableModel {
@@ -19,14 +35,29 @@ class ShareableModel {
     ShareableModel(int e, ModelMergerType t, const MatrixFactorizationModel &m,
                    SharingRatings data);
 
-    virtual std::vector<uint8_t> serialize() const;
-    virtual size_t deserialize(const std::vector<uint8_t> &data);
-    static ModelMergerType extract_type(const std::vector<uint8_t> &data);
+    std::vector<uint8_t> serialize() const;
+    virtual void serialize_append(std::vector<uint8_t> &out) const;
+    virtual size_t deserialize(ByteView data);
+    virtual std::shared_ptr<ShareableModel> with_model(
+        const MatrixFactorizationModel &m) const;
+    std::shared_ptr<const std::vector<uint8_t>> wire(Compression::Codec codec,
+                                                     BufferPool &pool) const;
+    static ModelMergerType extract_type(ByteView data);
+    static std::shared_ptr<ShareableModel> create(ByteView data);
+    size_t memory_size() const;
+    size_t serial_size() const;  // at most, uncompressed
 
     ModelMergerType type_;
     int epoch;
+    int base;  // epoch model_ is a delta against, -1: whole model
     MatrixFactorizationModel model_;
     SharingRatings rawdata;
+
+   private:
+    // The same bytes go to every destination: one serialization per message
+    mutable std::mutex wire_mtx_;
+    mutable std::shared_ptr<const std::vector<uint8_t>> wire_;
+    mutable Compression::Codec wire_codec_;
 };
 typedef std::shared_ptr<ShareableModel> ShareableModelPtr;
 
@@ -37,6 +68,59 @@ class Communication {
                         std::shared_ptr<ShareableModel> m) = 0;
 };
 
+//------------------------------------------------------------------------------
+// Holds back what a merger shares so that it can be serialized and sent later,
+// off the critical path. Shareable models are snapshots: training may go on.
+//------------------------------------------------------------------------------
+class DeferredCommunication : public Communication {
+   public:
+    struct Message {
+        unsigned src, dst;
+        ShareableModelPtr model;
+    };
+    typedef std::vector<Message> Batch;
+
+    DeferredCommunication(Communication *c);
+    virtual size_t send(unsigned src, unsigned dst,
+                        std::shared_ptr<ShareableModel> m);
+    Batch take();
+    size_t send_all(const Batch &batch);
+
+   private:
+    Communication *communication_;
+    Batch pending_;
+};
+
+//------------------------------------------------------------------------------
+// Sends each neighbour only how our model differs from the last one it
+// acknowledged, and rebuilds whole models out of what neighbours send. A
+// neighbour that lost track of the base (e.g. reconnected) asks for a resync
+// and gets a whole model next. Dummies and control messages pass as they are.
+//------------------------------------------------------------------------------
+class DeltaCommunication : public Communication {
+   public:
+    DeltaCommunication(unsigned rank, Communication *c);
+    virtual size_t send(unsigned src, unsigned dst,
+                        std::shared_ptr<ShareableModel> m);
+    // What the merger should get, or null for our own control messages
+    ShareableModelPtr receive(unsigned src, ShareableModelPtr m);
+
+   private:
+    struct Peer {
+        Peer() : acked(-1) {}
+        int acked;                               // -1: send whole models
+        MatrixFactorizationModel reference;      // what it has for acked
+        std::map<int, MatrixFactorizationModel> unacked;
+    };
+    void control(unsigned dst, ModelMergerType type, int epoch);
+
+    unsigned rank_;
+    Communication *communication_;
+    std::map<unsigned, Peer> sent_;  // per neighbour, as they rebuilt them
+    std::map<unsigned, std::map<int, MatrixFactorizationModel>> received_;
+    std::mutex mtx_;
+};
+
 //------------------------------------------------------------------------------
 class ModelMerger {
    public:
@@ -47,23 +131,50 @@ class ModelMerger {
 
     virtual size_t share(int epoch) = 0;
     virtual void merge(int epoch) = 0;
-    void receive(unsigned src, std::shared_ptr<ShareableModel> m);
+    virtual void receive(unsigned src, std::shared_ptr<ShareableModel> m);
+    virtual bool ready(int epoch, size_t howmany);
     bool received_all(int epoch, size_t howmany);
+    void merge_buffered(int epoch);
+    bool throttled();
+    void set_partial_sharing(double fraction, unsigned block);
+    void set_share_budget(size_t bytes);
+    void set_memory_budget(size_t bytes);
+    void set_quantization(MFWeights::Precision p);
+    void resume(int epoch);
 #ifndef ENCLAVED
     virtual void set_logfile(std::shared_ptr<std::ofstream> file);
 #endif
 
    protected:
     SharingRatings extract_ratings(unsigned howmany);
+    MatrixFactorizationModel model_toshare(unsigned dst);
+    bool partial_sharing() const;
+
+    // Bounded buffering: models from neighbours running ahead get spilled in
+    // compressed form past memory_budget_, and their senders get throttled
+    size_t buffered_bytes() const;
+    bool enforce_budget(int epoch);
+    void unspill(int upto);
+    void send_throttle(unsigned dst, bool hold);
 
     std::shared_ptr<MFSGDDecentralized> trainer_;
     std::set<unsigned> &neighbours_;
     std::set<std::pair<unsigned, int>> recvdfrom_;
     std::map<int, std::vector<std::pair<unsigned, ShareableModelPtr>>>
         received_models_;
-    std::mutex recv_mtx_;
+    std::map<int, std::vector<std::pair<unsigned, std::vector<uint8_t>>>>
+        spilled_;
+    std::set<unsigned> throttled_senders_, throttled_by_;
+    size_t memory_budget_;  // 0: unlimited
+    int merged_epoch_;
+    std::mutex recv_mtx_, throttle_mtx_;
     Communication *communication_;
-    unsigned userrank_, share_howmany_;
+    unsigned userrank_, share_howmany_, share_block_;
+    double share_fraction_;
+    size_t share_budget_;  // model bytes per message, 0: all
+    std::map<unsigned, MatrixFactorizationModel> last_shared_;  // by neighbour
+    MFWeights::Precision precision_;     // of shared embeddings
+    MatrixFactorizationModel residual_;  // what quantization left out
     bool modelshare_, datashare_;
 
 #ifndef ENCLAVED
@@ -73,13 +184,15 @@ class ModelMerger {
 
 //------------------------------------------------------------------------------
 struct TrainInfo {
-    TrainInfo() : train_err(-1) {}
-    TrainInfo(std::pair<double, size_t> train, double test, double dur,
-              size_t bout, size_t bin);
+    TrainInfo() : epoch(-1), train_err(-1) {}
+    TrainInfo(int epoch, std::pair<double, size_t> train, double test,
+              double dur, size_t bout, size_t bin);
     bool dummy() const { return train_err < 0; }
+    int epoch;
     double train_err, test_err, duration;
     size_t train_count, bytes_out, bytes_in;
 };
+typedef std::function<void(const TrainInfo &)> EpochCallback;
 
 //------------------------------------------------------------------------------
 class MFNode {
@@ -87,34 +200,73 @@ class MFNode {
     MFNode(unsigned node_index, std::shared_ptr<DataStore> node_data,
            const TripletVector<uint8_t> &test_set, bool modelshare,
            bool datashare, std::string outdir);
+    MFNode(MFNode &&) = default;  // kept in vectors
     ~MFNode();
     bool add_neighbour(unsigned rank);
     unsigned rank();
+    size_t degree() const;
+    void set_partial_sharing(double fraction, unsigned block = 1);
+    void set_memory_budget(size_t bytes);
+    void set_share_budget(size_t bytes);
+    void set_quantization(unsigned bits);
+    void set_delta_encoding(bool enable);
+    void set_pipelined(EpochCallback done);
+#ifndef ENCLAVED
+    void set_checkpoint(const std::string &save_dir,
+                        const std::string &restore_dir);
+#endif
     void init_training(Communication *c, const HyperMFSGD &h,
                        ModelMergerType model, unsigned local = 1,
                        size_t steps_per_iteration = 30,
-                       unsigned share_howmany = 20);
+                       unsigned share_howmany = 20, unsigned staleness = 0);
     TrainInfo train_and_share(int epoch);
-    size_t receive(unsigned src, const std::vector<uint8_t> &data);
-    size_t receive(unsigned src, const std::shared_ptr<ShareableModel> m);
+    size_t receive(unsigned src, ByteView data);
+    // bytes: what it would have taken on the wire, accounted as received
+    size_t receive(unsigned src, const std::shared_ptr<ShareableModel> m,
+                   size_t bytes = 0);
     int finished_epoch();
+    void resume(int epoch);
     std::pair<bool, TrainInfo> trigger_epoch_if_ready(size_t degree);
     std::string summary();
 
    private:
+    TrainInfo share_and_test_pipelined(int epoch, double duration,
+                                       std::pair<double, size_t> train);
+    void flush_pipeline();
+#ifndef ENCLAVED
+    std::string checkpoint_file(const std::string &dir) const;
+#endif
+
     TripletVector<uint8_t> test_set_;
     std::set<unsigned> neighbours_;
     std::shared_ptr<DataStore> node_data_;
     std::shared_ptr<MFSGDDecentralized> trainer_;
     std::shared_ptr<ModelMerger> decentralized_sharing_;
     int finished_epoch_;
-    unsigned local_iterations_, node_index_;
+    unsigned local_iterations_, node_index_, share_block_;
+    double share_fraction_;
     bool modelshare_, datashare_;
     TimeProbeStats train_stats_, share_stats_, merging_stats_, inference_stats_;
     std::string outdir_;
-    size_t bytes_reported_, bytes_in_;
+    size_t bytes_reported_, memory_budget_, share_budget_;
+    // Senders are received concurrently. Moves along with the node.
+    struct ByteCounter : std::atomic<size_t> {
+        ByteCounter() : std::atomic<size_t>(0) {}
+        ByteCounter(ByteCounter &&other) : std::atomic<size_t>(other.load()) {}
+    };
+    ByteCounter bytes_in_;
+    MFWeights::Precision precision_;
+    bool delta_encoding_;
+    std::shared_ptr<DeltaCommunication> delta_;
+
+    // Pipelined mode: sharing and test of epoch e overlap training of e + 1
+    EpochCallback epoch_done_;
+    std::shared_ptr<DeferredCommunication> deferred_;
 #ifndef ENCLAVED
+    std::shared_ptr<ThreadPool> pipeline_;
+    std::shared_future<void> pipeline_last_;  // single worker: FIFO
     std::shared_ptr<std::ofstream> logfile_;
+    std::string checkpoint_dir_, restore_dir_;  // empty: none
 #endif
 };
 
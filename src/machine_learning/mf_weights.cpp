@@ -1,6 +1,11 @@
 #include "mf_weights.h"
 
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <limits>
 
 //------------------------------------------------------------------------------
 // MWeights
@@ -48,43 +53,548 @@ double MFWeights::predict(int user, int item) const {
            user_biases.coeff(0, user) + item_biases.coeff(0, item);
 }
 
+//------------------------------------------------------------------------------
+// Wire format. Unversioned (legacy) models start with the byte size of the
+// users triplet block. Versioned ones start with kVersioned, which no size can
+// be, and a version byte. Quantized ones follow it with their precision.
+//------------------------------------------------------------------------------
+static const size_t kVersioned = ~size_t(0);
+static const uint8_t kColumnBlocked = 1, kQuantized = 2;
+// ALL_ZERO: present, but nothing to send. Common in deltas between models.
+enum ColumnFlags : uint8_t { HAS_FACTORS = 1, HAS_BIAS = 2, ALL_ZERO = 4 };
+
+//------------------------------------------------------------------------------
+// IEEE 754 half precision, round to nearest
+//------------------------------------------------------------------------------
+static uint16_t to_half(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (x >> 16) & 0x8000;
+    int exponent = int((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = x & 0x7fffff;
+    if (exponent <= 0) {  // subnormal or zero
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint16_t half = mantissa >> shift;
+        if ((mantissa >> (shift - 1)) & 1) ++half;
+        return sign | half;
+    }
+    if (exponent >= 31) return sign | 0x7c00;  // too large
+    uint16_t half = sign | (exponent << 10) | (mantissa >> 13);
+    if (mantissa & 0x1000) ++half;  // may carry into the exponent: fine
+    return half;
+}
+
+//------------------------------------------------------------------------------
+static float from_half(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000) << 16, exponent = (h >> 10) & 0x1f,
+             mantissa = h & 0x3ff;
+    if (exponent == 0) {
+        float f = std::ldexp(float(mantissa), -24);
+        return sign ? -f : f;
+    }
+    uint32_t x = sign | (exponent == 31 ? 0x7f800000
+                                        : ((exponent - 15 + 127) << 23)) |
+                 (mantissa << 13);
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+//------------------------------------------------------------------------------
+// Bytes taken by n values of an embedding
+//------------------------------------------------------------------------------
+static size_t payload_size(size_t n, MFWeights::Precision p) {
+    switch (p) {
+        case MFWeights::INT8:
+            return 2 * sizeof(float) + n;
+        case MFWeights::FP16:
+            return 2 * sizeof(float) + n * sizeof(uint16_t);
+        default:
+            return n * sizeof(double);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Quantized values are stored relative to the column: (v - offset) / scale,
+// which lies in [0, 1]
+//------------------------------------------------------------------------------
+static void encode_values(const double *v, size_t n, MFWeights::Precision p,
+                          std::vector<uint8_t> &out) {
+    const uint8_t *bytes;
+    if (p == MFWeights::FP64) {
+        bytes = reinterpret_cast<const uint8_t *>(v);
+        out.insert(out.end(), bytes, bytes + n * sizeof(double));
+        return;
+    }
+
+    // Rounded up, so that the extremes decode to offset and offset + scale
+    // exactly: encoding decoded values again then gives the same bytes
+    auto range = std::minmax_element(v, v + n);
+    const float up = std::numeric_limits<float>::infinity();
+    float offset = *range.first;
+    if (offset < *range.first) offset = std::nextafter(offset, up);
+    float scale = std::max(0., *range.second - offset);
+    if (offset + double(scale) < *range.second)
+        scale = std::nextafter(scale, up);
+    bytes = reinterpret_cast<const uint8_t *>(&offset);
+    out.insert(out.end(), bytes, bytes + sizeof(offset));
+    bytes = reinterpret_cast<const uint8_t *>(&scale);
+    out.insert(out.end(), bytes, bytes + sizeof(scale));
+    for (size_t i = 0; i < n; ++i) {
+        double u = scale > 0 ? (v[i] - offset) / scale : 0;
+        u = std::min(1., std::max(0., u));
+        if (p == MFWeights::INT8) {
+            out.push_back(uint8_t(std::lround(u * 255)));
+        } else {
+            uint16_t half = to_half(u);
+            bytes = reinterpret_cast<const uint8_t *>(&half);
+            out.insert(out.end(), bytes, bytes + sizeof(half));
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+static void decode_values(const uint8_t *in, size_t n, MFWeights::Precision p,
+                          double *v) {
+    if (p == MFWeights::FP64) {
+        memcpy(v, in, n * sizeof(double));
+        return;
+    }
+
+    float offset, scale;
+    memcpy(&offset, in, sizeof(offset));
+    memcpy(&scale, in + sizeof(offset), sizeof(scale));
+    in += 2 * sizeof(float);
+    for (size_t i = 0; i < n; ++i) {
+        double u;
+        if (p == MFWeights::INT8) {
+            u = in[i] / 255.;
+        } else {
+            uint16_t half;
+            memcpy(&half, in + i * sizeof(half), sizeof(half));
+            u = from_half(half);
+        }
+        v[i] = offset + u * scale;
+    }
+}
+
+//------------------------------------------------------------------------------
+static uint8_t column_flags(const Sparse &factors, const Sparse &biases,
+                            int c) {
+    uint8_t flags = 0;
+    if (c < factors.outerSize() && Sparse::InnerIterator(factors, c))
+        flags |= HAS_FACTORS;
+    if (c < biases.outerSize() && Sparse::InnerIterator(biases, c))
+        flags |= HAS_BIAS;
+    return flags;
+}
+
+//------------------------------------------------------------------------------
+// The embedding as it travels: dense factors, then the bias
+//------------------------------------------------------------------------------
+static size_t gather_column(const Sparse &factors, const Sparse &biases, int c,
+                            uint8_t flags, std::vector<double> &values) {
+    size_t n = 0, rows = factors.rows();
+    if (flags & HAS_FACTORS) {
+        std::fill(values.begin(), values.begin() + rows, 0.);
+        for (Sparse::InnerIterator it(factors, c); it; ++it) {
+            values[it.row()] = it.value();
+        }
+        n += rows;
+    }
+    if (flags & HAS_BIAS) values[n++] = biases.coeff(0, c);
+    return n;
+}
+
+//------------------------------------------------------------------------------
+static size_t values_in(uint8_t flags, int rows) {
+    return ((flags & HAS_FACTORS) ? rows : 0) + ((flags & HAS_BIAS) ? 1 : 0);
+}
+
+//------------------------------------------------------------------------------
+static size_t column_payload(uint8_t flags, int rows, MFWeights::Precision p) {
+    return (flags & ALL_ZERO) ? 0 : payload_size(values_in(flags, rows), p);
+}
+
+//------------------------------------------------------------------------------
+// Upper bound for one embedding: id delta, flags, factors and bias
+//------------------------------------------------------------------------------
+size_t MFWeights::serial_column_size(int rank, Precision p) {
+    return 5 + 1 + payload_size(rank + 1, p);
+}
+
+//------------------------------------------------------------------------------
+// Upper bound for what does not depend on the embeddings
+//------------------------------------------------------------------------------
+size_t MFWeights::serial_overhead() {
+    return sizeof(kVersioned) + 2 + 2 * (5 + 5);
+}
+
+//------------------------------------------------------------------------------
+size_t MFWeights::present_columns(const Sparse &factors, const Sparse &biases) {
+    size_t ret = 0;
+    for (int c = 0; c < std::max(factors.outerSize(), biases.outerSize());
+         ++c) {
+        ret += column_flags(factors, biases, c) != 0;
+    }
+    return ret;
+}
+
 //------------------------------------------------------------------------------
 size_t MFWeights::estimate_serial_size() const {
-    return serial_size(users) + serial_size(items) + serial_size(user_biases) +
-           serial_size(item_biases);
+    return serial_overhead() +
+           present_columns(users, user_biases) *
+               serial_column_size(users.rows(), precision) +
+           present_columns(items, item_biases) *
+               serial_column_size(items.rows(), precision);
 }
 
 //------------------------------------------------------------------------------
-void MFWeights::serialize_with_size(const Sparse &matrix,
-                                    std::vector<uint8_t> &out) const {
-    size_t index = out.size();
-    uint8_t *nptr = reinterpret_cast<uint8_t *>(&index);
-    out.insert(out.end(), nptr, nptr + sizeof(index));  // placeholder
-    matrix_to_triplets_append(matrix, out);
-    assert(*reinterpret_cast<size_t *>(&out[index]) == index);  // check value
-    size_t tmp = out.size() - index - sizeof(size_t);
-    memcpy(&out[index], &tmp, sizeof(tmp));  // fill size in B
+// Column-blocked: rows, number of columns, then for each present column its id
+// (delta to the previous one), flags and the whole embedding, unless all zero
+//------------------------------------------------------------------------------
+void MFWeights::serialize_columns(const Sparse &factors, const Sparse &biases,
+                                  Precision p, std::vector<uint8_t> &out) {
+    int rows = factors.rows();
+    varint_append(rows, out);
+    varint_append(present_columns(factors, biases), out);
+
+    int previous = -1;
+    std::vector<double> values(rows + 1);
+    for (int c = 0; c < std::max(factors.outerSize(), biases.outerSize());
+         ++c) {
+        uint8_t flags = column_flags(factors, biases, c);
+        if (!flags) continue;
+
+        size_t n = gather_column(factors, biases, c, flags, values);
+        if (std::all_of(values.begin(), values.begin() + n,
+                        [](double v) { return v == 0; })) {
+            flags |= ALL_ZERO;
+        }
+
+        varint_append(c - previous - 1, out);
+        out.push_back(flags);
+        previous = c;
+        if (!(flags & ALL_ZERO)) encode_values(values.data(), n, p, out);
+    }
 }
 
 //------------------------------------------------------------------------------
 void MFWeights::serialize_append(std::vector<uint8_t> &out) const {
-    serialize_with_size(users, out);
-    serialize_with_size(items, out);
-    serialize_with_size(user_biases, out);
-    serialize_with_size(item_biases, out);
+    const uint8_t *marker = reinterpret_cast<const uint8_t *>(&kVersioned);
+    out.insert(out.end(), marker, marker + sizeof(kVersioned));
+    if (precision == FP64) {
+        out.push_back(kColumnBlocked);
+    } else {
+        out.push_back(kQuantized);
+        out.push_back(precision);
+    }
+    serialize_columns(users, user_biases, precision, out);
+    serialize_columns(items, item_biases, precision, out);
+}
+
+//------------------------------------------------------------------------------
+// Messages come from peers: what does not add up is rejected as an unknown
+// format is
+//------------------------------------------------------------------------------
+static void malformed(const char *what) {
+    std::cerr << "Malformed model: " << what << std::endl;
+    abort();
+}
+
+//------------------------------------------------------------------------------
+// Ids may be sparse, but every one costs a column index here and in what the
+// message decodes to, so a few bytes must not declare billions of them
+//------------------------------------------------------------------------------
+bool MFWeights::plausible_columns(uint64_t cols, uint64_t carried) {
+    return cols <= (uint64_t(1) << 16) + 16 * carried;
+}
+
+//------------------------------------------------------------------------------
+// Three passes over the message: one to check it and find its shape, one to
+// count what each column holds, one to fill the matrices. Every column has as
+// many rows as the model has rank.
+//------------------------------------------------------------------------------
+size_t MFWeights::deserialize_columns(Sparse &factors, Sparse &biases,
+                                      Precision p, int rank, ByteView data,
+                                      size_t offset) {
+    uint64_t shape = varint_read(data, offset);
+    size_t count = varint_read(data, offset), begin = offset;
+    if (count && shape != uint64_t(rank)) malformed("rows differ from rank");
+    if (shape > uint64_t(kMaxRank)) malformed("too many rows");
+    int rows = shape;
+
+    int last = -1;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t step = varint_read(data, offset);
+        if (step >= uint64_t(INT_MAX - 1 - last)) malformed("too many columns");
+        last += step + 1;
+        if (offset >= data.size()) malformed("short message");
+        uint8_t flags = data[offset++];
+        if (values_in(flags, rows) == 0) malformed("empty column");
+        size_t payload = column_payload(flags, rows, p);
+        if (payload > data.size() - offset) malformed("short message");
+        offset += payload;
+    }
+    size_t end = offset;
+    if (!plausible_columns(size_t(last) + 1, end - begin)) {
+        malformed("ids beyond what the message carries");
+    }
+
+    int cols = last + 1;
+    factors.resize(count ? rows : 0, cols);
+    biases.resize(count ? 1 : 0, cols);
+    if (count == 0) return end;
+    Eigen::VectorXi factor_nnz = Eigen::VectorXi::Zero(cols),
+                    bias_nnz = Eigen::VectorXi::Zero(cols);
+    offset = begin;
+    int c = -1;
+    for (size_t i = 0; i < count; ++i) {
+        c += varint_read(data, offset) + 1;
+        uint8_t flags = data[offset++];
+        // all-zero embeddings keep a single stored zero
+        if (flags & HAS_FACTORS) factor_nnz[c] = (flags & ALL_ZERO) ? 1 : rows;
+        if (flags & HAS_BIAS) bias_nnz[c] = 1;
+        offset += column_payload(flags, rows, p);
+    }
+    factors.reserve(factor_nnz);
+    biases.reserve(bias_nnz);
+
+    offset = begin;
+    std::vector<double> values(size_t(rows) + 1);
+    c = -1;
+    for (size_t i = 0; i < count; ++i) {
+        c += varint_read(data, offset) + 1;
+        uint8_t flags = data[offset++];
+        size_t n = values_in(flags, rows);
+        if (flags & ALL_ZERO) {
+            std::fill(values.begin(), values.begin() + n, 0.);
+        } else {
+            decode_values(&data[offset], n, p, values.data());
+        }
+        offset += column_payload(flags, rows, p);
+        store_column(factors, biases, c, flags, values.data(), values[n - 1]);
+    }
+    factors.makeCompressed();
+    biases.makeCompressed();
+    return end;
+}
+
+//------------------------------------------------------------------------------
+// Into reserved space, columns in order. Zeros are left out, but for a single
+// one that keeps an all-zero embedding present.
+//------------------------------------------------------------------------------
+void MFWeights::store_column(Sparse &factors, Sparse &biases, int c,
+                             uint8_t flags, const double *values,
+                             double bias) {
+    if (flags & HAS_FACTORS) {
+        bool stored = false;
+        int rows = factors.rows();
+        for (int r = 0; r < rows; ++r) {
+            if (values[r] != 0 || (!stored && r == rows - 1)) {
+                factors.insert(r, c) = values[r];
+                stored = true;
+            }
+        }
+    }
+    if (flags & HAS_BIAS) biases.insert(0, c) = bias;
+}
+
+//------------------------------------------------------------------------------
+// Fixed stride, so that the values can be used as a (rows + 1) x count matrix
+//------------------------------------------------------------------------------
+void MFWeights::dense_columns(const Sparse &factors, const Sparse &biases,
+                              std::vector<int32_t> &ids,
+                              std::vector<uint8_t> &flags,
+                              std::vector<double> &values) {
+    int rows = factors.rows();
+    for (int c = 0; c < std::max(factors.outerSize(), biases.outerSize());
+         ++c) {
+        uint8_t f = column_flags(factors, biases, c);
+        if (!f) continue;
+        ids.push_back(c);
+        flags.push_back(f);
+        size_t at = values.size();
+        values.resize(at + rows + 1, 0.);
+        if (f & HAS_FACTORS) {
+            for (Sparse::InnerIterator it(factors, c); it; ++it) {
+                values[at + it.row()] = it.value();
+            }
+        }
+        if (f & HAS_BIAS) values[at + rows] = biases.coeff(0, c);
+    }
+}
+
+//------------------------------------------------------------------------------
+void MFWeights::from_dense_columns(int rows, size_t count, const int32_t *ids,
+                                   const uint8_t *flags, const double *values,
+                                   Sparse &factors, Sparse &biases) {
+    int cols = count ? ids[count - 1] + 1 : 0;  // checkpoints check ids
+    factors.resize(count ? rows : 0, cols);
+    biases.resize(count ? 1 : 0, cols);
+    if (count == 0) return;
+    Eigen::VectorXi factor_nnz = Eigen::VectorXi::Zero(cols),
+                    bias_nnz = Eigen::VectorXi::Zero(cols);
+    for (size_t i = 0; i < count; ++i) {
+        if (flags[i] & HAS_FACTORS) factor_nnz[ids[i]] = rows;
+        if (flags[i] & HAS_BIAS) bias_nnz[ids[i]] = 1;
+    }
+    factors.reserve(factor_nnz);
+    biases.reserve(bias_nnz);
+    size_t stride = size_t(rows) + 1;
+    for (size_t i = 0; i < count; ++i, values += stride) {
+        store_column(factors, biases, ids[i], flags[i], values, values[rows]);
+    }
+    factors.makeCompressed();
+    biases.makeCompressed();
 }
 
 //------------------------------------------------------------------------------
-size_t MFWeights::deserialize_matrix(Sparse &matrix,
-                                     const std::vector<uint8_t> &data,
+// Rounds every embedding to what its quantized form decodes to. What rounding
+// took away is carried in residual and added back before the next rounding,
+// so that errors do not pile up over epochs.
+//------------------------------------------------------------------------------
+void MFWeights::quantize_columns(Sparse &factors, Sparse &biases, Precision p,
+                                 Sparse *factor_residual,
+                                 Sparse *bias_residual) {
+    int rows = factors.rows(),
+        cols = std::max(factors.outerSize(), biases.outerSize());
+    TripletVector<double> factor_errors, bias_errors;
+    std::vector<double> values(rows + 1), decoded(rows + 1);
+    std::vector<uint8_t> encoded;
+    for (int c = 0; c < cols; ++c) {
+        uint8_t flags = column_flags(factors, biases, c);
+        if (!flags) continue;
+        size_t n = gather_column(factors, biases, c, flags, values);
+
+        if (factor_residual) {
+            size_t i = 0;
+            if ((flags & HAS_FACTORS) && c < factor_residual->outerSize()) {
+                for (Sparse::InnerIterator it(*factor_residual, c); it; ++it) {
+                    if (it.row() < rows) values[it.row()] += it.value();
+                }
+            }
+            if (flags & HAS_FACTORS) i = rows;
+            if ((flags & HAS_BIAS) && c < bias_residual->outerSize()) {
+                values[i] += bias_residual->coeff(0, c);
+            }
+        }
+
+        encoded.clear();
+        encode_values(values.data(), n, p, encoded);
+        decode_values(encoded.data(), n, p, decoded.data());
+
+        size_t i = 0;
+        if (flags & HAS_FACTORS) {
+            for (; i < size_t(rows); ++i) {
+                if (values[i] != decoded[i])
+                    factor_errors.emplace_back(i, c, values[i] - decoded[i]);
+            }
+            for (Sparse::InnerIterator it(factors, c); it; ++it) {
+                it.valueRef() = decoded[it.row()];
+            }
+        }
+        if (flags & HAS_BIAS) {
+            if (values[i] != decoded[i])
+                bias_errors.emplace_back(0, c, values[i] - decoded[i]);
+            for (Sparse::InnerIterator it(biases, c); it; ++it) {
+                it.valueRef() = decoded[i];
+            }
+        }
+    }
+    if (!factor_residual) return;
+
+    // Columns not sent this time keep their residual for the next
+    auto carry = [&](const Sparse &residual, const Sparse &sent,
+                     TripletVector<double> &errors, int height) {
+        for (int c = 0; c < residual.outerSize(); ++c) {
+            if (c < sent.outerSize() && Sparse::InnerIterator(sent, c))
+                continue;
+            for (Sparse::InnerIterator it(residual, c); it; ++it) {
+                errors.emplace_back(it.row(), c, it.value());
+            }
+        }
+        int width = std::max<int>(cols, residual.cols());
+        Sparse updated(std::max<int>(height, residual.rows()), width);
+        updated.setFromTriplets(errors.begin(), errors.end());
+        return updated;
+    };
+    *factor_residual = carry(*factor_residual, factors, factor_errors, rows);
+    *bias_residual = carry(*bias_residual, biases, bias_errors, 1);
+}
+
+//------------------------------------------------------------------------------
+void MFWeights::quantize(Precision p, MFWeights *residual) {
+    precision = p;
+    if (p == FP64) return;
+    quantize_columns(users, user_biases, p,
+                     residual ? &residual->users : nullptr,
+                     residual ? &residual->user_biases : nullptr);
+    quantize_columns(items, item_biases, p,
+                     residual ? &residual->items : nullptr,
+                     residual ? &residual->item_biases : nullptr);
+}
+
+//------------------------------------------------------------------------------
+// Columns of m, each plus sign times the same column of base (none: zeros).
+// They come out dense, explicit zeros included, so that none goes missing.
+//------------------------------------------------------------------------------
+Sparse MFWeights::combine_columns(const Sparse &m, const Sparse &base,
+                                  double sign) {
+    TripletVector<double> triplets;
+    std::vector<double> column(m.rows());
+    for (int c = 0; c < m.outerSize(); ++c) {
+        Sparse::InnerIterator it(m, c);
+        if (!it) continue;
+        std::fill(column.begin(), column.end(), 0.);
+        for (; it; ++it) column[it.row()] = it.value();
+        if (c < base.outerSize()) {
+            for (Sparse::InnerIterator b(base, c); b; ++b) {
+                if (b.row() < m.rows()) column[b.row()] += sign * b.value();
+            }
+        }
+        for (int r = 0; r < m.rows(); ++r) {
+            triplets.emplace_back(r, c, column[r]);
+        }
+    }
+    Sparse ret(m.rows(), m.cols());
+    ret.setFromTriplets(triplets.begin(), triplets.end());
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// The embeddings of this one, minus (sign -1) or plus (+1) those of base
+//------------------------------------------------------------------------------
+MFWeights MFWeights::combined(const MFWeights &base, double sign) const {
+    MFWeights ret;
+    ret.users = combine_columns(users, base.users, sign);
+    ret.user_biases = combine_columns(user_biases, base.user_biases, sign);
+    ret.items = combine_columns(items, base.items, sign);
+    ret.item_biases = combine_columns(item_biases, base.item_biases, sign);
+    ret.precision = precision;
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// Legacy format: each matrix as a byte size followed by Triplet<double>s
+//------------------------------------------------------------------------------
+size_t MFWeights::deserialize_matrix(Sparse &matrix, ByteView data,
                                      size_t offset) {
     typedef TripletVector<Sparse::Scalar>::value_type TripletType;
-    const size_t *size = reinterpret_cast<const size_t *>(&data[offset]);
+    size_t size;
+    if (offset > data.size() || data.size() - offset < sizeof(size)) {
+        malformed("short message");
+    }
+    memcpy(&size, &data[offset], sizeof(size));
     offset += sizeof(size_t);
+    if (size > data.size() - offset || size % sizeof(TripletType)) {
+        malformed("short message");
+    }
     const TripletType *begin =
         reinterpret_cast<const TripletType *>(&data[offset]);
-    offset += *size;
-    assert(offset <= data.size());
+    offset += size;
     const TripletType *end =
         reinterpret_cast<const TripletType *>(&data[offset]);
     matrix = matrix_from_data<Sparse::Scalar, Sparse::Options>(begin, end);
@@ -92,8 +602,31 @@ size_t MFWeights::deserialize_matrix(Sparse &matrix,
 }
 
 //------------------------------------------------------------------------------
-size_t MFWeights::deserialize(const std::vector<uint8_t> &data, size_t offset) {
-    assert(offset < data.size());
+size_t MFWeights::deserialize(ByteView data, size_t offset, int rank) {
+    // marker and version, or the legacy size
+    if (offset > data.size() || data.size() - offset <= sizeof(kVersioned)) {
+        malformed("short message");
+    }
+    size_t marker;
+    memcpy(&marker, &data[offset], sizeof(marker));
+    if (marker == kVersioned) {
+        offset += sizeof(marker);
+        uint8_t version = data[offset++];
+        Precision p = FP64;  // decoded values are plain doubles again
+        if (version == kQuantized && offset < data.size() &&
+            data[offset] <= INT8) {
+            p = Precision(data[offset++]);
+        } else if (version != kColumnBlocked) {
+            std::cerr << "Unknown model format version " << int(version)
+                      << std::endl;
+            abort();
+        }
+        offset = deserialize_columns(users, user_biases, p, rank, data, offset);
+        offset = deserialize_columns(items, item_biases, p, rank, data, offset);
+        assert(offset <= data.size());
+        return offset;
+    }
+
     offset = deserialize_matrix(users, data, offset);
     assert(offset < data.size());
     offset = deserialize_matrix(items, data, offset);
@@ -106,9 +639,3 @@ size_t MFWeights::deserialize(const std::vector<uint8_t> &data, size_t offset) {
 }
 
 //------------------------------------------------------------------------------
-size_t MFWeights::serial_size(const Sparse &m) const {
-    return m.nonZeros() *
-           (sizeof(Sparse::Scalar) + 2 * sizeof(Sparse::StorageIndex));
-}
-
-//------------------------------------------------------------------------------
@@ -5,6 +5,9 @@
 typedef std::pair<double, std::vector<double>> Embedding;
 class MFWeights {
    public:
+    // How embeddings travel. Quantized ones use a per-column offset and scale
+    enum Precision : uint8_t { FP64, FP16, INT8 };
+
     bool has_item(int item) const;
     bool has_user(int user) const;
 
@@ -14,18 +17,45 @@ class MFWeights {
 
     size_t estimate_serial_size() const;
     void serialize_append(std::vector<uint8_t>& out) const;
-    size_t deserialize(const std::vector<uint8_t>& data, size_t offset);
+    size_t deserialize(ByteView data, size_t offset, int rank);
+    static size_t serial_column_size(int rank, Precision p = FP64);
+    static size_t serial_overhead();
+    void quantize(Precision p, MFWeights* residual);
+    MFWeights combined(const MFWeights& base, double sign) const;
+
+    // Dense form checkpoints keep: for each present column its id, flags and
+    // rows + 1 values (factors, then the bias). Ids come in increasing order.
+    static void dense_columns(const Sparse& factors, const Sparse& biases,
+                              std::vector<int32_t>& ids,
+                              std::vector<uint8_t>& flags,
+                              std::vector<double>& values);
+    static void from_dense_columns(int rows, size_t count, const int32_t* ids,
+                                   const uint8_t* flags, const double* values,
+                                   Sparse& factors, Sparse& biases);
+    // What a model or checkpoint may claim before it is taken for garbage:
+    // ranks are tens, ids run ahead of the bytes carrying them only so far
+    static const int kMaxRank = 1 << 12;
+    static bool plausible_columns(uint64_t cols, uint64_t carried);
 
     Sparse users, user_biases;
     Sparse items, item_biases;
+    Precision precision = FP64;
 
    private:
-    size_t serial_size(const Sparse&) const;
-    size_t deserialize_matrix(Sparse &matrix,
-                                     const std::vector<uint8_t> &data,
-                                     size_t offset);
-    void serialize_with_size(const Sparse &matrix,
-                                    std::vector<uint8_t> &out) const;
+    size_t deserialize_matrix(Sparse &matrix, ByteView data, size_t offset);
+    static void serialize_columns(const Sparse& factors, const Sparse& biases,
+                                  Precision p, std::vector<uint8_t>& out);
+    static size_t deserialize_columns(Sparse& factors, Sparse& biases,
+                                      Precision p, int rank, ByteView data,
+                                      size_t offset);
+    static void quantize_columns(Sparse& factors, Sparse& biases, Precision p,
+                                 Sparse* factor_residual,
+                                 Sparse* bias_residual);
+    static void store_column(Sparse& factors, Sparse& biases, int c,
+                             uint8_t flags, const double* values, double bias);
+    static size_t present_columns(const Sparse& factors, const Sparse& biases);
+    static Sparse combine_columns(const Sparse& m, const Sparse& base,
+                                  double sign);
     
     Embedding get_factors(int i, const Sparse& factors,
                           const Sparse& bias) const;
@@ -0,0 +1,99 @@
+#include "network_model.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+//------------------------------------------------------------------------------
+bool LinkSpec::parse(const std::string &spec, LinkSpec &link) {
+    std::istringstream in(spec);
+    double fields[4] = {0, 0, 0, 0};
+    std::string field;
+    int i = 0;
+    try {
+        for (; i < 4 && std::getline(in, field, ':'); ++i) {
+            fields[i] = std::stod(field);
+        }
+    } catch (const std::logic_error &e) {
+        return false;
+    }
+    if (i == 0 || !in.eof() || fields[3] < 0 || fields[3] >= 1) return false;
+    link.bandwidth = fields[0] * 1e6 / 8;
+    link.latency = fields[1] / 1e3;
+    link.jitter = fields[2] / 1e3;
+    link.loss = fields[3];
+    return true;
+}
+
+//------------------------------------------------------------------------------
+NetworkModel::NetworkModel(const LinkSpec &defaults, unsigned seed)
+    : defaults_(defaults), seed_(seed) {}
+
+//------------------------------------------------------------------------------
+bool NetworkModel::load_links(const std::string &fname) {
+    std::ifstream file(fname);
+    if (!file.good()) {
+        std::cerr << "Could not open " << fname << std::endl;
+        return false;
+    }
+    std::string line;
+    for (unsigned number = 1; std::getline(file, line); ++number) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream in(line);
+        unsigned src, dst;
+        std::string spec;
+        if (!(in >> src)) continue;  // blank
+        LinkSpec link;
+        if (!(in >> dst >> spec) || !LinkSpec::parse(spec, link)) {
+            std::cerr << fname << ":" << number << ": invalid link" << std::endl;
+            return false;
+        }
+        specs_[std::make_pair(src, dst)] = link;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+NetworkModel::Link &NetworkModel::link(unsigned src, unsigned dst) {
+    auto key = std::make_pair(src, dst);
+    auto it = links_.find(key);
+    if (it != links_.end()) return it->second;
+
+    Link &ret = links_[key];
+    auto spec = specs_.find(key);
+    ret.spec = spec == specs_.end() ? defaults_ : spec->second;
+    ret.free_at = ret.last_arrival = 0;
+    std::seed_seq seed = {seed_, src, dst};
+    ret.rng.seed(seed);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+// Links of a sender are only used from its own thread, in the order of its
+// clock: the queue needs no global ordering of events
+//------------------------------------------------------------------------------
+double NetworkModel::deliver(unsigned src, unsigned dst, size_t bytes,
+                             double sent) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    Link &l = link(src, dst);
+    const LinkSpec &spec = l.spec;
+
+    double start = std::max(sent, l.free_at);
+    l.free_at = start + (spec.bandwidth > 0 ? bytes / spec.bandwidth : 0);
+    double delay = spec.latency;
+    if (spec.jitter > 0) {
+        std::uniform_real_distribution<double> jitter(-spec.jitter,
+                                                      spec.jitter);
+        delay = std::max(0., delay + jitter(l.rng));
+    }
+    if (spec.loss > 0) {
+        std::binomial_distribution<size_t> lost((bytes + kPacket - 1) / kPacket,
+                                                spec.loss);
+        delay += lost(l.rng) * 2 * spec.latency;
+    }
+    l.last_arrival = std::max(l.last_arrival, l.free_at + delay);
+    return l.last_arrival;
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Bandwidth in bytes per second (0: unlimited), latency and jitter in
+// seconds, loss as the fraction of packets lost
+//------------------------------------------------------------------------------
+struct LinkSpec {
+    LinkSpec() : bandwidth(0), latency(0), jitter(0), loss(0) {}
+    // "Mbps:ms:ms:loss", trailing fields may be left out
+    static bool parse(const std::string &spec, LinkSpec &link);
+    double bandwidth, latency, jitter, loss;
+};
+
+//------------------------------------------------------------------------------
+// When messages sent over emulated links arrive, in simulated seconds. Each
+// link is a queue: a message is transmitted once the previous one is out, at
+// the link's bandwidth, then travels for the latency plus up to jitter either
+// way, as netem does. Delivery is in order, as over TCP. A packet lost costs
+// its message one round trip, as a fast retransmit. Links draw from their own
+// generator: a run gets the same delays whatever the thread interleaving.
+//------------------------------------------------------------------------------
+class NetworkModel {
+   public:
+    NetworkModel(const LinkSpec &defaults, unsigned seed = 1);
+    // Lines "src dst Mbps:ms:ms:loss", one per direction; # starts a comment
+    bool load_links(const std::string &fname);
+    double deliver(unsigned src, unsigned dst, size_t bytes, double sent);
+
+   private:
+    struct Link {
+        LinkSpec spec;
+        double free_at, last_arrival;
+        std::mt19937 rng;
+    };
+    Link &link(unsigned src, unsigned dst);
+
+    static const size_t kPacket = 1448;  // TCP payload of an Ethernet frame
+    LinkSpec defaults_;
+    unsigned seed_;
+    std::mutex mtx_;
+    std::map<std::pair<unsigned, unsigned>, LinkSpec> specs_;
+    std::map<std::pair<unsigned, unsigned>, Link> links_;
+};
+
+//------------------------------------------------------------------------------
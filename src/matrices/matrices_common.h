@@ -2,6 +2,9 @@
 
 #include <Eigen/Dense>
 #include <Eigen/Sparse>
+#include <utils/byte_view.h>
+
+#include <climits>
 
 typedef Eigen::SparseMatrix<uint8_t> Ratings;
 typedef Eigen::SparseMatrix<double> Sparse;
@@ -39,6 +42,39 @@ void sparse_matrix_iterate(
     }
 }
 
+//------------------------------------------------------------------------------
+// LEB128: 7 bits per byte, least significant first, high bit set if more
+//------------------------------------------------------------------------------
+inline void varint_append(uint64_t v, std::vector<uint8_t>& out) {
+    while (v >= 0x80) {
+        out.push_back(uint8_t(v) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(uint8_t(v));
+}
+
+//------------------------------------------------------------------------------
+// False if data ends within it, or it runs past the 10 bytes of any uint64_t
+//------------------------------------------------------------------------------
+inline bool varint_read(ByteView data, size_t& offset, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && offset < data.size(); shift += 7) {
+        uint8_t byte = data[offset++];
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// What there is of it: callers check bounds after
+//------------------------------------------------------------------------------
+inline uint64_t varint_read(ByteView data, size_t& offset) {
+    uint64_t ret;
+    varint_read(data, offset, ret);
+    return ret;
+}
+
 //------------------------------------------------------------------------------
 template <typename T>
 TripletVector<typename T::Scalar> matrix_to_triplets(const T& m) {
@@ -55,10 +91,12 @@ TripletVector<typename T::Scalar> matrix_to_triplets(const T& m) {
 template <typename T>
 void matrix_to_triplets_append(const T& m, std::vector<uint8_t>& out) {
     typedef typename TripletVector<typename T::Scalar>::value_type TripletType;
+    size_t index = out.size();
+    out.resize(index + m.nonZeros() * sizeof(TripletType));  // sized once
+    uint8_t* cursor = out.data() + index;
     sparse_matrix_iterate(m, [&](typename T::InnerIterator it) {
-        size_t index = out.size();
-        out.resize(index + sizeof(TripletType));
-        new (&out[index]) TripletType(it.row(), it.col(), it.value());
+        new (cursor) TripletType(it.row(), it.col(), it.value());
+        cursor += sizeof(TripletType);
     });
 }
 
@@ -77,6 +115,73 @@ TripletVector<T> raw_to_triplets(const std::vector<uint8_t>& data) {
     return TripletVector<T>(t, t + n);
 }
 
+//------------------------------------------------------------------------------
+// Ratings shared between nodes: count, values (0-10) two per byte, then
+// (user, item) in order as varints. Users are deltas to the previous one;
+// items too while the user stays the same. Independent of struct layout.
+//------------------------------------------------------------------------------
+inline void ratings_append(const TripletVector<uint8_t>& v,
+                           std::vector<uint8_t>& out) {
+    auto less = [](const Triplet<uint8_t>& a, const Triplet<uint8_t>& b) {
+        return a.row() < b.row() || (a.row() == b.row() && a.col() < b.col());
+    };
+    const TripletVector<uint8_t>* sorted = &v;
+    TripletVector<uint8_t> copy;
+    if (!std::is_sorted(v.begin(), v.end(), less)) {
+        copy = v;
+        std::sort(copy.begin(), copy.end(), less);
+        sorted = &copy;
+    }
+
+    varint_append(sorted->size(), out);
+    size_t values = out.size();
+    out.resize(values + (sorted->size() + 1) / 2);
+    for (size_t i = 0; i < sorted->size(); ++i) {
+        uint8_t value = (*sorted)[i].value();
+        assert(value <= 15);
+        out[values + i / 2] |= value << (i % 2 * 4);
+    }
+    int user = 0, item = 0;
+    for (const auto& t : *sorted) {
+        varint_append(t.row() - user, out);
+        varint_append(t.row() == user ? t.col() - item : t.col(), out);
+        user = t.row();
+        item = t.col();
+    }
+}
+
+//------------------------------------------------------------------------------
+// False if they do not add up: ratings come from peers. Each one takes at
+// least two bytes of varints, ids stay ints and values at most 10.
+//------------------------------------------------------------------------------
+inline bool ratings_read(ByteView data, size_t& offset,
+                         TripletVector<uint8_t>& dst) {
+    uint64_t n;
+    if (!varint_read(data, offset, n) || n > data.size() - offset) {
+        return false;
+    }
+    size_t values = offset;
+    offset += (n + 1) / 2;
+    if (n > (data.size() - offset) / 2) return false;
+    dst.reserve(dst.size() + n);
+    uint64_t user = 0, item = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t step, col;
+        if (!varint_read(data, offset, step) ||
+            !varint_read(data, offset, col) || step > INT_MAX - user) {
+            return false;
+        }
+        user += step;
+        if (step) item = 0;
+        if (col > INT_MAX - item) return false;
+        item += col;
+        uint8_t value = data[values + i / 2] >> (i % 2 * 4) & 15;
+        if (value > 10) return false;
+        dst.emplace_back(user, item, value);
+    }
+    return true;
+}
+
 //------------------------------------------------------------------------------
 template <typename T, int Major = Eigen::ColMajor,
           typename Iterator = typename TripletVector<T>::const_iterator>
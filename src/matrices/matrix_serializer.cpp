@@ -2,72 +2,421 @@
 
 #ifdef ENCLAVED
 #include <libc_mock/libcpp_mock.h>
-#include <json/json.hpp>
-#else
-#include <json/json-17.hpp>
 #endif
-using json = nlohmann::json;
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <streambuf>
+#include <string>
 
 //------------------------------------------------------------------------------
-// JsonSerializer
+// Stream buffers over the caller's bytes: output appended to a vector, input
+// read where it lies
+//------------------------------------------------------------------------------
+class VectorBuffer : public std::streambuf {
+   public:
+    explicit VectorBuffer(std::vector<uint8_t> &out) : out_(out) {}
+
+   protected:
+    int_type overflow(int_type c) {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            out_.push_back(uint8_t(c));
+        }
+        return traits_type::not_eof(c);
+    }
+    std::streamsize xsputn(const char *s, std::streamsize n) {
+        out_.insert(out_.end(), s, s + n);
+        return n;
+    }
+
+   private:
+    std::vector<uint8_t> &out_;
+};
+
+class ViewBuffer : public std::streambuf {
+   public:
+    explicit ViewBuffer(ByteView in) {
+        char *p = const_cast<char *>(reinterpret_cast<const char *>(in.data()));
+        setg(p, p, p + in.size());
+    }
+};
+
+//------------------------------------------------------------------------------
+static void malformed(const char *format, const char *what) {
+    std::cerr << "Malformed " << format << " matrix: " << what << std::endl;
+    abort();
+}
+
+//------------------------------------------------------------------------------
+// MatrixSerializer
+//------------------------------------------------------------------------------
+std::vector<uint8_t> MatrixSerializer::serialize(const Dense &m) {
+    std::vector<uint8_t> ret;
+    VectorBuffer buffer(ret);
+    std::ostream out(&buffer);
+    write(m, out);
+    return ret;
+}
+
 //------------------------------------------------------------------------------
-std::vector<uint8_t> JsonSerializer::serialize(const Dense &) {
+std::vector<uint8_t> MatrixSerializer::serialize(const Sparse &m) {
     std::vector<uint8_t> ret;
+    VectorBuffer buffer(ret);
+    std::ostream out(&buffer);
+    write(m, out);
     return ret;
 }
 
 //------------------------------------------------------------------------------
-std::vector<uint8_t> JsonSerializer::serialize(const Sparse &inputmatrix) {
-    json matrix, column;
-    sparse_matrix_iterate(inputmatrix,
-                          [&](Sparse::InnerIterator it) {
-                              json line;
-                              line[std::to_string(it.row())] = it.value();
-                              column.emplace_back(line);
-                          },
-                          [&](int c) {
-                              if (!column.empty()) {
-                                  matrix[std::to_string(c)] = column;
-                                  column.clear();
-                              }
-                          });
-    std::string m = matrix.dump();
-    return std::vector<uint8_t>(m.begin(), m.end());
+Dense MatrixSerializer::deserialize_dense(ByteView data) {
+    ViewBuffer buffer(data);
+    std::istream in(&buffer);
+    return read_dense(in);
+}
+
+//------------------------------------------------------------------------------
+Sparse MatrixSerializer::deserialize_sparse(ByteView data) {
+    ViewBuffer buffer(data);
+    std::istream in(&buffer);
+    return read_sparse(in);
+}
+
+//------------------------------------------------------------------------------
+// JsonSerializer
+//------------------------------------------------------------------------------
+// Tokens of the documents the writers produce, taken off the stream one at a
+// time
+//------------------------------------------------------------------------------
+class JsonReader {
+   public:
+    explicit JsonReader(std::istream &in) : in_(in) {}
+
+    bool next(char c) {
+        in_ >> std::ws;
+        if (in_.peek() != c) return false;
+        in_.get();
+        return true;
+    }
+    void expect(char c) {
+        if (!next(c)) malformed("json", "unexpected character");
+    }
+    std::string string() {
+        expect('"');
+        std::string ret;
+        for (int c; (c = in_.get()) != '"';) {
+            if (c == '\\') c = in_.get();
+            if (c == std::char_traits<char>::eof()) {
+                malformed("json", "unterminated string");
+            }
+            ret.push_back(char(c));
+        }
+        return ret;
+    }
+    void key(const char *name) {
+        if (string() != name) malformed("json", name);
+        expect(':');
+    }
+    double number() {
+        in_ >> std::ws;
+        if (in_.peek() == 'n') {  // non-finite values go out as null
+            char null[4];
+            if (!in_.read(null, 4) || memcmp(null, "null", 4) != 0) {
+                malformed("json", "bad value");
+            }
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+        double ret;
+        if (!(in_ >> ret)) malformed("json", "bad value");
+        return ret;
+    }
+    int index(const char *name) {  // the value of a size
+        key(name);
+        long long ret;
+        if (!(in_ >> ret)) malformed("json", "bad index");
+        return index(ret);
+    }
+    int index_key() {  // a row or column
+        std::string s = string();
+        char *end;
+        long long ret = strtoll(s.c_str(), &end, 10);
+        if (s.empty() || *end) malformed("json", "bad index");
+        return index(ret);
+    }
+
+   private:
+    static int index(long long v) {
+        if (v < 0 || v > std::numeric_limits<int>::max()) {
+            malformed("json", "index out of range");
+        }
+        return int(v);
+    }
+
+    std::istream &in_;
+};
+
+//------------------------------------------------------------------------------
+static void json_number(double v, std::ostream &out) {
+    if (std::isfinite(v)) {
+        out << v;
+    } else {
+        out << "null";
+    }
+}
+
+//------------------------------------------------------------------------------
+// Saves and restores the precision of the stream it writes to
+//------------------------------------------------------------------------------
+class FullPrecision {
+   public:
+    explicit FullPrecision(std::ostream &out)
+        : out_(out),
+          saved_(out.precision(std::numeric_limits<double>::max_digits10)) {}
+    ~FullPrecision() { out_.precision(saved_); }
+
+   private:
+    std::ostream &out_;
+    std::streamsize saved_;
+};
+
+//------------------------------------------------------------------------------
+void JsonSerializer::write(const Dense &m, std::ostream &out) {
+    FullPrecision precision(out);
+    out << "{\"matrix\":\"dense\",\"rows\":" << m.rows()
+        << ",\"cols\":" << m.cols() << ",\"columns\":[";
+    for (Eigen::Index c = 0; c < m.cols(); ++c) {
+        out << (c ? ",[" : "[");
+        for (Eigen::Index r = 0; r < m.rows(); ++r) {
+            if (r) out << ',';
+            json_number(m(r, c), out);
+        }
+        out << ']';
+    }
+    out << "]}";
 }
 
 //------------------------------------------------------------------------------
-Dense JsonSerializer::deserialize_dense(const std::vector<uint8_t> &) {
-    Dense ret;
+void JsonSerializer::write(const Sparse &m, std::ostream &out) {
+    FullPrecision precision(out);
+    out << "{\"matrix\":\"sparse\",\"rows\":" << m.rows()
+        << ",\"cols\":" << m.cols() << ",\"nnz\":" << m.nonZeros()
+        << ",\"columns\":{";
+    bool first = true;
+    for (int c = 0; c < m.outerSize(); ++c) {
+        Sparse::InnerIterator it(m, c);
+        if (!it) continue;
+        out << (first ? "\"" : ",\"") << c << "\":[";
+        first = false;
+        for (bool entry = false; it; ++it, entry = true) {
+            out << (entry ? ",{\"" : "{\"") << it.row() << "\":";
+            json_number(it.value(), out);
+            out << '}';
+        }
+        out << ']';
+    }
+    out << "}}";
+}
+
+//------------------------------------------------------------------------------
+Dense JsonSerializer::read_dense(std::istream &in) {
+    JsonReader json(in);
+    json.expect('{');
+    json.key("matrix");
+    if (json.string() != "dense") malformed("json", "not dense");
+    json.expect(',');
+    int rows = json.index("rows");
+    json.expect(',');
+    int cols = json.index("cols");
+    json.expect(',');
+    json.key("columns");
+
+    Dense ret(rows, cols);
+    json.expect('[');
+    for (int c = 0; c < cols; ++c) {
+        if (c) json.expect(',');
+        json.expect('[');
+        for (int r = 0; r < rows; ++r) {
+            if (r) json.expect(',');
+            ret(r, c) = json.number();
+        }
+        json.expect(']');
+    }
+    json.expect(']');
+    json.expect('}');
     return ret;
 }
 
 //------------------------------------------------------------------------------
-Sparse JsonSerializer::deserialize_sparse(const std::vector<uint8_t> &) {
-    Sparse ret;
+// Entries go straight into the compressed storage, sized from the header
+//------------------------------------------------------------------------------
+Sparse JsonSerializer::read_sparse(std::istream &in) {
+    JsonReader json(in);
+    json.expect('{');
+    json.key("matrix");
+    if (json.string() != "sparse") malformed("json", "not sparse");
+    json.expect(',');
+    int rows = json.index("rows");
+    json.expect(',');
+    int cols = json.index("cols");
+    json.expect(',');
+    int nnz = json.index("nnz");
+    json.expect(',');
+    json.key("columns");
+
+    Sparse ret(rows, cols);
+    ret.resizeNonZeros(nnz);
+    int *outer = ret.outerIndexPtr(), *inner = ret.innerIndexPtr();
+    double *values = ret.valuePtr();
+    int next = 0, pos = 0;
+    json.expect('{');
+    if (!json.next('}')) {
+        do {
+            int c = json.index_key();
+            if (c < next || c >= cols) malformed("json", "column out of order");
+            for (; next <= c; ++next) outer[next] = pos;
+            json.expect(':');
+            json.expect('[');
+            int last = -1;
+            do {
+                json.expect('{');
+                int r = json.index_key();
+                if (r <= last || r >= rows || pos == nnz) {
+                    malformed("json", "row out of order");
+                }
+                json.expect(':');
+                inner[pos] = last = r;
+                values[pos++] = json.number();
+                json.expect('}');
+            } while (json.next(','));
+            json.expect(']');
+        } while (json.next(','));
+        json.expect('}');
+    }
+    json.expect('}');
+    if (pos != nnz) malformed("json", "nnz mismatch");
+    for (; next <= cols; ++next) outer[next] = pos;
     return ret;
 }
 
 //------------------------------------------------------------------------------
 // BinarySerializer
 //------------------------------------------------------------------------------
-std::vector<uint8_t> BinarySerializer::serialize(const Dense &) {
-    std::vector<uint8_t> ret;
-    return ret;
+struct BinaryHeader {
+    char magic[4];
+    uint8_t kind, scalar;
+    uint16_t reserved;
+    uint64_t rows, cols, nnz;
+};
+static const char kMagic[4] = {'R', 'X', 'M', 'T'};
+static const uint8_t kDense = 'D', kSparse = 'S';
+static_assert(sizeof(Sparse::StorageIndex) == sizeof(int32_t),
+              "sparse indices are written as 32 bits");
+
+//------------------------------------------------------------------------------
+static void write_header(uint8_t kind, uint64_t rows, uint64_t cols,
+                         uint64_t nnz, std::ostream &out) {
+    BinaryHeader header;
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.kind = kind;
+    header.scalar = sizeof(double);
+    header.reserved = 0;
+    header.rows = rows;
+    header.cols = cols;
+    header.nnz = nnz;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+//------------------------------------------------------------------------------
+static BinaryHeader read_header(uint8_t kind, std::istream &in) {
+    BinaryHeader header;
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.scalar != sizeof(double)) {
+        malformed("binary", "bad header");
+    }
+    if (header.kind != kind) {
+        malformed("binary", kind == kDense ? "not dense" : "not sparse");
+    }
+    uint64_t max = std::numeric_limits<int>::max();
+    if (header.rows > max || header.cols > max || header.nnz > max ||
+        (kind == kSparse && header.rows &&
+         header.nnz / header.rows > header.cols)) {
+        malformed("binary", "size out of range");
+    }
+    return header;
+}
+
+//------------------------------------------------------------------------------
+template <typename T>
+static void read_all(std::istream &in, T *data, size_t n) {
+    if (!in.read(reinterpret_cast<char *>(data), n * sizeof(T))) {
+        malformed("binary", "truncated");
+    }
 }
 
 //------------------------------------------------------------------------------
-std::vector<uint8_t> BinarySerializer::serialize(const Sparse &m) {
-    return triplets_to_raw(matrix_to_triplets(m));
+void BinarySerializer::write(const Dense &m, std::ostream &out) {
+    write_header(kDense, m.rows(), m.cols(), m.size(), out);
+    for (Eigen::Index c = 0; c < m.cols(); ++c) {
+        out.write(reinterpret_cast<const char *>(m.col(c).data()),
+                  m.rows() * sizeof(double));
+    }
 }
 
 //------------------------------------------------------------------------------
-Dense BinarySerializer::deserialize_dense(const std::vector<uint8_t> &) {
-    Dense ret;
+// Reads the storage in place, compressed or not
+//------------------------------------------------------------------------------
+void BinarySerializer::write(const Sparse &m, std::ostream &out) {
+    write_header(kSparse, m.rows(), m.cols(), m.nonZeros(), out);
+    const int *outer = m.outerIndexPtr(), *counts = m.innerNonZeroPtr();
+    for (int c = 0; c < m.outerSize(); ++c) {
+        int32_t count = counts ? counts[c] : outer[c + 1] - outer[c];
+        out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        out.write(reinterpret_cast<const char *>(m.innerIndexPtr() + outer[c]),
+                  count * sizeof(int32_t));
+        out.write(reinterpret_cast<const char *>(m.valuePtr() + outer[c]),
+                  count * sizeof(double));
+    }
+}
+
+//------------------------------------------------------------------------------
+Dense BinarySerializer::read_dense(std::istream &in) {
+    BinaryHeader header = read_header(kDense, in);
+    if (header.nnz != header.rows * header.cols) {
+        malformed("binary", "size mismatch");
+    }
+    Dense ret(header.rows, header.cols);
+    read_all(in, ret.data(), ret.size());
     return ret;
 }
 
 //------------------------------------------------------------------------------
-Sparse BinarySerializer::deserialize_sparse(const std::vector<uint8_t> &v) {
-    return ::deserialize_sparse<Sparse>(v);
+Sparse BinarySerializer::read_sparse(std::istream &in) {
+    BinaryHeader header = read_header(kSparse, in);
+    int cols = header.cols, nnz = header.nnz;
+    Sparse ret(header.rows, cols);
+    ret.resizeNonZeros(nnz);
+    int *outer = ret.outerIndexPtr(), *inner = ret.innerIndexPtr();
+    int pos = 0;
+    for (int c = 0; c < cols; ++c) {
+        int32_t count;
+        read_all(in, &count, 1);
+        if (count < 0 || count > nnz - pos) malformed("binary", "nnz mismatch");
+        outer[c] = pos;
+        read_all(in, inner + pos, count);
+        read_all(in, ret.valuePtr() + pos, count);
+        for (int i = pos; i < pos + count; ++i) {
+            if (inner[i] < 0 || inner[i] >= ret.rows() ||
+                (i > pos && inner[i] <= inner[i - 1])) {
+                malformed("binary", "row out of order");
+            }
+        }
+        pos += count;
+    }
+    if (pos != nnz) malformed("binary", "nnz mismatch");
+    outer[cols] = pos;
+    return ret;
 }
+
 //------------------------------------------------------------------------------
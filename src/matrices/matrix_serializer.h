@@ -1,37 +1,58 @@
 #pragma once
 
+#include <istream>
+#include <ostream>
 #include <vector>
+#include <utils/byte_view.h>
 #include "matrices_common.h"
 
+//------------------------------------------------------------------------------
+// Matrices go out and come back column by column: writers read the matrix in
+// place, readers fill the result as they parse. Neither builds a copy of the
+// whole matrix (triplets, document tree) on the way. Every output starts with
+// a header saying whether it holds a dense or a sparse matrix and its sizes.
+// Readers abort on malformed input.
+//------------------------------------------------------------------------------
 class MatrixSerializer {
    public:
-    virtual std::vector<uint8_t> serialize(const Dense &) = 0;
-    virtual std::vector<uint8_t> serialize(const Sparse &) = 0;
-    virtual Dense deserialize_dense(const std::vector<uint8_t>&) = 0;
-    virtual Sparse deserialize_sparse(const std::vector<uint8_t>&) = 0;
+    virtual ~MatrixSerializer() {}
+    virtual void write(const Dense &, std::ostream &) = 0;
+    virtual void write(const Sparse &, std::ostream &) = 0;
+    virtual Dense read_dense(std::istream &) = 0;
+    virtual Sparse read_sparse(std::istream &) = 0;
+
+    // Whole buffers, through the streams above
+    std::vector<uint8_t> serialize(const Dense &);
+    std::vector<uint8_t> serialize(const Sparse &);
+    Dense deserialize_dense(ByteView);
+    Sparse deserialize_sparse(ByteView);
 };
 
+//------------------------------------------------------------------------------
+// {"matrix":"dense","rows":R,"cols":C,"columns":[[v,...],...]}
+// {"matrix":"sparse","rows":R,"cols":C,"nnz":N,
+//  "columns":{"c":[{"r":v},...],...}}, empty columns left out
+// The reader takes keys in the order above and columns in increasing order.
+//------------------------------------------------------------------------------
 class JsonSerializer : public MatrixSerializer {
    public:
-    virtual std::vector<uint8_t> serialize(const Dense &);
-    virtual std::vector<uint8_t> serialize(const Sparse &);
-    virtual Dense deserialize_dense(const std::vector<uint8_t>&);
-    virtual Sparse deserialize_sparse(const std::vector<uint8_t>&);
+    virtual void write(const Dense &, std::ostream &);
+    virtual void write(const Sparse &, std::ostream &);
+    virtual Dense read_dense(std::istream &);
+    virtual Sparse read_sparse(std::istream &);
 };
 
+//------------------------------------------------------------------------------
+// Header (magic, kind, scalar size, rows, cols, nnz), then dense columns as
+// they lie in memory, or per sparse column its nnz, row indices, then values.
+// Native byte order.
+//------------------------------------------------------------------------------
 class BinarySerializer : public MatrixSerializer {
-    virtual std::vector<uint8_t> serialize(const Dense &);
-    virtual std::vector<uint8_t> serialize(const Sparse &);
-    virtual Dense deserialize_dense(const std::vector<uint8_t>&);
-    virtual Sparse deserialize_sparse(const std::vector<uint8_t>&);
+   public:
+    virtual void write(const Dense &, std::ostream &);
+    virtual void write(const Sparse &, std::ostream &);
+    virtual Dense read_dense(std::istream &);
+    virtual Sparse read_sparse(std::istream &);
 };
 
 //------------------------------------------------------------------------------
-template <typename SparseMatrix>
-SparseMatrix deserialize_sparse(const std::vector<uint8_t> &v) {
-    typedef typename SparseMatrix::Scalar ValueType;
-    TripletVector<ValueType> tv = raw_to_triplets<ValueType>(v);
-    return matrix_from_data<ValueType>(tv.begin(), tv.end());
-}
-
-//------------------------------------------------------------------------------
@@ -0,0 +1,91 @@
+#include "async_merger.h"
+
+//------------------------------------------------------------------------------
+// AsyncGossipMerger
+//------------------------------------------------------------------------------
+AsyncGossipMerger::AsyncGossipMerger(
+    unsigned rank, unsigned share_howmany, Communication *c,
+    std::shared_ptr<MFSGDDecentralized> trainer, std::set<unsigned> &neighbours,
+    bool modelshare, bool datashare, unsigned staleness, double mixing)
+    : ModelMerger(rank, share_howmany, c, trainer, neighbours, modelshare,
+                  datashare),
+      staleness_(staleness),
+      mixing_(mixing) {}
+
+//------------------------------------------------------------------------------
+size_t AsyncGossipMerger::share(int epoch) {
+    SharingRatings rawdata;
+    if (datashare_) {
+        rawdata = extract_ratings(share_howmany_);
+    }
+    // Every neighbour gets it: it also advances their clock of us
+    ShareableModelPtr toshare;
+    size_t ret = 0;
+    for (const auto &peer : neighbours_) {
+        if (!toshare || partial_sharing()) {
+            toshare = std::make_shared<ShareableModel>(
+                epoch, ASYNC, model_toshare(peer), rawdata);
+        }
+        ret += communication_->send(userrank_, peer, toshare);
+    }
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+void AsyncGossipMerger::receive(unsigned src,
+                                std::shared_ptr<ShareableModel> m) {
+    if (!flow_control(m->type_)) {
+        std::unique_lock<std::mutex> lock(recv_mtx_);
+        auto it = clock_.find(src);
+        if (it == clock_.end() || it->second < m->epoch) {
+            clock_[src] = m->epoch;
+        }
+    }
+    ModelMerger::receive(src, m);
+}
+
+//------------------------------------------------------------------------------
+// Stale synchronous parallel: epoch + 1 may start unless some neighbour is
+// still more than staleness_ epochs behind. staleness_ = 0 is a full barrier.
+// Every neighbour counts, as many as the caller expects models from or not.
+//------------------------------------------------------------------------------
+bool AsyncGossipMerger::ready(int epoch, size_t) {
+    std::unique_lock<std::mutex> lock(recv_mtx_);
+    for (const auto &n : neighbours_) {
+        auto it = clock_.find(n);
+        int heard = it == clock_.end() ? -1 : it->second;
+        if (heard + int(staleness_) < epoch) return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+double AsyncGossipMerger::age_weight(int age) const {
+    return mixing_ / (1 + std::max(age, 0));
+}
+
+//------------------------------------------------------------------------------
+void AsyncGossipMerger::merge(int epoch) {
+    std::unique_lock<std::mutex> lock(recv_mtx_);
+
+    size_t count = 0;
+    for (auto &kv : received_models_) {  // ascending epochs: freshest last
+        int age = epoch - kv.first;
+        for (auto &model : kv.second) {
+            unsigned src = model.first;
+            ShareableModelPtr shared = model.second;
+            if (age <= int(staleness_)) {
+                if (modelshare_ && shared->model_.rank() >= 0) {
+                    trainer_->mutable_model().merge_average(shared->model_,
+                                                            age_weight(age));
+                }
+                count += trainer_->add_raw_ratings(shared->rawdata);
+            }  // else too old: dropped
+            recvdfrom_.erase(std::make_pair(src, shared->epoch));
+        }
+    }
+
+    received_models_.clear();
+}
+
+//------------------------------------------------------------------------------
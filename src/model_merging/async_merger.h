@@ -0,0 +1,31 @@
+#pragma once
+
+#include <machine_learning/mf_node.h>
+
+//------------------------------------------------------------------------------
+// Barrier-free gossip: a node moves on as long as it is at most `staleness`
+// epochs ahead of its slowest neighbour, and merges whatever has arrived,
+// weighting each received model by how old it is.
+//------------------------------------------------------------------------------
+class AsyncGossipMerger : public ModelMerger {
+   public:
+    AsyncGossipMerger(unsigned rank, unsigned share_howmany, Communication *c,
+                      std::shared_ptr<MFSGDDecentralized> trainer,
+                      std::set<unsigned> &neighbours, bool modelshare,
+                      bool datashare, unsigned staleness,
+                      double mixing = .5);
+
+    virtual size_t share(int epoch);
+    virtual void merge(int epoch);
+    virtual void receive(unsigned src, std::shared_ptr<ShareableModel> m);
+    virtual bool ready(int epoch, size_t howmany);
+
+   private:
+    double age_weight(int age) const;
+
+    std::map<unsigned, int> clock_;  // latest epoch heard from each neighbour
+    unsigned staleness_;
+    double mixing_;
+};
+
+//------------------------------------------------------------------------------
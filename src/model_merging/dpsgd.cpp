@@ -19,12 +19,13 @@ size_t DPSGDMerger::share(int epoch) {
         rawdata = extract_ratings(share_howmany_);
     }
 
-    DPSGDModelPtr toshare = std::make_shared<DPSGDShareableModel>(
-        epoch, modelshare_? trainer_->model(): MatrixFactorizationModel(-2), // -2 for no model sharing
-        rawdata, neighbours_.size());
-
+    DPSGDModelPtr toshare;
     size_t ret = 0;
     for (auto &peer : neighbours_) {
+        if (!toshare || partial_sharing()) {  // partial: one sample per peer
+            toshare = std::make_shared<DPSGDShareableModel>(
+                epoch, model_toshare(peer), rawdata, neighbours_.size());
+        }
         ret += communication_->send(userrank_, peer, toshare);
     }
     return ret;
@@ -79,15 +80,14 @@ DPSGDShareableModel::DPSGDShareableModel(int e,
     // call not needed now, training occurs at original place
 }
 //------------------------------------------------------------------------------
-std::vector<uint8_t> DPSGDShareableModel::serialize() const {
-    std::vector<uint8_t> ret(ShareableModel::serialize());
+void DPSGDShareableModel::serialize_append(std::vector<uint8_t> &out) const {
+    ShareableModel::serialize_append(out);
     const uint8_t *dptr = reinterpret_cast<const uint8_t *>(&degree_);
-    ret.insert(ret.end(), dptr, dptr + sizeof(degree_));
-    return ret;
+    out.insert(out.end(), dptr, dptr + sizeof(degree_));
 }
 
 //------------------------------------------------------------------------------
-size_t DPSGDShareableModel::deserialize(const std::vector<uint8_t> &data) {
+size_t DPSGDShareableModel::deserialize(ByteView data) {
     size_t offset = ShareableModel::deserialize(data);
     assert(offset < data.size() && data.size() - offset >= size_t(degree_));
     memcpy(&degree_, &data[offset], sizeof(degree_));
@@ -96,3 +96,9 @@ size_t DPSGDShareableModel::deserialize(const std::vector<uint8_t> &data) {
 }
 
 //------------------------------------------------------------------------------
+std::shared_ptr<ShareableModel> DPSGDShareableModel::with_model(
+    const MatrixFactorizationModel &m) const {
+    return std::make_shared<DPSGDShareableModel>(epoch, m, rawdata, degree_);
+}
+
+//------------------------------------------------------------------------------
@@ -12,8 +12,10 @@ class DPSGDShareableModel : public ShareableModel {
     DPSGDShareableModel(int e, const MatrixFactorizationModel &m,
                         SharingRatings, size_t degree);
 
-    virtual std::vector<uint8_t> serialize() const;
-    virtual size_t deserialize(const std::vector<uint8_t> &data);
+    virtual void serialize_append(std::vector<uint8_t> &out) const;
+    virtual size_t deserialize(ByteView data);
+    virtual std::shared_ptr<ShareableModel> with_model(
+        const MatrixFactorizationModel &m) const;
     size_t degree_;
 };
 
@@ -16,27 +16,23 @@ size_t RandomModelWalkMerger::share(int epoch) {
     if (datashare_) {
         rawdata = extract_ratings(share_howmany_);
     }
+    // Choose a random neighbor to send
+    unsigned peer = rand() % neighbours_.size();
+    unsigned dst = *std::next(neighbours_.begin(), peer);
     ShareableModelPtr toshare = std::make_shared<ShareableModel>(
-                          epoch, RMW,
-                          modelshare_ ? trainer_->model()
-                                      : MatrixFactorizationModel(
-                                            -2),  //-2 when no model sharing
-                          rawdata),
+                          epoch, RMW, model_toshare(dst), rawdata),
                       dummy = std::make_shared<ShareableModel>(
                           epoch, RMW,
                           MatrixFactorizationModel(-1),  // -1 for dummy
                           SharingRatings());
 
-    // Choose a random neighbor to send
-    unsigned peer = rand() % neighbours_.size(), i = 0;
     size_t ret = 0;
     for (const auto &n : neighbours_) {
-        if (i == peer) {
+        if (n == dst) {
             ret += communication_->send(userrank_, n, toshare);
         } else {
             ret += communication_->send(userrank_, n, dummy);
         }
-        ++i;
     }
 
     return ret;
@@ -4,8 +4,12 @@
 #include <sgx_qv_errlist.h>
 #include "sgx_dcap_quoteverify.h"
 #endif
+#include <communication/netstats.h>
+#include <communication/outbound_ring.h>
 #include <communication/sync_zmq.h>
 #include <stdio.h>
+#include <atomic>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <mutex>
@@ -34,12 +38,37 @@ void uprint(const char *str) {
 }
 //------------------------------------------------------------------------------
 ssize_t ocall_send(const char *id, const void *buffer, size_t length) {
-    return CommunicationZmq::send(id, buffer, length);
+    return CommunicationManager::send(id, buffer, length);
 }
 
+//------------------------------------------------------------------------------
+int ocall_outbox_wakeup() { return OutboundDrain::wakeup(); }
+
+//------------------------------------------------------------------------------
+int ocall_outbox_wait(uint64_t consumed) {
+    return OutboundDrain::wait(consumed);
+}
+
+//------------------------------------------------------------------------------
+void ocall_peer_traffic(const char *peer, struct PeerTraffic *traffic) {
+    *traffic = NetStats::peer(peer);
+}
+
+//------------------------------------------------------------------------------
+// The process leaves with the last node it hosts
 //------------------------------------------------------------------------------
 extern void ctrlc_handler(int s);
-void ocall_farewell() { ctrlc_handler(0); }
+std::atomic<unsigned> running_nodes(1);
+void ocall_farewell() {
+    if (--running_nodes == 0) ctrlc_handler(0);
+}
+
+#ifdef NATIVE
+//------------------------------------------------------------------------------
+void ocall_post(const std::string &key, std::function<void()> task) {
+    CommunicationZmq::post(key, task);
+}
+#endif
 
 //------------------------------------------------------------------------------
 #ifndef NATIVE
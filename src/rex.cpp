@@ -4,17 +4,25 @@
 #include <data_splitter.h>
 #include <enclave_interface.h>
 #include <generic_utils.h>
+#include <netstats.h>
+#include <outbound_ring.h>
 #include <pwd.h>
 #include <stringtools.h>
+#include <shm_transport.h>
 #include <sync_zmq.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <utils/compression.h>
+#include <atomic>
 #include <csignal>
 #include <iostream>
 #include <set>
 #include <thread>
+#include <vector>
 
 #define DEFAULT_PORT 4444
+#define SHM_RING_BYTES (4 << 20)  // per neighbour
 #define quote(s) #s
 #define quotevalue(m) quote(m)
 
@@ -33,7 +41,45 @@ static struct argp_option options[] = {
     {"steps_per_iteration", 'u', "steps", 0,
      "Number of local steps in each iteration or epoch."},
     {"local", 'l', "number", 0, "Local iterations. Default: 1."},
+    {"partial", 'g', "fraction", 0,
+     "Fraction of the embeddings sent to each neighbour per epoch, sampled "
+     "at random. Default: 1."},
     {"dpsgd", 'd', 0, 0, "Switch to DPSGD. Default: RMW."},
+    {"async", 'a', "staleness", 0,
+     "Switch to barrier-free gossip. Nodes may run at most 'staleness' "
+     "epochs ahead of their slowest neighbour."},
+    {"pipelined", 'i', 0, 0,
+     "Send and test each epoch in the background while the next one trains."},
+    {"budget", 'b', "MB", 0,
+     "Memory for models buffered from neighbours, fractions too. Past it they "
+     "are kept compressed and senders running ahead are throttled. Default: "
+     "unlimited."},
+    {"bandwidth", 'w', "KB", 0,
+     "Model bytes sent to each neighbour per epoch. Only the embeddings that "
+     "changed the most since last sent fit: not with -g. Default: the whole "
+     "model."},
+    {"compress", 'z', "codec", 0,
+     "Compress messages before sending (and encrypting) them: none, fast, "
+     "high or auto (by size). Default: none."},
+    {"delta", 't', 0, 0,
+     "Send each neighbour only what changed since the last model it "
+     "acknowledged."},
+    {"quantize", 'q', "bits", 0,
+     "Send embeddings with 8 or 16 bits per value instead of 64. What is lost "
+     "is added back the next time they are sent. Default: 64."},
+    {"input_threads", 'n', "howmany", 0,
+     "Threads handling received messages, in order for each sender. 0: the "
+     "network thread. At most 9 with SGX. Default: 4."},
+    {"chunk", 'k', "KB", 0,
+     "Send larger models in chunks of this size, each encrypted on its own: "
+     "receivers decrypt one while the next is on the way. Default: 0, whole "
+     "models."},
+    {"max_message", 'M', "MB", 0,
+     "Largest chunked model accepted from a neighbour. Larger ones are "
+     "dropped before any memory is reserved for them. Default: 256."},
+    {"outbox", 'o', "MB", 0,
+     "Ring the enclave queues outgoing messages in, sent on by a thread "
+     "outside. 0: an ocall per message. Default: 16."},
     {"port", 'p', "port", 0, "Listening port"},
     {"machines", 'm', "\"host1 host2:port2 [...]\"", 0,
      "List of machines in host:port format, separated by space and enclosed by "
@@ -43,26 +89,73 @@ static struct argp_option options[] = {
     {"epochs", 'e', "howmany", 0, "Number of epochs. Deafult 10."},
     {"usersdata", 'c', "howmany", 0,
      "Cap the amount of users in the input file. Default: unlimited."},
+    {"checkpoint", 'C', "directory", 0,
+     "Save the model to directory after every epoch. rex_native only: models "
+     "do not leave enclaves."},
+    {"colocate", 'j', 0, 0,
+     "Run all machines of this host in this process, each on its own port. "
+     "Models between them are handed over in memory. rex_native only."},
+    {"transport", 'T', "name", 0,
+     "How nodes reach each other: zmq, over TCP, or shm, through shared "
+     "memory rings when all machines are this host. Default: zmq."},
+    {"netstats", 'S', "seconds", 0,
+     "Print the traffic and latency of each peer on stderr every this many "
+     "seconds. Default: 0, only in each node's final summary."},
+    {"restore", 'R', "directory", 0,
+     "Start from the model saved in directory, at the epoch after its own. "
+     "rex_native only."},
     {0}};
 
 //------------------------------------------------------------------------------
 struct Arguments {
     Arguments()
         : port(DEFAULT_PORT),
-          modelshare(true),
           datashare(false),
+          modelshare(true),
           dpsgd(false),
+          asyncgossip(false),
+          pipelined(false),
+          delta(false),
+          colocate(false),
+          shared_memory(false),
           share_howmany(20),
           local(1),
+          epochs(10),
+          staleness(0),
+          quantize(64),
+          input_threads(4),
+          netstats_period(0),
           steps_per_iteration(30),
-          epochs(10) {}
+          budget(0),
+          bandwidth(0),
+          outbox(16 << 20),
+          chunk(0),
+          max_message(256 << 20),
+          share_fraction(1.),
+          compression(Compression::NONE) {}
     uint16_t port;
-    bool datashare, modelshare, dpsgd;
-    std::string machines, input_fname;
-    unsigned share_howmany, local, epochs;
-    size_t steps_per_iteration, capusers;
+    bool datashare, modelshare, dpsgd, asyncgossip, pipelined, delta;
+    bool colocate, shared_memory;
+    std::string machines, input_fname, checkpoint_dir, restore_dir;
+    unsigned share_howmany, local, epochs, staleness, quantize, input_threads,
+        netstats_period;
+    size_t steps_per_iteration, capusers, budget, bandwidth, outbox, chunk,
+        max_message;
+    double share_fraction;
+    Compression::Codec compression;
 };
 
+//------------------------------------------------------------------------------
+// The working directory changes to the binary's before the node starts
+//------------------------------------------------------------------------------
+static std::string absolute_path(const std::string &path) {
+    if (path.empty() || path[0] == '/') return path;
+    char *cwd = getcwd(nullptr, 0);
+    std::string ret = std::string(cwd) + "/" + path;
+    free(cwd);
+    return ret;
+}
+
 //------------------------------------------------------------------------------
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     Arguments *args = (Arguments *)state->input;
@@ -88,6 +181,13 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 'd':
             args->dpsgd = true;
             break;
+        case 'a':
+            args->asyncgossip = true;
+            args->staleness = std::stoi(arg);
+            break;
+        case 'i':
+            args->pipelined = true;
+            break;
         case 'p':
             args->port = std::stoi(arg);
             break;
@@ -100,6 +200,78 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 'm':
             args->machines = arg;
             break;
+        case 'g':
+            args->share_fraction = std::stod(arg);
+            break;
+        case 'b': {
+            char *end;
+            double mb = strtod(arg, &end);
+            args->budget = size_t(mb * (1 << 20));
+            if (end == arg || *end || mb < 0 || (mb > 0 && !args->budget)) {
+                argp_error(state, "budget is a number of MB, 0: unlimited");
+            }
+            break;
+        }
+        case 'w':
+            args->bandwidth = std::stoul(arg) << 10;
+            break;
+        case 't':
+            args->delta = true;
+            break;
+        case 'z':
+            args->compression = Compression::parse(arg);
+            break;
+        case 'q':
+            args->quantize = std::stoi(arg);
+            break;
+        case 'o':
+            args->outbox = std::stoul(arg) << 20;
+            break;
+        case 'k':
+            args->chunk = std::stoul(arg) << 10;
+            break;
+        case 'M':
+            args->max_message = std::stoul(arg) << 20;
+            if (args->max_message == 0) argp_error(state, "no message fits");
+            break;
+        case 'n':
+            args->input_threads = std::stoi(arg);
+#ifndef NATIVE
+            if (args->input_threads > 9) {  // TCSNum 10: ecalls at once
+                argp_error(state, "at most 9 input threads with SGX");
+            }
+#endif
+            break;
+        case 'j':
+#ifdef NATIVE
+            args->colocate = true;
+#else
+            argp_error(state, "colocated nodes need rex_native");
+#endif
+            break;
+        case 'T':
+            if (std::string(arg) != "zmq" && std::string(arg) != "shm") {
+                argp_error(state, "transport is zmq or shm");
+            }
+            args->shared_memory = std::string(arg) == "shm";
+            break;
+        case 'S':
+            args->netstats_period = std::stoi(arg);
+            break;
+        case 'C':
+        case 'R':
+#ifdef NATIVE
+            (key == 'C' ? args->checkpoint_dir : args->restore_dir) =
+                absolute_path(arg);
+#else
+            argp_error(state, "checkpoints need rex_native");
+#endif
+            break;
+        case ARGP_KEY_END:
+            if (args->bandwidth && args->share_fraction != 1) {
+                argp_error(state, "-w and -g both choose what is shared: use one");
+            }
+            break;
         default:
             return ARGP_ERR_UNKNOWN;
     };
@@ -119,12 +291,15 @@ int farewell_message(int s) {
 }
 
 //------------------------------------------------------------------------------
+extern std::atomic<unsigned> running_nodes;
 std::thread *headsman_thread = nullptr;
 void ctrlc_handler(int s) {
     if (headsman_thread == nullptr) {
         EnclaveInterface::finish();
-        headsman_thread = new std::thread(
-            []() { CommunicationManager<CommunicationZmq>::finish(); });
+        headsman_thread = new std::thread([]() {
+            OutboundDrain::finish();
+            CommunicationManager::finish();
+        });
     }
 }
 
@@ -168,6 +343,29 @@ std::pair<int, size_t> find_userrank_and_neigh(
     return std::make_pair(myindex, hosts.size());
 }
 
+//------------------------------------------------------------------------------
+// Endpoints of machines on this host, all of them run here with -j
+//------------------------------------------------------------------------------
+std::set<std::pair<std::string, uint16_t>> hosted_nodes(
+    const std::string &machines) {
+    char hostname[HOST_NAME_MAX];
+    gethostname(hostname, HOST_NAME_MAX);
+
+    std::set<std::pair<std::string, uint16_t>> ret;
+    for (const auto &h : split(machines, " ")) {
+        auto hostport = split(h, ":");
+        if (hostport[0] != hostname) continue;
+        try {
+            ret.emplace(hostport[0], hostport.size() == 1
+                                         ? DEFAULT_PORT
+                                         : std::stoi(hostport[1]));
+        } catch (const std::invalid_argument &e) {
+            std::cerr << "Invalid endpoint: " << h << std::endl;
+        }
+    }
+    return ret;
+}
+
 //------------------------------------------------------------------------------
 bool read_data(const std::string &fname, TripletVector<uint8_t> &train,
                TripletVector<uint8_t> &test, int total_nodes, int userrank,
@@ -201,48 +399,125 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    std::set<std::pair<std::string, uint16_t>> neighbors;
-    std::string nlist;
-    auto index_count =
-        find_userrank_and_neigh(args.machines, args.port, neighbors, nlist);
-    for (const auto &n : neighbors) {
-        CommunicationZmq::add_endpoint(n.first, n.second);
+    // Nodes run by this process: one, or all of this host's with -j
+    std::set<std::pair<std::string, uint16_t>> hosted;
+    std::vector<uint16_t> ports(1, args.port);
+    if (args.colocate) {
+        hosted = hosted_nodes(args.machines);
+        if (hosted.empty()) {
+            std::cerr << "No node of this host in " << args.machines << "."
+                      << std::endl;
+            return 2;
+        }
+        if (args.input_threads == 0) {
+            std::cerr << "Colocated nodes need input threads. See option -n."
+                      << std::endl;
+            return 1;
+        }
+        if (args.shared_memory) {
+            std::cerr << "Colocated nodes use zmq to reach other processes."
+                      << std::endl;
+            return 1;
+        }
+        ports.clear();
+        for (const auto &h : hosted) ports.push_back(h.second);
+        args.outbox = 0;  // the ring has a single writer
     }
-
-    struct EnclaveArguments enclave_args;
-    enclave_args.userrank = index_count.first;
-    if (index_count.first < 0) {
-        return 2;
+    running_nodes = ports.size();
+    if (args.shared_memory) {
+        CommunicationManager::use(
+            new ShmTransport(SHM_RING_BYTES, args.input_threads));
+    } else {
+        CommunicationZmq::set_input_threads(args.input_threads);
+        CommunicationManager::use(new ZmqTransport());
     }
 
-    TripletVector<uint8_t> train, test;
-    if (!read_data(fname, train, test, index_count.second,
-                   enclave_args.userrank, args.capusers)) {
-        return 3;
+    if (!args.checkpoint_dir.empty()) {
+        mkdir(args.checkpoint_dir.c_str(), 0755);  // may exist already
     }
-
+    fname = absolute_path(fname);
     change_dir(argv[0]);
 
     // Arguments passed on to the enclave
-    enclave_args.train = reinterpret_cast<uint8_t *>(train.data());
-    enclave_args.train_size = train.size();
-    enclave_args.test = reinterpret_cast<uint8_t *>(test.data());
-    enclave_args.test_size = test.size();
-    enclave_args.degree = neighbors.size();
+    struct EnclaveArguments enclave_args;
     enclave_args.datashare = uint8_t(args.datashare);
     enclave_args.modelshare = uint8_t(args.modelshare);
     enclave_args.dpsgd = uint8_t(args.dpsgd);
+    enclave_args.asyncgossip = uint8_t(args.asyncgossip);
+    enclave_args.staleness = args.staleness;
+    enclave_args.pipelined = uint8_t(args.pipelined);
+    enclave_args.share_fraction = args.share_fraction;
+    enclave_args.recv_budget = args.budget;
+    enclave_args.share_budget = args.bandwidth;
+    enclave_args.quantize = args.quantize;
+    enclave_args.delta = uint8_t(args.delta);
+    enclave_args.compression = args.compression;
     enclave_args.share_howmany = args.share_howmany;
     enclave_args.local = args.local;
     enclave_args.steps_per_iteration = args.steps_per_iteration;
     enclave_args.epochs = args.epochs;
+    enclave_args.outbox =
+        args.outbox ? OutboundDrain::init(args.outbox) : nullptr;
+    enclave_args.outbox_size = args.outbox;
+    enclave_args.chunk_size = args.chunk;
+    enclave_args.max_message = args.max_message;
+    enclave_args.hosted = ports.size();
+    strncpy(enclave_args.checkpoint, args.checkpoint_dir.c_str(),
+            sizeof(enclave_args.checkpoint));
+    strncpy(enclave_args.restore, args.restore_dir.c_str(),
+            sizeof(enclave_args.restore));
+
+    bool ready = true;
+    std::set<std::pair<std::string, uint16_t>> remote;
+    for (unsigned slot = 0; ready && slot < ports.size(); ++slot) {
+        std::set<std::pair<std::string, uint16_t>> neighbors;
+        std::string nlist;
+        auto index_count = find_userrank_and_neigh(args.machines, ports[slot],
+                                                   neighbors, nlist);
+        if (index_count.first < 0) {
+            return 2;
+        }
+        for (const auto &n : neighbors) {
+            if (hosted.find(n) == hosted.end()) remote.insert(n);
+        }
 
-    strncpy(enclave_args.nodes, nlist.c_str(), sizeof(enclave_args.nodes));
-    if (EnclaveInterface::init(enclave_args)) {
-        CommunicationManager<CommunicationZmq>::init(
-            EnclaveInterface::input<std::string>, args.port);
+        TripletVector<uint8_t> train, test;  // copied by the node
+        if (!read_data(fname, train, test, index_count.second,
+                       index_count.first, args.capusers)) {
+            return 3;
+        }
+        enclave_args.userrank = index_count.first;
+        enclave_args.slot = slot;
+        enclave_args.train = reinterpret_cast<uint8_t *>(train.data());
+        enclave_args.train_size = train.size();
+        enclave_args.test = reinterpret_cast<uint8_t *>(test.data());
+        enclave_args.test_size = test.size();
+        enclave_args.degree = neighbors.size();
+        strncpy(enclave_args.nodes, nlist.c_str(), sizeof(enclave_args.nodes));
+        ready = EnclaveInterface::init(enclave_args);
+    }
+    for (const auto &n : remote) {
+        CommunicationManager::add_endpoint(n.first, n.second);
+    }
+
+    if (ready) {
+        CommunicationManager::init(
+            EnclaveInterface::input<std::string>, ports[0]);
+#ifdef NATIVE
+        for (unsigned slot = 1; slot < ports.size(); ++slot) {
+            CommunicationZmq::host(
+                [slot](const std::string &msg) {
+                    return EnclaveInterface::input_slot(slot, msg);
+                },
+                ports[slot]);
+        }
+        if (args.colocate) EnclaveInterface::colocate();
+#endif
+        if (enclave_args.outbox) OutboundDrain::start();
         std::signal(SIGINT, ctrlc_handler);
-        CommunicationManager<CommunicationZmq>::iterate();
+        NetStats::start_dumps(args.netstats_period);
+        CommunicationManager::iterate();
+        NetStats::stop_dumps();
         if (headsman_thread) {
             headsman_thread->join();
         }
@@ -0,0 +1,289 @@
+#include <argp.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+const char *argp_program_version = "Rex local cluster";
+const char *argp_program_bug_address = "<rafael.pires@epfl.ch>";
+
+#define DEFAULTDIR "out"
+#define DEFAULT_PORT 4444
+#define GRACE_SECONDS 5
+#define quote(s) #s
+#define quotevalue(m) quote(m)
+
+static char doc[] =
+    "Rex local cluster: runs rex_native nodes on this host, over loopback, and "
+    "merges what they print. Options after -- go to every node.";
+static char args_doc[] = "[-- rex_native options]";
+static struct argp_option options[] = {
+    {"nodes", 'n', "howmany", 0, "Number of rex_native processes. Default: 4."},
+    {"port", 'p', "port", 0,
+     "Port of the first node, the next ones follow. Default: " quotevalue(
+         DEFAULT_PORT) "."},
+    {"cores", 'k', "howmany", 0,
+     "Cores each node is pinned to, handed out in order. 0: not pinned. "
+     "Default: the available ones, split evenly."},
+    {"binary", 'b', "path", 0,
+     "rex_native to run. Default: the one next to this binary."},
+    {"outdir", 'o', "directory", 0,
+     "Output of each node, and results.csv merging their epochs. Default "
+     "'" DEFAULTDIR "'."},
+    {"timeout", 't', "seconds", 0,
+     "Interrupt the nodes after this long. Default: none."},
+    {0}};
+
+//------------------------------------------------------------------------------
+struct Arguments {
+    Arguments()
+        : nodes(4),
+          port(DEFAULT_PORT),
+          timeout(0),
+          cores(-1),
+          output_dir(DEFAULTDIR) {}
+    unsigned nodes, port, timeout;
+    int cores;  // -1: split evenly
+    std::string binary, output_dir;
+    std::vector<std::string> node_args;
+};
+
+//------------------------------------------------------------------------------
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    Arguments *args = (Arguments *)state->input;
+    switch (key) {
+        case 'n':
+            args->nodes = std::atoi(arg);
+            if (args->nodes == 0) argp_error(state, "at least one node");
+            break;
+        case 'p':
+            args->port = std::atoi(arg);
+            break;
+        case 'k':
+            args->cores = std::atoi(arg);
+            break;
+        case 'b':
+            args->binary = arg;
+            break;
+        case 'o':
+            args->output_dir = arg;
+            break;
+        case 't':
+            args->timeout = std::atoi(arg);
+            break;
+        case ARGP_KEY_ARGS:
+            args->node_args.assign(state->argv + state->next,
+                                   state->argv + state->argc);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    };
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+static std::string default_binary() {
+    char path[PATH_MAX];
+    ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (n <= 0) return "rex_native";
+    path[n] = '\0';
+    return (boost::filesystem::path(path).parent_path() / "rex_native")
+        .string();
+}
+
+//------------------------------------------------------------------------------
+// Node index gets cores [index * per_node, (index + 1) * per_node), wrapping
+// around what this process may use
+//------------------------------------------------------------------------------
+static bool node_cpus(unsigned index, unsigned per_node, cpu_set_t &set) {
+    cpu_set_t available;
+    if (per_node == 0 || sched_getaffinity(0, sizeof(available), &available)) {
+        return false;
+    }
+    std::vector<int> cpus;
+    for (int c = 0; c < CPU_SETSIZE; ++c) {
+        if (CPU_ISSET(c, &available)) cpus.push_back(c);
+    }
+    CPU_ZERO(&set);
+    for (unsigned i = 0; i < per_node; ++i) {
+        CPU_SET(cpus[(index * per_node + i) % cpus.size()], &set);
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+static std::string node_log(const Arguments &args, unsigned index) {
+    return args.output_dir + "/node_" + std::to_string(index) + ".log";
+}
+
+//------------------------------------------------------------------------------
+// The child prints to its own log, pinned before exec
+//------------------------------------------------------------------------------
+static pid_t launch(const Arguments &args, unsigned index,
+                    const std::string &machines, unsigned per_node) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    int fd = open(node_log(args, index).c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                  0644);
+    if (fd < 0) {
+        perror("open");
+        _exit(126);
+    }
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+
+    cpu_set_t set;
+    if (node_cpus(index, per_node, set)) {
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    std::string port = std::to_string(args.port + index);
+    std::vector<const char *> argv = {args.binary.c_str(), "-m",
+                                      machines.c_str(), "-p", port.c_str()};
+    for (const auto &a : args.node_args) argv.push_back(a.c_str());
+    argv.push_back(nullptr);
+    execv(args.binary.c_str(), const_cast<char *const *>(argv.data()));
+    perror(args.binary.c_str());
+    _exit(127);
+}
+
+//------------------------------------------------------------------------------
+// SIGINT lets nodes say goodbye; those still there after the grace get killed
+//------------------------------------------------------------------------------
+static bool wait_all(std::vector<pid_t> &pids, unsigned timeout) {
+    typedef std::chrono::steady_clock Clock;
+    auto deadline = Clock::now() + std::chrono::seconds(timeout);
+    bool interrupted = false, killed = false, ok = true;
+    size_t running = pids.size();
+    while (running > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid > 0) {
+            auto it = std::find(pids.begin(), pids.end(), pid);
+            if (it == pids.end()) continue;
+            unsigned index = it - pids.begin();
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                std::cerr << "Node " << index << " failed ("
+                          << (WIFEXITED(status) ? WEXITSTATUS(status)
+                                                : 128 + WTERMSIG(status))
+                          << ")" << std::endl;
+                ok = false;
+            }
+            *it = 0;
+            --running;
+            continue;
+        }
+        if (timeout && !killed && Clock::now() > deadline) {
+            int sig = interrupted ? SIGKILL : SIGINT;
+            for (pid_t p : pids) {
+                if (p) kill(p, sig);
+            }
+            std::cerr << "Timeout: " << (interrupted ? "killed" : "interrupted")
+                      << " " << running << " node(s)" << std::endl;
+            killed = interrupted;
+            interrupted = true;
+            deadline = Clock::now() + std::chrono::seconds(GRACE_SECONDS);
+            ok = false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// Epoch lines of every node, ordered by epoch and then node. Lines are told by
+// their header: a process hosting several nodes (-j) starts them with a node
+// column, which then replaces the process index.
+//------------------------------------------------------------------------------
+static size_t merge_results(const Arguments &args) {
+    std::vector<std::tuple<int, unsigned, std::string>> rows;
+    std::string header;
+    for (unsigned i = 0; i < args.nodes; ++i) {
+        std::ifstream log(node_log(args, i));
+        std::string line;
+        size_t fields = 0;  // of the header of this log, 0: not seen yet
+        bool labelled = false;
+        while (std::getline(log, line)) {
+            size_t n = std::count(line.begin(), line.end(), ';') + 1;
+            if (line.compare(0, 6, "epoch;") == 0 ||
+                line.compare(0, 11, "node;epoch;") == 0) {
+                labelled = line[0] == 'n';
+                header = labelled ? line.substr(5) : line;
+                fields = n;
+            } else if (n == fields && isdigit(line[0])) {
+                unsigned node = i;
+                if (labelled) {
+                    node = std::atoi(line.c_str());
+                    line.erase(0, line.find(';') + 1);
+                }
+                rows.emplace_back(std::atoi(line.c_str()), node, line);
+            }
+        }
+    }
+    std::sort(rows.begin(), rows.end());
+
+    std::ofstream out(args.output_dir + "/results.csv");
+    out << "node;" << header << "\n";
+    for (const auto &r : rows) {
+        out << std::get<1>(r) << ";" << std::get<2>(r) << "\n";
+    }
+    return rows.size();
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char **argv) {
+    Arguments args;
+    struct argp argp = {options, parse_opt, args_doc, doc};
+    argp_parse(&argp, argc, argv, 0, 0, &args);
+    if (args.binary.empty()) args.binary = default_binary();
+    boost::filesystem::create_directories(args.output_dir);
+
+    char hostname[HOST_NAME_MAX];
+    gethostname(hostname, HOST_NAME_MAX);
+    std::string machines;
+    for (unsigned i = 0; i < args.nodes; ++i) {
+        machines += (i ? " " : "") + std::string(hostname) + ":" +
+                    std::to_string(args.port + i);
+    }
+
+    unsigned per_node = args.cores;
+    if (args.cores < 0) {
+        cpu_set_t available;
+        sched_getaffinity(0, sizeof(available), &available);
+        per_node = std::max(1u, unsigned(CPU_COUNT(&available)) / args.nodes);
+    }
+
+    std::cout << "Running " << args.nodes << " nodes: " << machines
+              << std::endl;
+    std::vector<pid_t> pids;
+    for (unsigned i = 0; i < args.nodes; ++i) {
+        pid_t pid = launch(args, i, machines, per_node);
+        if (pid < 0) {
+            perror("fork");
+            for (pid_t p : pids) kill(p, SIGKILL);
+            return 1;
+        }
+        pids.push_back(pid);
+    }
+    bool ok = wait_all(pids, args.timeout);
+
+    size_t rows = merge_results(args);
+    std::cout << rows << " epochs in " << args.output_dir << "/results.csv"
+              << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+//------------------------------------------------------------------------------
+// Unbounded queue, many producers and one consumer, without locks. Producers
+// swap themselves in as the newest node and then link the previous one to it;
+// the consumer walks from the oldest. A producer stopped between both steps
+// hides what comes after it until it resumes: pop then reports empty.
+//------------------------------------------------------------------------------
+template <typename T>
+class MpscQueue {
+   public:
+    MpscQueue() : head_(new Node()), tail_(head_.load()) {}
+
+    ~MpscQueue() {
+        T discard;
+        while (pop(discard)) {
+        }
+        delete tail_;
+    }
+
+    //--------------------------------------------------------------------------
+    void push(T &&value) {
+        Node *node = new Node(std::move(value));
+        Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    //--------------------------------------------------------------------------
+    bool pop(T &value) {  // consumer only
+        Node *next = tail_->next.load(std::memory_order_acquire);
+        if (next == nullptr) return false;
+        value = std::move(next->value);
+        delete tail_;
+        tail_ = next;  // becomes the stub
+        return true;
+    }
+
+   private:
+    struct Node {
+        Node() : next(nullptr) {}
+        explicit Node(T &&v) : value(std::move(v)), next(nullptr) {}
+        T value;
+        std::atomic<Node *> next;
+    };
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    std::atomic<Node *> head_;  // newest, producers
+    Node *tail_;                // stub before the oldest, consumer
+};
+
+//------------------------------------------------------------------------------
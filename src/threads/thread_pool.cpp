@@ -34,6 +34,12 @@ void ThreadPool::add_task(std::function<void()> t) {
     condition_.notify_one();
 }
 
+//------------------------------------------------------------------------------
+size_t ThreadPool::queued() {
+    std::unique_lock<std::mutex> lock(mutex_queue_);
+    return tasks_.size();
+}
+
 //------------------------------------------------------------------------------
 ThreadPool::~ThreadPool() {
     {
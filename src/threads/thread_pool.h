@@ -12,6 +12,7 @@ class ThreadPool {
     ~ThreadPool();
 
     void add_task(std::function<void()>);
+    size_t queued();  // tasks not started yet
 
    private:
     void worker();
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Serialization buffers kept with their capacity from one epoch to the next:
+// once the pool is warm, serializing a model does not allocate. Shared bytes
+// come back to the pool when their last reference goes away. At most max_free
+// buffers are kept, the largest ones. Must be owned by a shared_ptr.
+//------------------------------------------------------------------------------
+class BufferPool : public std::enable_shared_from_this<BufferPool> {
+   public:
+    typedef std::vector<uint8_t> Buffer;
+
+    explicit BufferPool(size_t max_free = 4) : max_free_(max_free) {}
+
+    //--------------------------------------------------------------------------
+    Buffer acquire() {  // empty
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (free_.empty()) return Buffer();
+        Buffer ret(std::move(free_.back()));
+        free_.pop_back();
+        return ret;
+    }
+
+    //--------------------------------------------------------------------------
+    void release(Buffer &&b) {
+        b.clear();
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (free_.size() < max_free_) {
+            free_.push_back(std::move(b));
+            return;
+        }
+        auto smallest = std::min_element(
+            free_.begin(), free_.end(), [](const Buffer &x, const Buffer &y) {
+                return x.capacity() < y.capacity();
+            });
+        if (smallest != free_.end() && smallest->capacity() < b.capacity()) {
+            *smallest = std::move(b);
+        }
+    }
+
+    //--------------------------------------------------------------------------
+    std::shared_ptr<const Buffer> share(Buffer &&b) {
+        std::shared_ptr<BufferPool> self = shared_from_this();
+        return std::shared_ptr<const Buffer>(
+            new Buffer(std::move(b)), [self](const Buffer *p) {
+                self->release(std::move(*const_cast<Buffer *>(p)));
+                delete p;
+            });
+    }
+
+   private:
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    std::mutex mtx_;
+    size_t max_free_;
+    std::vector<Buffer> free_;
+};
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Read-only window on bytes owned elsewhere: a zmq message, the buffer handed
+// to the enclave, a vector. Messages get parsed where they were received.
+//------------------------------------------------------------------------------
+class ByteView {
+   public:
+    ByteView() : data_(nullptr), size_(0) {}
+    ByteView(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+    ByteView(const char *data, size_t size)
+        : data_(reinterpret_cast<const uint8_t *>(data)), size_(size) {}
+    ByteView(const std::vector<uint8_t> &v) : data_(v.data()), size_(v.size()) {}
+    ByteView(const std::string &s)
+        : data_(reinterpret_cast<const uint8_t *>(s.data())), size_(s.size()) {}
+
+    const uint8_t *data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const uint8_t &operator[](size_t i) const { return data_[i]; }
+    const uint8_t *begin() const { return data_; }
+    const uint8_t *end() const { return data_ + size_; }
+    std::string str() const {
+        return std::string(reinterpret_cast<const char *>(data_), size_);
+    }
+
+   private:
+    const uint8_t *data_;
+    size_t size_;
+};
@@ -0,0 +1,216 @@
+#include "compression.h"
+
+#include <matrices/matrices_common.h>
+
+#include <algorithm>
+#include <cstring>
+
+//------------------------------------------------------------------------------
+// Frame: tag, varint size before compression, sequences. Serialized messages
+// start with their type, a small integer: the tag can not be taken for one.
+//------------------------------------------------------------------------------
+static const uint8_t kTag = 0xc0, kTagMask = 0xf0;
+static const size_t kMinPayload = 64, kHighUpTo = 256 << 10;
+// Sizes a peer may declare: in all, and per compressed byte (a match grows by
+// 255 bytes for each byte of its length)
+static const size_t kMaxSize = size_t(1) << 30, kMaxRatio = 256;
+
+// Sequence: token (literal length << 4 | match length - kMinMatch, 15 meaning
+// more follows in bytes of 255), literals, 2-byte offset, rest of the lengths
+static const size_t kMinMatch = 4, kWindow = 65535;
+static const unsigned kHashBits = 16;
+
+//------------------------------------------------------------------------------
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+//------------------------------------------------------------------------------
+static uint32_t hash(const uint8_t *p) {
+    return (read32(p) * 2654435761u) >> (32 - kHashBits);
+}
+
+//------------------------------------------------------------------------------
+static void append_length(size_t length, std::vector<uint8_t> &out) {
+    for (; length >= 255; length -= 255) out.push_back(255);
+    out.push_back(uint8_t(length));
+}
+
+//------------------------------------------------------------------------------
+static void emit(const uint8_t *literals, size_t nliterals, size_t offset,
+                 size_t match, std::vector<uint8_t> &out) {
+    size_t mcode = match ? match - kMinMatch : 0;
+    out.push_back(uint8_t(std::min<size_t>(nliterals, 15) << 4 |
+                          std::min<size_t>(mcode, 15)));
+    if (nliterals >= 15) append_length(nliterals - 15, out);
+    out.insert(out.end(), literals, literals + nliterals);
+    if (!match) return;  // last sequence
+    out.push_back(uint8_t(offset));
+    out.push_back(uint8_t(offset >> 8));
+    if (mcode >= 15) append_length(mcode - 15, out);
+}
+
+//------------------------------------------------------------------------------
+static size_t match_length(const uint8_t *a, const uint8_t *b,
+                           const uint8_t *end) {
+    const uint8_t *start = b;
+    while (b < end && *a == *b) ++a, ++b;
+    return b - start;
+}
+
+//------------------------------------------------------------------------------
+// Hash chains: head_ of the newest position per hash, previous of older ones.
+// depth bounds how many candidates are looked at.
+//------------------------------------------------------------------------------
+void Compression::lz_compress(const std::vector<uint8_t> &in, unsigned depth,
+                              bool lazy, std::vector<uint8_t> &out) {
+    const uint8_t *base = in.data(), *end = base + in.size();
+    std::vector<int32_t> head(1 << kHashBits, -1), previous(in.size(), -1);
+
+    auto insert = [&](size_t pos) {
+        uint32_t h = hash(base + pos);
+        previous[pos] = head[h];
+        head[h] = pos;
+    };
+    auto find = [&](size_t pos, size_t &offset) {
+        size_t best = 0;
+        unsigned tries = depth;
+        for (int32_t c = head[hash(base + pos)];
+             c >= 0 && pos - c <= kWindow && tries--; c = previous[c]) {
+            if (read32(base + c) != read32(base + pos)) continue;
+            size_t length = match_length(base + c, base + pos, end);
+            if (length > best) {
+                best = length;
+                offset = pos - c;
+            }
+        }
+        return best;
+    };
+
+    size_t anchor = 0, pos = 0, last = in.size() >= kMinMatch
+                                             ? in.size() - kMinMatch
+                                             : 0;
+    while (pos < last) {
+        size_t offset = 0, length = find(pos, offset);
+        if (length < kMinMatch) {
+            insert(pos++);
+            continue;
+        }
+        if (lazy) {  // a longer match one byte later is worth a literal
+            insert(pos);
+            size_t next_offset = 0,
+                   next = pos + 1 < last ? find(pos + 1, next_offset) : 0;
+            if (next > length) {
+                ++pos;
+                continue;
+            }
+        }
+
+        emit(base + anchor, pos - anchor, offset, length, out);
+        size_t stop = std::min(pos + length, last);
+        if (depth > 1) {  // every position may serve a later match
+            for (size_t p = lazy ? pos + 1 : pos; p < stop; ++p) insert(p);
+        } else {
+            insert(pos);
+        }
+        pos += length;
+        anchor = pos;
+    }
+    if (anchor < in.size()) {
+        emit(base + anchor, in.size() - anchor, 0, 0, out);
+    }
+}
+
+//------------------------------------------------------------------------------
+std::vector<uint8_t> Compression::compress(std::vector<uint8_t> &&data,
+                                           Codec codec) {
+    std::vector<uint8_t> ret;
+    if (!compress(data, codec, ret)) return std::move(data);
+    return ret;
+}
+
+//------------------------------------------------------------------------------
+bool Compression::compress(const std::vector<uint8_t> &data, Codec codec,
+                           std::vector<uint8_t> &out) {
+    if (codec == AUTO) {
+        codec = data.size() < kMinPayload
+                    ? NONE
+                    : (data.size() <= kHighUpTo ? HIGH : FAST);
+    }
+    if (codec == NONE || data.empty()) return false;
+
+    out.clear();
+    out.reserve(data.size());
+    out.push_back(kTag | codec);
+    varint_append(data.size(), out);
+    lz_compress(data, codec == HIGH ? 64 : 1, codec == HIGH, out);
+    return out.size() < data.size();
+}
+
+//------------------------------------------------------------------------------
+bool Compression::compressed(ByteView data) {
+    return !data.empty() && (data[0] & kTagMask) == kTag;
+}
+
+//------------------------------------------------------------------------------
+static bool read_length(ByteView in, size_t &offset, size_t &length) {
+    uint8_t byte;
+    do {
+        if (offset >= in.size()) return false;
+        byte = in[offset++];
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Nothing is reserved, nor written, past what the payload could hold
+//------------------------------------------------------------------------------
+std::vector<uint8_t> Compression::decompress(ByteView in) {
+    size_t offset = 1, size = varint_read(in, offset);
+    std::vector<uint8_t> out;
+    bool corrupt = size > kMaxSize || size / kMaxRatio > in.size();
+    if (!corrupt) out.reserve(size);
+    while (offset < in.size() && !corrupt) {
+        uint8_t token = in[offset++];
+        size_t nliterals = token >> 4;
+        if ((nliterals == 15 && !read_length(in, offset, nliterals)) ||
+            nliterals > in.size() - offset || nliterals > size - out.size()) {
+            corrupt = true;
+            break;
+        }
+        out.insert(out.end(), in.data() + offset, in.data() + offset + nliterals);
+        offset += nliterals;
+        if (offset == in.size()) break;  // last sequence
+
+        if (offset + 2 > in.size()) {
+            corrupt = true;
+            break;
+        }
+        size_t distance = in[offset] | size_t(in[offset + 1]) << 8;
+        offset += 2;
+        size_t length = token & 15;
+        if (length == 15 && !read_length(in, offset, length)) {
+            corrupt = true;
+            break;
+        }
+        length += kMinMatch;
+        if (distance == 0 || distance > out.size() ||
+            length > size - out.size()) {
+            corrupt = true;
+            break;
+        }
+        for (size_t from = out.size() - distance; length--; ++from) {
+            out.push_back(out[from]);  // may overlap what it appends
+        }
+    }
+    if (corrupt || out.size() != size) {
+        std::cerr << "Corrupt compressed payload" << std::endl;
+        abort();
+    }
+    return out;
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <utils/byte_view.h>
+
+//------------------------------------------------------------------------------
+// Compression of serialized messages, before they get encrypted. LZ77 with
+// byte-aligned sequences, self-contained so that it also runs in the enclave.
+// FAST takes the first match its hash table offers; HIGH searches hash chains
+// and defers matches when the next one is longer. Both decode the same way.
+// AUTO picks by payload size. Payloads that do not shrink go out as they are.
+//------------------------------------------------------------------------------
+class Compression {
+   public:
+    enum Codec : uint8_t { NONE, FAST, HIGH, AUTO };
+
+    static std::vector<uint8_t> compress(std::vector<uint8_t> &&data,
+                                         Codec codec);
+    // Into a caller's buffer: false, and out unspecified, if data stays as is
+    static bool compress(const std::vector<uint8_t> &data, Codec codec,
+                         std::vector<uint8_t> &out);
+    static bool compressed(ByteView data);
+    static std::vector<uint8_t> decompress(ByteView data);
+
+    //--------------------------------------------------------------------------
+    static Codec parse(const std::string &name) {
+        if (name == "none") return NONE;
+        if (name == "fast") return FAST;
+        if (name == "high") return HIGH;
+        if (name == "auto") return AUTO;
+        std::cerr << "Unknown compression '" << name
+                  << "'. Options: none, fast, high, auto" << std::endl;
+        abort();
+    }
+
+   private:
+    static void lz_compress(const std::vector<uint8_t> &in, unsigned depth,
+                            bool lazy, std::vector<uint8_t> &out);
+};